@@ -50,16 +50,36 @@ struct lpage;
 void mmu_setas(struct addrspace *as);
 void mmu_unmap(struct addrspace *as, vaddr_t va);
 void mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable);
+void mmu_invalidate_page(paddr_t pa);
+void mmu_writeprotect(struct addrspace *as);
+void mmu_map_zero(struct addrspace *as, vaddr_t va);
+void mmu_unmap_zero(struct addrspace *as);
+
+/* TLB refill from the page table, without the fault path */
+bool mmu_refill(struct addrspace *as, int faulttype, vaddr_t va);
 
 /* physical page allocation */
 paddr_t coremap_allocuser(struct lpage *lp);
 void coremap_free(paddr_t page, bool iskern);
 
+/* number of physical pages the coremap manages */
+unsigned coremap_npages(void);
+
+/* resident set accounting: drop the charges of a dying address space */
+void coremap_disown(struct addrspace *as);
+
+/* load control: evict all of an address space's pages that we can */
+unsigned coremap_evictas(struct addrspace *as);
+
 /* physical page pinning */
 void coremap_pin(paddr_t paddr);
 int coremap_pageispinned(paddr_t paddr);
 void coremap_unpin(paddr_t paddr);
 
+/* page replacement policy ("random", "sequential", or "clock") */
+int coremap_set_replacement(const char *name);
+const char *coremap_get_replacement(void);
+
 /* special ops on physical pages */
 void coremap_zero_page(paddr_t paddr);
 void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
@@ -84,6 +104,7 @@ void coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr);
  * Coremap functions whose existence is machine-dependent.
  */
 void coremap_bootstrap(void);
+void coremap_pageout_bootstrap(void);
 void coremap_print_short(void);
 void coremap_print_long(void);
 
@@ -30,6 +30,8 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <platform/maxcpus.h>
+#include <spinlock.h>
 
 /*
  * Machine-dependent VM system definitions.
@@ -110,34 +112,109 @@ void ram_getsize(paddr_t *lo, paddr_t *hi);
 
 /*
  * Machine-dependent per-CPU data
+ *
+ * Each CPU keeps a small stack of free pages (coremap indexes) that
+ * user page allocations and frees use without going to the coremap.
+ * It's refilled and drained PCACHE_BATCH pages at a time; see
+ * coremap.c.
+ *
+ * cvm_tlbcount has a count for each coremap entry of how many of this
+ * CPU's TLB entries map that page, so a page can be in any number of
+ * TLB entries and we can still find them all to shoot them down.
+ *
+ * The TLB and the fields that describe it are changed only by their
+ * own CPU, holding cvm_tlblock, so that the TLB refill path needs no
+ * other lock. cvm_lastas and cvm_curasid are changed holding both
+ * coremap_spinlock and cvm_tlblock, and can be read with either.
  */
 
+#define PCACHE_MAX	16
+#define PCACHE_BATCH	8
+
 struct cpu_vm_machdep {
 	/* last address space loaded into MMU */
 	struct addrspace *cvm_lastas;
 
+	/* ASID currently loaded in the MMU (0 for none) */
+	uint32_t cvm_curasid;
+	/* next ASID to hand out, and the current ASID generation */
+	uint32_t cvm_nextasid;
+	uint32_t cvm_asidgen;
+	/* ASIDs retired this generation with entries left (bit per ASID) */
+	uint64_t cvm_deadasids;
+
+	/* TLB lock; protects the TLB itself and the fields below */
+	struct spinlock cvm_tlblock;
 	/* if < NUM_TLB, next TLB entry to use (when TLB not yet full) */
 	uint32_t cvm_nexttlb;
 	/* for OPT_SEQTLB, next TLB entry to use (after TLB full) */
 	uint32_t cvm_tlbseqslot;
+	/* TLB entries mapping each page (indexed by coremap entry) */
+	uint8_t *cvm_tlbcount;
+	/* TLB misses handled by mmu_refill */
+	uint32_t cvm_fastrefills;
+
+	/* free page cache, and allocations it could and couldn't serve */
+	struct spinlock cvm_pcache_lock;
+	unsigned cvm_pcache_count;
+	uint32_t cvm_pcache[PCACHE_MAX];
+	uint32_t cvm_pcache_hits;
+	uint32_t cvm_pcache_misses;
 };
 
 void cpu_vm_machdep_init(struct cpu_vm_machdep *cvm);
 void cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm);
 
+/*
+ * Machine-dependent per-address-space data
+ *
+ * The ASID an address space holds on each CPU, or'd with the ASID
+ * generation on that CPU it was handed out in. When a CPU runs out of
+ * ASIDs it flushes its TLB and starts a new generation, which makes
+ * all the ASIDs handed out before stale.
+ *
+ * am_zeromapped is set if the address space may have TLB entries for
+ * the zero page, which the coremap doesn't keep track of.
+ *
+ * am_cpumask has a bit for each CPU the address space has been
+ * activated on, and so may have TLB entries on.
+ *
+ * am_pagetable is a two-level page table of the TLB entries (EntryLo
+ * values) mmu_map has made for the address space, so a TLB miss on a
+ * page that's still resident can be refilled without going through
+ * the fault path (mmu_refill). The directory has PT_NDIR pointers to
+ * tables of PT_NPTES entries, each covering 4M of user space; both
+ * levels are allocated as needed, so they're NULL until then. An
+ * entry of 0 is a true miss. See coremap.c for how entries are kept
+ * in step with the coremap.
+ */
+
+#define PT_PTESHIFT	12
+#define PT_DIRSHIFT	22
+#define PT_NPTES	(1 << (PT_DIRSHIFT - PT_PTESHIFT))
+#define PT_NDIR		(USERSPACETOP >> PT_DIRSHIFT)
+
+struct addrspace_machdep {
+	uint32_t am_asid[MAXCPUS];
+	uint32_t am_cpumask;
+	bool am_zeromapped;
+	uint32_t **am_pagetable;
+};
+
+void addrspace_machdep_init(struct addrspace_machdep *am);
+void addrspace_machdep_cleanup(struct addrspace_machdep *am);
+
 /*
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
  *
- * Note that because IPI delivery isn't instantaneous, we may
- * sometimes end up flushing out a translation other than the one
- * someone wanted gone, unless we check that the coremap index
- * matches.
+ * A request names a physical page, by coremap index, and the target
+ * drops all its TLB entries for that page. Because IPI delivery isn't
+ * instantaneous, they may be gone by then; that's fine.
  */
 
 struct tlbshootdown {
-	int ts_tlbix;
 	unsigned ts_coremapindex;
 };
 
@@ -37,6 +37,7 @@
 #include <syscall.h>
 #include <kern/wait.h> /* New include of wait macros for _exit */
 #include <copyinout.h> /* A3 SETUP - new include for lseek */
+#include "opt-dumbvm.h"
 /*
  * System call dispatcher.
  *
@@ -89,6 +90,10 @@ syscall(struct trapframe *tf)
 	off_t pos;
 	off_t retval64 = 0;
 	/* END A3 SETUP */
+#if !OPT_DUMBVM
+	/* mmap has 6 arguments; the last two come off the stack. */
+	int mmapfd;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -194,6 +199,31 @@ syscall(struct trapframe *tf)
 		break;
 	    
 	    /* END A3 SETUP */
+
+#if !OPT_DUMBVM
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+		break;
+	    case SYS_mmap:
+		err = copyin((userptr_t)(tf->tf_sp+16), &mmapfd, sizeof(int));
+		if (err) {
+			break;
+		}
+		/* 64-bit, so aligned: sp+24, not sp+20 */
+		err = copyin((userptr_t)(tf->tf_sp+24), &pos, sizeof(off_t));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2,
+			       tf->tf_a3, mmapfd, pos, &retval);
+		break;
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+	    case SYS_msync:
+		err = sys_msync((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+		break;
+#endif
  
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -33,6 +33,8 @@
 #include <kern/unistd.h>
 #include <lib.h>
 #include <uio.h>
+#include <clock.h>
+#include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <cpu.h>
@@ -62,6 +64,11 @@
  * We have one coremap_entry per page of physical RAM. This is absolute
  * overhead, so it's important to keep it small - if it's overweight
  * adding more memory won't help.
+ *
+ * Which TLB entries map a page isn't in the coremap entry: a page can
+ * be in any number of them, on any number of CPUs (a shared page is
+ * mapped by every address space using it), so each CPU counts its own
+ * (cvm_tlbcount; see "TLB entry tracking" below).
  */
 
 
@@ -71,21 +78,59 @@
  */
 #define CM_MIN_SLACK		8
 
+/*
+ * The pageout daemon wakes up when free pages drop below the low
+ * watermark and evicts until they reach the high watermark. The low
+ * watermark is CM_MIN_SLACK plus 1/CM_LOWATER_FRACTION of memory; the
+ * high watermark is twice that. Every SWAP_CLUSTER_MAX evictions, and
+ * when it's done, it writes out a cluster of dirty pages ahead of the
+ * clock hand in one I/O, so that evictions mostly find clean pages.
+ */
+#define CM_LOWATER_FRACTION	64
+
+/*
+ * The pageout daemon picks this many victims at a time, so their TLB
+ * shootdowns can all be sent together.
+ */
+#define PAGEOUT_BATCH		8
+
+/*
+ * Compaction. When there's plenty of free memory but no free block of
+ * at least COMPACT_ORDER (so a multipage kernel allocation of that
+ * size would have to evict), the compaction daemon picks the aligned
+ * block of that size with the fewest user pages in it and migrates
+ * them to free pages elsewhere. It doesn't run when free memory is
+ * near the pageout daemon's low watermark, since then there's nowhere
+ * to migrate to; and if it can't find a block to clear it waits
+ * COMPACT_BACKOFF seconds before looking again.
+ */
+#define COMPACT_ORDER		4	/* 16 pages (64k) */
+#define COMPACT_BACKOFF		1
+
 
 /*
  * Coremap entry structure.
  */
 
+struct pt_rmap {
+	uint32_t *rm_pte;	/* page table entry */
+	struct pt_rmap *rm_next;
+};
+
 struct coremap_entry {
 	struct lpage *cm_lpage;	/* logical page we hold, or NULL */
-
-	volatile
-	int cm_tlbix:7;		/* tlb index number, or -1 */
-	unsigned cm_cpunum:5;	/* cpu number for cm_tlbix */
+	struct addrspace *cm_owner; /* charged to; see coremap_rsslock */
+	uint32_t cm_rssnext;	/* owner's resident list, if cm_owner */
+	uint32_t cm_rssprev;
+	uint32_t *cm_pte;	/* page table entry mapping us, or NULL */
+	struct pt_rmap *cm_rmap; /* more of them, if cm_pte isn't NULL */
 
 	unsigned cm_kernel:1,	/* true if kernel page */
 		cm_notlast:1,	/* true not last in sequence of kernel pages */
-		cm_allocated:1;	/* true if page in use (user or kernel) */
+		cm_allocated:1,	/* true if page in use (user or kernel) */
+		cm_referenced:1, /* true if mapped since last clock sweep */
+		cm_freehead:1,	/* true if first page of a free buddy block */
+		cm_order:4;	/* buddy block order, if cm_freehead */
 	volatile 
 	unsigned cm_pinned:1;	/* true if page is busy */
 };
@@ -100,6 +145,23 @@ struct coremap_entry {
 
 static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Resident set accounting. Each user page is charged to the address
+ * space that allocated it (cm_owner), which counts it in as_rss.
+ * The pages charged to each address space are also kept on a
+ * circular list through cm_rssnext/cm_rssprev, with as_rsshand
+ * pointing into it (the list is empty when as_rss is 0), so local
+ * replacement only has to look at that address space's own pages.
+ * cm_owner, the list links, as_rss and as_rsshand are protected by
+ * coremap_rsslock, a leaf lock (it may be taken with coremap_spinlock
+ * held), rather than coremap_spinlock, because the per-CPU page caches
+ * charge and uncharge pages without the latter. coremap_disown drops
+ * an address space's charges under it before the address space is
+ * freed, so once a page's charge is dropped nobody can be left holding
+ * a pointer to a dead address space.
+ */
+static struct spinlock coremap_rsslock = SPINLOCK_INITIALIZER;
+
 /*
  * Use one wchan for all page-pin waiting. There shouldn't be that
  * much of it or very many threads at once. Also use one wchan for all
@@ -109,16 +171,158 @@ static struct spinlock coremap_spinlock = SPINLOCK_INITIALIZER;
 static struct wchan *coremap_pinchan;
 static struct wchan *coremap_shootchan;
 
+/*
+ * TLB shootdowns. Requests for another CPU's TLB collect in
+ * shoot_pending until tlb_shootdown_flush sends them, one interrupt
+ * per CPU for however many there are, so the sender can go on to
+ * something else (such as the next victim) meanwhile. Waiting for a
+ * page to be shot down means waiting on coremap_shootchan for the
+ * TLB counts of the CPUs that had it to reach zero.
+ */
+static struct tlbshootdown shoot_pending[MAXCPUS][TLBSHOOTDOWN_MAX];
+static unsigned shoot_npending[MAXCPUS];
+
 static uint32_t num_coremap_entries;
 static uint32_t num_coremap_kernel;	/* pages allocated to the kernel */
-static uint32_t num_coremap_user;	/* pages allocated to user progs */
+static uint32_t num_coremap_user;	/* pages allocated to user progs,
+					   or in a per-CPU page cache */
 static uint32_t num_coremap_free;	/* pages not allocated at all */
 static uint32_t base_coremap_page;
+
+/*
+ * The zero page: a kernel page of zeros that read faults on untouched
+ * zero-fill pages map read-only (see mmu_map_zero). It can be in any
+ * number of TLB entries at once, so unlike every other page its TLB
+ * entries aren't tracked in the coremap.
+ */
+static paddr_t zero_paddr;
 static struct coremap_entry *coremap;
 
-static volatile uint32_t ct_shootdowns_sent;
+/*
+ * Free page index: a two-level bitmap. freemap has one bit per coremap
+ * entry, set iff the page is neither allocated nor pinned (that is,
+ * coremap_alloc_one_page could take it). freemap_summary has one bit
+ * per freemap word, set iff that word is nonzero. Finding a free page
+ * is then a find-last-set in the summary and one in a freemap word;
+ * the summary is a handful of words for any RAM size System/161
+ * supports (one word covers 4M). Updated by freemap_update() whenever
+ * cm_allocated or cm_pinned changes.
+ */
+static uint32_t *freemap;
+static uint32_t *freemap_summary;
+static uint32_t freemap_summarywords;
+
+/*
+ * Buddy free lists, for finding contiguous runs of free pages for
+ * multipage kernel allocations. Every page that is not allocated
+ * (pinned or not) is in exactly one free block: 2^order pages,
+ * aligned to its size in coremap index space. The block's first page
+ * is marked cm_freehead and holds a struct buddy_block linking it into
+ * the list for its order; free pages aren't otherwise in use, so this
+ * costs no extra memory.
+ */
+#define BUDDY_NORDERS	11		/* up to 1024 pages (4M) per block */
+
+struct buddy_block {
+	struct buddy_block *bb_next;
+	struct buddy_block *bb_prev;
+};
+
+static struct buddy_block *buddy_lists[BUDDY_NORDERS];
+static uint32_t buddy_counts[BUDDY_NORDERS];
+
+/*
+ * Page replacement policy; see page_replace().
+ */
+#define PR_RANDOM	0
+#define PR_SEQUENTIAL	1
+#define PR_CLOCK	2
+
+static const char *const replacement_names[] = {
+	"random",
+	"sequential",
+	"clock",
+};
+
+#if OPT_RANDPAGE
+static unsigned replacement_policy = PR_RANDOM;
+#else
+static unsigned replacement_policy = PR_CLOCK;
+#endif
+
+/* Next coremap index looked at by sequential and clock replacement. */
+static uint32_t replace_hand;
+
+/* Pageout daemon */
+static struct wchan *pageout_chan;
+static uint32_t pageout_lowater;
+static uint32_t pageout_hiwater;
+
+/* Compaction daemon */
+static struct wchan *compact_chan;
+
+/* Whether mmu_refill uses the page tables (for benchmarking) */
+static bool mmu_fastrefill = true;
+
+static volatile uint32_t ct_shootdowns_sent;	/* interrupts sent */
+static volatile uint32_t ct_shootdowns_coalesced; /* rode along with others */
+static volatile uint32_t ct_shootdowns_avoided;	/* gone before we sent */
 static volatile uint32_t ct_shootdowns_done;
 static volatile uint32_t ct_shootdown_interrupts;
+static volatile uint32_t ct_tlb_refills;
+static volatile uint32_t ct_tlb_flushes;
+static volatile uint32_t ct_asid_allocs;
+static volatile uint32_t ct_asid_rollovers;
+static volatile uint32_t ct_tlb_purged;		/* under retired ASIDs */
+static volatile uint32_t ct_zero_unmaps;
+static volatile uint32_t ct_clock_refskips;	/* referenced, or in a TLB */
+static volatile uint32_t ct_clock_tlbdrops;	/* TLB entries dropped */
+static volatile uint32_t ct_clock_dirtyskips;
+static volatile uint32_t ct_clock_busyskips;	/* pinned, kernel, or free */
+static volatile uint32_t ct_clock_cleanvictims;
+static volatile uint32_t ct_clock_dirtyvictims;
+static volatile uint32_t ct_buddy_allocs;	/* multipage, from free lists */
+static volatile uint32_t ct_buddy_moveallocs;	/* multipage, by moving pages */
+static volatile uint32_t ct_pageout_wakeups;
+static volatile uint32_t ct_pageout_evicted;
+static volatile uint32_t ct_pageout_cleaned;
+static volatile uint32_t ct_sync_evictions;	/* by faulting threads */
+static volatile uint32_t ct_compact_migrated;	/* pages moved */
+static volatile uint32_t ct_compact_evicted;	/* pages evicted for room */
+static volatile uint32_t ct_compact_wakeups;
+static volatile uint32_t ct_compact_blocks;	/* blocks cleared by daemon */
+static volatile uint32_t ct_rss_evictions;	/* local, for RSS limits */
+
+/*
+ * Per-CPU VM data (struct cpu_vm_machdep), listed here so we can find
+ * it all: to take back the pages in the free page caches, to look at
+ * other CPUs' TLB counts, and for stats. CPUs are listed in the order
+ * they're created, so vm_cpus[n] is CPU n's.
+ *
+ * A page in a free page cache is allocated and pinned as far as the rest of the
+ * coremap is concerned, and counted as a user page, but has no lpage;
+ * so nobody else touches it. Taking one out or putting one back then
+ * only involves the cache's own lock (cvm_pcache_lock) and cm_lpage.
+ * Pages move between the caches and the coremap PCACHE_BATCH at a
+ * time, holding coremap_spinlock then the cache lock; never the other
+ * way around.
+ */
+static struct cpu_vm_machdep *vm_cpus[MAXCPUS];
+static unsigned vm_ncpus;
+
+/*
+ * Spare page table reverse map entries (see "Page tables" below), so
+ * pt_set, which can't allocate, has one to hand. Protected by
+ * coremap_spinlock.
+ */
+static struct pt_rmap *pt_rmapfree;
+static unsigned pt_nrmapfree;
+#define PT_RMAP_SPARE	32	/* give back spares beyond this many */
+
+/* For computing rates in vm_printmdstats. */
+static time_t lastreport_secs;
+static uint32_t lastreport_nsecs;
+static uint32_t lastreport_refills;
 
 ////////////////////////////////////////////////////////////
 //
@@ -128,262 +332,1703 @@ void
 cpu_vm_machdep_init(struct cpu_vm_machdep *cvm)
 {
 	cvm->cvm_lastas = NULL;
+	cvm->cvm_curasid = 0;
+	cvm->cvm_nextasid = 1;
+	cvm->cvm_asidgen = NUM_ASID;
+	cvm->cvm_deadasids = 0;
+
+	spinlock_init(&cvm->cvm_tlblock);
 	cvm->cvm_nexttlb = 0;
 	cvm->cvm_tlbseqslot = 0;
+	/* (all CPUs are created after vm_bootstrap) */
+	cvm->cvm_tlbcount = kmalloc(num_coremap_entries);
+	if (cvm->cvm_tlbcount == NULL) {
+		panic("cpu_vm_machdep_init: Out of memory\n");
+	}
+	bzero(cvm->cvm_tlbcount, num_coremap_entries);
+	cvm->cvm_fastrefills = 0;
+
+	spinlock_init(&cvm->cvm_pcache_lock);
+	cvm->cvm_pcache_count = 0;
+	cvm->cvm_pcache_hits = 0;
+	cvm->cvm_pcache_misses = 0;
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(vm_ncpus < MAXCPUS);
+	vm_cpus[vm_ncpus++] = cvm;
+	spinlock_release(&coremap_spinlock);
 }
 
 void
 cpu_vm_machdep_cleanup(struct cpu_vm_machdep *cvm)
 {
-	(void)cvm;
-	/* nothing */
+	/* CPUs never go away, so we don't bother unlisting it */
+	KASSERT(cvm->cvm_pcache_count == 0);
+	spinlock_cleanup(&cvm->cvm_pcache_lock);
+	spinlock_cleanup(&cvm->cvm_tlblock);
 }
 
 ////////////////////////////////////////////////////////////
 //
-// Stats
+// Per-addrspace data
 
 void
-vm_printmdstats(void)
+addrspace_machdep_init(struct addrspace_machdep *am)
 {
-	uint32_t ss, sd, si;
-
-	spinlock_acquire(&coremap_spinlock);
-	ss = ct_shootdowns_sent;
-	sd = ct_shootdowns_done;
-	si = ct_shootdown_interrupts;
-	spinlock_release(&coremap_spinlock);
+	unsigned i;
 
-	kprintf("vm: shootdowns: %lu sent, %lu done (%lu interrupts)\n",
-		(unsigned long) ss, (unsigned long) sd, (unsigned long) si);
+	/* generation 0 is never current, so these are all stale */
+	for (i=0; i<MAXCPUS; i++) {
+		am->am_asid[i] = 0;
+	}
+	am->am_cpumask = 0;
+	am->am_zeromapped = false;
+	am->am_pagetable = NULL;
 }
 
-////////////////////////////////////////////////////////////
-//
-// TLB handling
-
 /*
- * tlb_replace - TLB replacement algorithm. Returns index of TLB entry
- * to replace.
+ * tlb_retire: make the ASID AM holds on CPU stale, which retires all
+ * the TLB entries it has there at once. The entries stay in that TLB
+ * until they're replaced, still counted in cvm_tlbcount, where they'd
+ * make their pages look in use to the clock and draw shootdowns; so
+ * the ASID also goes in the CPU's cvm_deadasids, and the CPU drops
+ * them the next time it switches address spaces (tlb_purgedead). An
+ * ASID from an earlier generation has no entries left to drop, since
+ * starting a generation flushes the TLB.
  *
  * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 static
-uint32_t 
-tlb_replace(void) 
+void
+tlb_retire(struct addrspace_machdep *am, unsigned cpu)
 {
+	struct cpu_vm_machdep *cvm;
+	uint32_t tag;
+
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(cpu < vm_ncpus);
 
-#if OPT_RANDTLB
-	/* random */
-	return random() % NUM_TLB;
-#else
-	/* sequential */
-	uint32_t slot = curcpu->c_vm.cvm_tlbseqslot;
-	curcpu->c_vm.cvm_tlbseqslot = (slot + 1) % NUM_TLB;
-	return slot;
-#endif
+	cvm = vm_cpus[cpu];
+	tag = am->am_asid[cpu];
+	if ((tag & ~(uint32_t)(NUM_ASID-1)) == cvm->cvm_asidgen) {
+		cvm->cvm_deadasids |= (uint64_t)1 << (tag & (NUM_ASID-1));
+	}
+	am->am_asid[cpu] = 0;
 }
 
 /*
- * tlb_invalidate: marks a given tlb entry as invalid.
+ * Page tables.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * A page table entry is a copy of the TLB entry mmu_map loaded for a
+ * page, and the page's coremap entry points back at every page table
+ * entry it's in: the first in cm_pte, any others in the cm_rmap list.
+ * A page is in more than one when it's shared: read-only, e.g. text
+ * pages of a program several processes are running or pages shared
+ * copy-on-write after a fork, or a page of a shared object that
+ * several address spaces have mapped.
+ * Whenever a page is taken out of the TLB for good (eviction,
+ * migration, write-protecting it for copy-on-write; see
+ * coremap_unmap_tlb_start), freed, or cleaned, all its entries are
+ * cleared too, so mmu_refill can never bring back a translation the
+ * coremap has revoked, or a writable one for a page that's been
+ * cleaned.
+ *
+ * Entries, cm_pte and cm_rmap are changed only under coremap_spinlock.
+ * mmu_refill reads entries without it; see there for why that's safe.
+ * The directory is only changed by the address space's own thread (in
+ * mmu_map), and freed once the address space is dead.
  */
+
 static
-void
-tlb_invalidate(int tlbix)
+uint32_t *
+pt_lookup(struct addrspace_machdep *am, vaddr_t va)
 {
-	uint32_t elo, ehi;
-	paddr_t pa;
-	unsigned cmix;
+	uint32_t *pt;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(va < USERSPACETOP);
 
-	tlb_read(&ehi, &elo, tlbix);
-	if (elo & TLBLO_VALID) {
-		pa = elo & TLBLO_PPAGE;
-		cmix = PADDR_TO_COREMAP(pa);
-		KASSERT(cmix < num_coremap_entries);
-		KASSERT(coremap[cmix].cm_tlbix == tlbix);
-		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
-		coremap[cmix].cm_tlbix = -1;
-		coremap[cmix].cm_cpunum = 0;
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-			(unsigned long) COREMAP_TO_PADDR(cmix));
+	if (am->am_pagetable == NULL) {
+		return NULL;
 	}
-
-	tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
-	DEBUG(DB_TLB, "... pa ------- <-- tlb %d\n", tlbix);
+	pt = am->am_pagetable[va >> PT_DIRSHIFT];
+	if (pt == NULL) {
+		return NULL;
+	}
+	return &pt[(va >> PT_PTESHIFT) & (PT_NPTES - 1)];
 }
 
 /*
- * tlb_clear: flushes the TLB by loading it with invalid entries.
+ * Make sure AM has a page table entry for VA, and that there's a spare
+ * reverse map entry in case the page it gets is shared. If we're out
+ * of memory we don't; VA just doesn't get refilled by mmu_refill.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * Synchronization: takes coremap_spinlock briefly, to get at the
+ * spares. May block in kmalloc.
  */
 static
 void
-tlb_clear(void)
+pt_prepare(struct addrspace_machdep *am, vaddr_t va)
 {
-	int i;	
+	uint32_t **dir, *pt;
+	struct pt_rmap *rm;
+	unsigned ix;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_invalidate(i);
-	}
-	curcpu->c_vm.cvm_nexttlb = 0;
-}
+	ix = va >> PT_DIRSHIFT;
+	KASSERT(ix < PT_NDIR);
 
-/*
- * Do one TLB shootdown.
- */
-void
-vm_tlbshootdown(const struct tlbshootdown *ts, int num)
-{
-	int i;
-	int tlbix;
-	unsigned where;
+	if (am->am_pagetable == NULL) {
+		dir = kmalloc(PT_NDIR * sizeof(uint32_t *));
+		if (dir == NULL) {
+			return;
+		}
+		bzero(dir, PT_NDIR * sizeof(uint32_t *));
+		am->am_pagetable = dir;
+	}
+	if (am->am_pagetable[ix] == NULL) {
+		pt = kmalloc(PT_NPTES * sizeof(uint32_t));
+		if (pt == NULL) {
+			return;
+		}
+		bzero(pt, PT_NPTES * sizeof(uint32_t));
+		am->am_pagetable[ix] = pt;
+	}
 
-	spinlock_acquire(&coremap_spinlock);
-	ct_shootdown_interrupts++;
-	for (i=0; i<num; i++) {
-		tlbix = ts[i].ts_tlbix;
-		where = ts[i].ts_coremapindex;
-		if (coremap[where].cm_tlbix == tlbix &&
-		    coremap[where].cm_cpunum == curcpu->c_number) {
-			tlb_invalidate(tlbix);
-			ct_shootdowns_done++;
+	/* (just a hint without the lock; off by one doesn't matter) */
+	if (pt_nrmapfree == 0) {
+		rm = kmalloc(sizeof(*rm));
+		if (rm == NULL) {
+			return;
+		}
+		spinlock_acquire(&coremap_spinlock);
+		rm->rm_next = pt_rmapfree;
+		pt_rmapfree = rm;
+		pt_nrmapfree++;
+		spinlock_release(&coremap_spinlock);
+	}
+	else if (pt_nrmapfree > PT_RMAP_SPARE) {
+		/* lots were freed at once (a big exit); give some back */
+		spinlock_acquire(&coremap_spinlock);
+		rm = pt_rmapfree;
+		if (rm != NULL) {
+			pt_rmapfree = rm->rm_next;
+			pt_nrmapfree--;
 		}
+		spinlock_release(&coremap_spinlock);
+		kfree(rm);
 	}
-	wchan_wakeall(coremap_shootchan);
-	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * Shoot down everything.
+ * Put a reverse map entry back on the spares list.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
+static
 void
-vm_tlbshootdown_all(void)
+pt_rmap_free(struct pt_rmap *rm)
 {
-	spinlock_acquire(&coremap_spinlock);
-	ct_shootdown_interrupts++;
-	tlb_clear();
-	ct_shootdowns_done += NUM_TLB;
-	wchan_wakeall(coremap_shootchan);
-	spinlock_release(&coremap_spinlock);
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	rm->rm_pte = NULL;
+	rm->rm_next = pt_rmapfree;
+	pt_rmapfree = rm;
+	pt_nrmapfree++;
 }
 
 /*
- * Wait for shootdown to complete.
+ * Forget that the page at coremap index CMIX is in page table entry
+ * PTE. Doesn't change the entry itself.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 static
 void
-tlb_shootwait(void)
+pt_rmap_remove(unsigned cmix, uint32_t *pte)
 {
-	wchan_lock(coremap_shootchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_shootchan);
-	spinlock_acquire(&coremap_spinlock);
+	struct pt_rmap *rm, **rmp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (coremap[cmix].cm_pte == pte) {
+		/* move the next one up, if there is one */
+		rm = coremap[cmix].cm_rmap;
+		if (rm == NULL) {
+			coremap[cmix].cm_pte = NULL;
+			return;
+		}
+		coremap[cmix].cm_pte = rm->rm_pte;
+		coremap[cmix].cm_rmap = rm->rm_next;
+	}
+	else {
+		rmp = &coremap[cmix].cm_rmap;
+		while (*rmp != NULL && (*rmp)->rm_pte != pte) {
+			rmp = &(*rmp)->rm_next;
+		}
+		KASSERT(*rmp != NULL);
+		rm = *rmp;
+		*rmp = rm->rm_next;
+	}
+	pt_rmap_free(rm);
 }
 
 /*
- * tlb_unmap: Searches the TLB for a vaddr translation and invalidates
- * it if it exists.
+ * Clear all the page table entries for the page at coremap index
+ * CMIX.
  *
- * Synchronization: assumes we hold coremap_spinlock. Does not block. 
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 static
 void
-tlb_unmap(vaddr_t va)
+pt_clear(unsigned cmix)
 {
-	int i;
-	uint32_t elo = 0, ehi = 0;
+	struct pt_rmap *rm;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-	KASSERT(va < MIPS_KSEG0);
-
-	i = tlb_probe(va & PAGE_FRAME,0);
-	if (i < 0) {
+	if (coremap[cmix].cm_pte == NULL) {
+		KASSERT(coremap[cmix].cm_rmap == NULL);
 		return;
 	}
-	
-	tlb_read(&ehi, &elo, i);
-	
-	KASSERT(elo & TLBLO_VALID);
-	
-	DEBUG(DB_TLB, "invalidating tlb slot %d (va: 0x%x)\n", i, va); 
-	
-	tlb_invalidate(i);
+	*coremap[cmix].cm_pte = 0;
+	coremap[cmix].cm_pte = NULL;
+	while ((rm = coremap[cmix].cm_rmap) != NULL) {
+		*rm->rm_pte = 0;
+		coremap[cmix].cm_rmap = rm->rm_next;
+		pt_rmap_free(rm);
+	}
 }
 
 /*
- * mipstlb_getslot: get a TLB slot for use, replacing an existing one if
- * necessary and peforming any at-replacement actions.
+ * Point page table entry PTE at the page at coremap index CMIX, with
+ * TLB entry ELO, replacing whatever page it had before. If the page
+ * is already in other entries and we're out of spare reverse map
+ * entries, PTE is left empty instead.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 static
-int
-mipstlb_getslot(void)
+void
+pt_set(uint32_t *pte, unsigned cmix, uint32_t elo)
 {
-	int i;
+	struct pt_rmap *rm;
 
-	if (curcpu->c_vm.cvm_nexttlb < NUM_TLB) {
-		return curcpu->c_vm.cvm_nexttlb++;
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	if (*pte != 0) {
+		pt_rmap_remove(PADDR_TO_COREMAP(*pte & TLBLO_PPAGE), pte);
+		*pte = 0;
 	}
 
-	/* no space... need to evict */
-	i = tlb_replace();
-	tlb_invalidate(i);
-	return i;
+	if (coremap[cmix].cm_pte == NULL) {
+		coremap[cmix].cm_pte = pte;
+	}
+	else {
+		rm = pt_rmapfree;
+		if (rm == NULL) {
+			return;
+		}
+		pt_rmapfree = rm->rm_next;
+		pt_nrmapfree--;
+		rm->rm_pte = pte;
+		rm->rm_next = coremap[cmix].cm_rmap;
+		coremap[cmix].cm_rmap = rm;
+	}
+	*pte = elo;
 }
 
-////////////////////////////////////////////////////////////
-//
-// Page replacement code
-//
-
-/*
- * To evict a page, it must be non-kernel and non-pinned.
- *
- * page_replace() takes no arguments and returns an index into the
- * coremap (for the selected victim page).
- */
-
-#if OPT_RANDPAGE
-
 /*
- * Random page replacement.
+ * Clear AM's page table entry for VA, if it has one.
  *
- * Repeatedly generates a random index into the coremap until the 
- * selected page is not pinned and does not belong to the kernel.
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
  */
 static
-uint32_t 
-page_replace(void)
+void
+pt_unmap(struct addrspace_machdep *am, vaddr_t va)
 {
-    // Complete this function.
-	return 0;
-}
+	uint32_t *pte;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-#else /* not OPT_RANDPAGE */
+	pte = pt_lookup(am, va);
+	if (pte != NULL && *pte != 0) {
+		pt_rmap_remove(PADDR_TO_COREMAP(*pte & TLBLO_PPAGE), pte);
+		*pte = 0;
+	}
+}
 
 /*
- * Sequential page replacement.
+ * addrspace_machdep_cleanup: retire the address space's ASIDs, so the
+ * TLB entries it leaves behind get dropped, and free the page table.
+ * Pages that are still in it (shared ones that outlive the address
+ * space) are taken out first, so no cm_pte or cm_rmap points into it.
  *
- * Selects pages to be evicted from the coremap sequentially. Skips
- * pages that are pinned or that belong to the kernel.
+ * Synchronization: takes coremap_spinlock.
  */
-
-static
-uint32_t
-page_replace(void)
+void
+addrspace_machdep_cleanup(struct addrspace_machdep *am)
 {
-	// Complete this function.
-	return 0;
-}
+	uint32_t *pt;
+	unsigned i, j, cmix;
+
+	spinlock_acquire(&coremap_spinlock);
+	for (i=0; i<MAXCPUS; i++) {
+		if (am->am_cpumask & ((uint32_t)1 << i)) {
+			tlb_retire(am, i);
+		}
+	}
+	am->am_cpumask = 0;
+
+	if (am->am_pagetable == NULL) {
+		spinlock_release(&coremap_spinlock);
+		return;
+	}
 
-#endif /* OPT_RANDPAGE */
+	for (i=0; i<PT_NDIR; i++) {
+		pt = am->am_pagetable[i];
+		if (pt == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NPTES; j++) {
+			if (pt[j] != 0) {
+				cmix = PADDR_TO_COREMAP(pt[j] & TLBLO_PPAGE);
+				pt_rmap_remove(cmix, &pt[j]);
+				pt[j] = 0;
+			}
+		}
+	}
+	spinlock_release(&coremap_spinlock);
+
+	for (i=0; i<PT_NDIR; i++) {
+		kfree(am->am_pagetable[i]);
+	}
+	kfree(am->am_pagetable);
+	am->am_pagetable = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Stats
+
+void
+vm_printmdstats(void)
+{
+	uint32_t ss, sc, sa, sd, si, tr, tfr, tf, aa, ar, ap, zu;
+	uint32_t hand, rs, td, ds, bs, cv, dv, ba, be;
+	uint32_t pw, pe, pc, se, ph, pm;
+	uint32_t cm, ce, cw, cb, re;
+	struct cpu_vm_machdep *cvm;
+	unsigned i, pn;
+	const char *policy;
+	time_t secs, isecs;
+	uint32_t nsecs, insecs;
+	uint64_t ims;
+
+	gettime(&secs, &nsecs);
+
+	spinlock_acquire(&coremap_spinlock);
+	ss = ct_shootdowns_sent;
+	sc = ct_shootdowns_coalesced;
+	sa = ct_shootdowns_avoided;
+	sd = ct_shootdowns_done;
+	si = ct_shootdown_interrupts;
+	tr = ct_tlb_refills;
+	tf = ct_tlb_flushes;
+	aa = ct_asid_allocs;
+	ar = ct_asid_rollovers;
+	ap = ct_tlb_purged;
+	zu = ct_zero_unmaps;
+	policy = replacement_names[replacement_policy];
+	hand = replace_hand;
+	rs = ct_clock_refskips;
+	td = ct_clock_tlbdrops;
+	ds = ct_clock_dirtyskips;
+	bs = ct_clock_busyskips;
+	cv = ct_clock_cleanvictims;
+	dv = ct_clock_dirtyvictims;
+	ba = ct_buddy_allocs;
+	be = ct_buddy_moveallocs;
+	pw = ct_pageout_wakeups;
+	pe = ct_pageout_evicted;
+	pc = ct_pageout_cleaned;
+	se = ct_sync_evictions;
+	cm = ct_compact_migrated;
+	ce = ct_compact_evicted;
+	cw = ct_compact_wakeups;
+	cb = ct_compact_blocks;
+	re = ct_rss_evictions;
+	spinlock_release(&coremap_spinlock);
+
+	tfr = 0;
+	for (i=0; i<vm_ncpus; i++) {
+		cvm = vm_cpus[i];
+		spinlock_acquire(&cvm->cvm_tlblock);
+		tfr += cvm->cvm_fastrefills;
+		spinlock_release(&cvm->cvm_tlblock);
+	}
+
+	kprintf("vm: shootdowns: %lu sent, %lu coalesced, %lu avoided\n",
+		(unsigned long) ss, (unsigned long) sc, (unsigned long) sa);
+	kprintf("vm: shootdowns: %lu done (%lu interrupts)\n",
+		(unsigned long) sd, (unsigned long) si);
+	kprintf("vm: tlb: %lu refills, %lu flushes\n",
+		(unsigned long) tr, (unsigned long) tf);
+	kprintf("vm: tlb: %lu refills from page tables (fast path %s)\n",
+		(unsigned long) tfr, mmu_fastrefill ? "on" : "off");
+	kprintf("vm: asids: %lu assigned, %lu rollovers, "
+		"%lu retired entries dropped\n",
+		(unsigned long) aa, (unsigned long) ar, (unsigned long) ap);
+	kprintf("vm: tlb: zero page unmapped %lu times\n",
+		(unsigned long) zu);
+	kprintf("vm: page replacement: %s, hand at %lu/%lu\n", policy,
+		(unsigned long) hand, (unsigned long) num_coremap_entries);
+	kprintf("vm: clock: %lu clean victims, %lu dirty victims\n",
+		(unsigned long) cv, (unsigned long) dv);
+	kprintf("vm: clock: skipped %lu referenced (%lu tlb drops), "
+		"%lu dirty, %lu busy\n", (unsigned long) rs,
+		(unsigned long) td, (unsigned long) ds, (unsigned long) bs);
+	kprintf("vm: multipage allocs: %lu from free blocks, "
+		"%lu by moving pages\n", (unsigned long) ba,
+		(unsigned long) be);
+	kprintf("vm: compaction: %lu pages migrated, %lu evicted, "
+		"%lu wakeups, %lu blocks cleared\n", (unsigned long) cm,
+		(unsigned long) ce, (unsigned long) cw, (unsigned long) cb);
+	kprintf("vm: pageout: watermarks %lu/%lu pages, %lu wakeups, "
+		"%lu evicted, %lu cleaned\n", (unsigned long) pageout_lowater,
+		(unsigned long) pageout_hiwater, (unsigned long) pw,
+		(unsigned long) pe, (unsigned long) pc);
+	kprintf("vm: pageout: %lu evictions by faulting threads\n",
+		(unsigned long) se);
+	kprintf("vm: %lu local evictions for RSS limits\n",
+		(unsigned long) re);
+
+	for (i=0; i<vm_ncpus; i++) {
+		cvm = vm_cpus[i];
+		spinlock_acquire(&cvm->cvm_pcache_lock);
+		ph = cvm->cvm_pcache_hits;
+		pm = cvm->cvm_pcache_misses;
+		pn = cvm->cvm_pcache_count;
+		spinlock_release(&cvm->cvm_pcache_lock);
+		kprintf("vm: cpu%u page cache: %u pages, %lu hits, "
+			"%lu misses\n", i, pn, (unsigned long) ph,
+			(unsigned long) pm);
+	}
+
+	if (lastreport_secs != 0) {
+		getinterval(lastreport_secs, lastreport_nsecs, secs, nsecs,
+			    &isecs, &insecs);
+		ims = (uint64_t)isecs * 1000 + insecs / 1000000;
+		if (ims > 0) {
+			kprintf("vm: tlb: %lu refills/sec since last report\n",
+				(unsigned long)
+				((uint64_t)(tr - lastreport_refills) * 1000
+				 / ims));
+		}
+	}
+	lastreport_secs = secs;
+	lastreport_nsecs = nsecs;
+	lastreport_refills = tr;
+}
+
+////////////////////////////////////////////////////////////
+//
+// TLB handling
+
+/*
+ * tlb_lock/tlb_unlock: take and release this CPU's TLB lock. The
+ * caller must already hold coremap_spinlock (which keeps us on this
+ * CPU); mmu_refill, which doesn't, does it by hand.
+ */
+static
+void
+tlb_lock(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	spinlock_acquire(&curcpu->c_vm.cvm_tlblock);
+}
+
+static
+void
+tlb_unlock(void)
+{
+	spinlock_release(&curcpu->c_vm.cvm_tlblock);
+}
+
+/*
+ * tlb_replace - TLB replacement algorithm. Returns index of TLB entry
+ * to replace.
+ *
+ * Synchronization: assumes we hold this CPU's TLB lock. Does not block.
+ */
+static
+uint32_t 
+tlb_replace(void) 
+{
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
+#if OPT_RANDTLB
+	/* random */
+	return random() % NUM_TLB;
+#else
+	/* sequential */
+	uint32_t slot = curcpu->c_vm.cvm_tlbseqslot;
+	curcpu->c_vm.cvm_tlbseqslot = (slot + 1) % NUM_TLB;
+	return slot;
+#endif
+}
+
+/*
+ * TLB entry tracking.
+ *
+ * Each CPU counts, for every page, how many of its own TLB entries map
+ * that page (cvm_tlbcount), and updates the count whenever it loads or
+ * drops an entry. A CPU's TLB and counts are only changed by that CPU,
+ * holding its TLB lock (cvm_tlblock), and everywhere but mmu_refill
+ * coremap_spinlock as well; other CPUs just read the counts, to see
+ * whom to send a shootdown. The zero page is not counted.
+ *
+ * Getting a page out of every TLB (coremap_unmap_tlb_start) then means
+ * dropping our own entries for it and sending each other CPU whose
+ * count isn't zero a shootdown naming the page, after which it drops
+ * its entries. Since the page is pinned and its page table entries
+ * are cleared first (and tlb_sync waits for refills that got in
+ * before that), nothing can load it again meanwhile, so the counts
+ * only go down.
+ */
+
+/*
+ * tlb_invalidate: marks a given tlb entry as invalid.
+ *
+ * Synchronization: assumes we hold this CPU's TLB lock. Does not block.
+ */
+static
+void
+tlb_invalidate(int tlbix)
+{
+	uint32_t elo, ehi;
+	paddr_t pa;
+	unsigned cmix;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
+	tlb_read(&ehi, &elo, tlbix);
+	if ((elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) != zero_paddr) {
+		pa = elo & TLBLO_PPAGE;
+		cmix = PADDR_TO_COREMAP(pa);
+		KASSERT(cmix < num_coremap_entries);
+		KASSERT(curcpu->c_vm.cvm_tlbcount[cmix] > 0);
+		curcpu->c_vm.cvm_tlbcount[cmix]--;
+		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+			(unsigned long) COREMAP_TO_PADDR(cmix));
+	}
+
+	tlb_write(TLBHI_INVALID(tlbix), TLBLO_INVALID(), tlbix);
+	DEBUG(DB_TLB, "... pa ------- <-- tlb %d\n", tlbix);
+}
+
+/*
+ * tlb_clear: flushes the TLB by loading it with invalid entries.
+ *
+ * Synchronization: assumes we hold coremap_spinlock and this CPU's TLB
+ * lock. Does not block.
+ */
+static
+void
+tlb_clear(void)
+{
+	int i;	
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_invalidate(i);
+	}
+	curcpu->c_vm.cvm_nexttlb = 0;
+	ct_tlb_flushes++;
+}
+
+/*
+ * tlb_purgedead: drop this CPU's TLB entries under ASIDs that have
+ * been retired (see tlb_retire), so they stop being counted. Until
+ * then there are at most NUM_TLB such entries per CPU, and they only
+ * last until the CPU next switches address spaces.
+ *
+ * Synchronization: assumes we hold coremap_spinlock and this CPU's TLB
+ * lock. Does not block.
+ */
+static
+void
+tlb_purgedead(void)
+{
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+	uint32_t ehi, elo, asid;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&cvm->cvm_tlblock));
+
+	if (cvm->cvm_deadasids == 0) {
+		return;
+	}
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) == 0) {
+			continue;
+		}
+		asid = (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT;
+		if (cvm->cvm_deadasids & ((uint64_t)1 << asid)) {
+			tlb_invalidate(i);
+			ct_tlb_purged++;
+		}
+	}
+	cvm->cvm_deadasids = 0;
+}
+
+/*
+ * tlb_unmap_page: drop all of this CPU's TLB entries for the page at
+ * coremap index CMIX. The count says how many to look for, so we can
+ * stop as soon as we've found them.
+ *
+ * Synchronization: assumes we hold this CPU's TLB lock. Does not block.
+ */
+static
+void
+tlb_unmap_page(unsigned cmix)
+{
+	uint8_t *count = curcpu->c_vm.cvm_tlbcount;
+	uint32_t elo, ehi;
+	paddr_t pa;
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
+	pa = COREMAP_TO_PADDR(cmix);
+	for (i=0; i<NUM_TLB && count[cmix] > 0; i++) {
+		tlb_read(&ehi, &elo, i);
+		if ((elo & TLBLO_VALID) && (elo & TLBLO_PPAGE) == pa) {
+			tlb_invalidate(i);
+		}
+	}
+	KASSERT(count[cmix] == 0);
+}
+
+/*
+ * tlb_present: true if the page at coremap index CMIX is in any CPU's
+ * TLB.
+ *
+ * Synchronization: none needed to get an answer that was right a
+ * moment ago. Once the page has no page table entries and tlb_sync
+ * has been called, the answer stays right until it's mapped again.
+ */
+static
+bool
+tlb_present(unsigned cmix)
+{
+	unsigned i;
+
+	for (i=0; i<vm_ncpus; i++) {
+		if (vm_cpus[i]->cvm_tlbcount[cmix] > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * tlb_sync: wait out any mmu_refill in progress on any CPU, by taking
+ * each CPU's TLB lock in turn. A refill reads a page table entry
+ * without coremap_spinlock, so it may have read one just before we
+ * cleared it; afterwards it has either loaded the page and counted it,
+ * or it will see the entry cleared.
+ *
+ * Synchronization: assumes we hold coremap_spinlock, and not our own
+ * TLB lock. Does not block.
+ */
+static
+void
+tlb_sync(void)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<vm_ncpus; i++) {
+		spinlock_acquire(&vm_cpus[i]->cvm_tlblock);
+		spinlock_release(&vm_cpus[i]->cvm_tlblock);
+	}
+}
+
+/*
+ * Do a batch of TLB shootdowns. Each names a page; drop all our
+ * entries for it. A request for a page we've dropped since it was
+ * sent finds the count already zero.
+ */
+void
+vm_tlbshootdown(const struct tlbshootdown *ts, int num)
+{
+	int i;
+	unsigned where;
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(vm_cpus[curcpu->c_number] == &curcpu->c_vm);
+	ct_shootdown_interrupts++;
+	tlb_lock();
+	for (i=0; i<num; i++) {
+		where = ts[i].ts_coremapindex;
+		if (curcpu->c_vm.cvm_tlbcount[where] > 0) {
+			tlb_unmap_page(where);
+			ct_shootdowns_done++;
+		}
+	}
+	tlb_unlock();
+	wchan_wakeall(coremap_shootchan);
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * Shoot down everything. This also does any requests for us that are
+ * queued but not sent yet; their pages are pinned and can't come back
+ * into the TLB, so once sent they'll find nothing to do.
+ */
+void
+vm_tlbshootdown_all(void)
+{
+	spinlock_acquire(&coremap_spinlock);
+	ct_shootdown_interrupts++;
+	tlb_lock();
+	tlb_clear();
+	tlb_unlock();
+	ct_shootdowns_done += NUM_TLB;
+	wchan_wakeall(coremap_shootchan);
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * Wait for shootdown to complete.
+ */
+static
+void
+tlb_shootwait(void)
+{
+	wchan_lock(coremap_shootchan);
+	spinlock_release(&coremap_spinlock);
+	wchan_sleep(coremap_shootchan);
+	spinlock_acquire(&coremap_spinlock);
+}
+
+/*
+ * coremap_pinwait: wait for a pinned page to unpin.
+ */
+static
+void
+coremap_pinwait(void)
+{
+	wchan_lock(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+	wchan_sleep(coremap_pinchan);
+	spinlock_acquire(&coremap_spinlock);
+}
+
+/*
+ * tlb_unmap: Searches the TLB for a vaddr translation tagged with
+ * ASID and invalidates it if it exists.
+ *
+ * Synchronization: assumes we hold this CPU's TLB lock. Does not block. 
+ */
+static
+void
+tlb_unmap(vaddr_t va, uint32_t asid)
+{
+	int i;
+	uint32_t elo = 0, ehi = 0;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
+	KASSERT(va < MIPS_KSEG0);
+	KASSERT(asid > 0 && asid < NUM_ASID);
+
+	i = tlb_probe((va & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
+	if (i < 0) {
+		return;
+	}
+	
+	tlb_read(&ehi, &elo, i);
+	
+	KASSERT(elo & TLBLO_VALID);
+	
+	DEBUG(DB_TLB, "invalidating tlb slot %d (va: 0x%x)\n", i, va); 
+	
+	tlb_invalidate(i);
+}
+
+/*
+ * tlb_asidof: return the ASID address space AS holds on this CPU, or 0
+ * if it has none in the current generation.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+uint32_t
+tlb_asidof(struct addrspace *as)
+{
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+	uint32_t tag;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	tag = as->as_machdep.am_asid[curcpu->c_number];
+	if ((tag & ~(uint32_t)(NUM_ASID-1)) != cvm->cvm_asidgen) {
+		return 0;
+	}
+	return tag & (NUM_ASID-1);
+}
+
+/*
+ * tlb_getasid: return the ASID for address space AS on this CPU,
+ * handing out a fresh one if it has none in the current generation.
+ *
+ * ASIDs are never reused within a generation, so entries left behind
+ * under a retired ASID can't be used, and tlb_purgedead can drop them
+ * by ASID alone. When we run out we flush the TLB and start a new
+ * generation.
+ *
+ * Synchronization: assumes we hold coremap_spinlock and this CPU's TLB
+ * lock. Does not block.
+ */
+static
+uint32_t
+tlb_getasid(struct addrspace *as)
+{
+	struct cpu_vm_machdep *cvm = &curcpu->c_vm;
+	uint32_t asid;
+
+	asid = tlb_asidof(as);
+	if (asid != 0) {
+		return asid;
+	}
+
+	if (cvm->cvm_nextasid >= NUM_ASID) {
+		tlb_clear();
+		cvm->cvm_deadasids = 0;
+		cvm->cvm_asidgen += NUM_ASID;
+		if (cvm->cvm_asidgen == 0) {
+			/* wrapped; generation 0 means "none" */
+			cvm->cvm_asidgen = NUM_ASID;
+		}
+		cvm->cvm_nextasid = 1;
+		ct_asid_rollovers++;
+	}
+
+	asid = cvm->cvm_nextasid++;
+	as->as_machdep.am_asid[curcpu->c_number] = cvm->cvm_asidgen | asid;
+	ct_asid_allocs++;
+	return asid;
+}
+
+/*
+ * mipstlb_getslot: get a TLB slot for use, replacing an existing one if
+ * necessary and peforming any at-replacement actions.
+ *
+ * Synchronization: assumes we hold this CPU's TLB lock. Does not block.
+ */
+static
+int
+mipstlb_getslot(void)
+{
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&curcpu->c_vm.cvm_tlblock));
+
+	if (curcpu->c_vm.cvm_nexttlb < NUM_TLB) {
+		return curcpu->c_vm.cvm_nexttlb++;
+	}
+
+	/* no space... need to evict */
+	i = tlb_replace();
+	tlb_invalidate(i);
+	return i;
+}
+
+/*
+ * tlb_shootdown_flush: send the shootdowns queued for CPU, if any, in
+ * one interrupt. Requests whose page has left that CPU's TLB by now
+ * (it needed the slots) are dropped.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_shootdown_flushcpu(unsigned cpu)
+{
+	struct tlbshootdown *ts;
+	unsigned i, n, where;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	ts = shoot_pending[cpu];
+	n = 0;
+	for (i=0; i<shoot_npending[cpu]; i++) {
+		where = ts[i].ts_coremapindex;
+		if (vm_cpus[cpu]->cvm_tlbcount[where] == 0) {
+			ct_shootdowns_avoided++;
+			continue;
+		}
+		ts[n++] = ts[i];
+	}
+	shoot_npending[cpu] = 0;
+
+	if (n > 0) {
+		ct_shootdowns_sent++;
+		ct_shootdowns_coalesced += n - 1;
+		ipi_tlbshootdown_batch(cpu, ts, n);
+	}
+}
+
+static
+void
+tlb_shootdown_flush(void)
+{
+	unsigned i;
+
+	for (i=0; i<MAXCPUS; i++) {
+		if (shoot_npending[i] > 0) {
+			tlb_shootdown_flushcpu(i);
+		}
+	}
+}
+
+/*
+ * coremap_unmap_tlb_start: begin getting the physical page at coremap
+ * index CMIX out of every TLB. Our own entries for it are dropped
+ * right away; for each other CPU that has some we queue a shootdown,
+ * and coremap_unmap_tlb_finish waits for them. Several pages can be
+ * started before any of them is finished, and their shootdowns go out
+ * together.
+ *
+ * The page's page table entries are cleared first, and any refill
+ * that read one before that waited out (tlb_sync), so mmu_refill
+ * can't load it again and the counts we look at can only go down;
+ * with that and the TLB entries gone, every translation of the page
+ * is revoked.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * The page must be pinned, so it can't be mapped again (or change
+ * identity) before the shootdowns are done.
+ */
+static
+void
+coremap_unmap_tlb_start(unsigned cmix)
+{
+	struct tlbshootdown *ts;
+	unsigned cpu;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[cmix].cm_pinned);
+
+	pt_clear(cmix);
+	tlb_sync();
+
+	for (cpu=0; cpu<vm_ncpus; cpu++) {
+		if (vm_cpus[cpu]->cvm_tlbcount[cmix] == 0) {
+			continue;
+		}
+		if (cpu == curcpu->c_number) {
+			tlb_lock();
+			tlb_unmap_page(cmix);
+			tlb_unlock();
+			continue;
+		}
+
+		/* yay, TLB shootdown */
+		if (shoot_npending[cpu] == TLBSHOOTDOWN_MAX) {
+			tlb_shootdown_flushcpu(cpu);
+		}
+		ts = &shoot_pending[cpu][shoot_npending[cpu]++];
+		ts->ts_coremapindex = cmix;
+	}
+}
+
+/*
+ * coremap_unmap_tlb_finish: wait until the page at coremap index CMIX,
+ * started with coremap_unmap_tlb_start, is out of every TLB. Sends its
+ * shootdowns first if they're still queued.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. May release it
+ * and sleep waiting for the shootdowns.
+ */
+static
+void
+coremap_unmap_tlb_finish(unsigned cmix)
+{
+	unsigned cpu;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[cmix].cm_pinned);
+
+	while (1) {
+		if (curcpu->c_vm.cvm_tlbcount[cmix] > 0) {
+			/* we slept and woke up on a CPU that had it */
+			tlb_lock();
+			tlb_unmap_page(cmix);
+			tlb_unlock();
+		}
+		if (!tlb_present(cmix)) {
+			break;
+		}
+		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+		for (cpu=0; cpu<vm_ncpus; cpu++) {
+			if (vm_cpus[cpu]->cvm_tlbcount[cmix] > 0 &&
+			    shoot_npending[cpu] > 0) {
+				tlb_shootdown_flushcpu(cpu);
+			}
+		}
+		tlb_shootwait();
+	}
+
+	DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
+	      (unsigned long) COREMAP_TO_PADDR(cmix));
+}
+
+/*
+ * coremap_unmap_tlb: make sure the physical page at coremap index CMIX
+ * is not in any TLB, shooting it down on other CPUs if necessary.
+ *
+ * Synchronization: as for coremap_unmap_tlb_finish.
+ */
+static
+void
+coremap_unmap_tlb(unsigned cmix)
+{
+	coremap_unmap_tlb_start(cmix);
+	coremap_unmap_tlb_finish(cmix);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Free page index
+
+/*
+ * Index of the highest set bit in a nonzero word. (No clz on MIPS-I.)
+ */
+static
+unsigned
+freemap_highbit(uint32_t x)
+{
+	unsigned n = 0;
+
+	KASSERT(x != 0);
+	if (x & 0xffff0000) {
+		n += 16;
+		x >>= 16;
+	}
+	if (x & 0xff00) {
+		n += 8;
+		x >>= 8;
+	}
+	if (x & 0xf0) {
+		n += 4;
+		x >>= 4;
+	}
+	if (x & 0xc) {
+		n += 2;
+		x >>= 2;
+	}
+	if (x & 0x2) {
+		n += 1;
+	}
+	return n;
+}
+
+/*
+ * Bring the free page index up to date for coremap entry I.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+freemap_update(uint32_t i)
+{
+	uint32_t w = i / 32;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(i < num_coremap_entries);
+
+	if (!coremap[i].cm_allocated && !coremap[i].cm_pinned) {
+		freemap[w] |= (uint32_t)1 << (i % 32);
+	}
+	else {
+		freemap[w] &= ~((uint32_t)1 << (i % 32));
+	}
+
+	if (freemap[w] != 0) {
+		freemap_summary[w / 32] |= (uint32_t)1 << (w % 32);
+	}
+	else {
+		freemap_summary[w / 32] &= ~((uint32_t)1 << (w % 32));
+	}
+}
+
+/*
+ * Return the highest-numbered free, unpinned page, or -1 if none.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+int
+freemap_findlast(void)
+{
+	uint32_t s, w;
+	int i;
+
+	for (s = freemap_summarywords; s-- > 0; ) {
+		if (freemap_summary[s] != 0) {
+			w = s * 32 + freemap_highbit(freemap_summary[s]);
+			KASSERT(freemap[w] != 0);
+			i = w * 32 + freemap_highbit(freemap[w]);
+			KASSERT(i < (int)num_coremap_entries);
+			return i;
+		}
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buddy free lists
+
+#define BUDDY_BLOCK(i) \
+	((struct buddy_block *)PADDR_TO_KVADDR(COREMAP_TO_PADDR(i)))
+#define BUDDY_INDEX(bb) \
+	((uint32_t)PADDR_TO_COREMAP(KVADDR_TO_PADDR((vaddr_t)(bb))))
+
+/*
+ * Add the free block starting at coremap index I to the list for its
+ * order.
+ */
+static
+void
+buddy_insert(uint32_t i, unsigned order)
+{
+	struct buddy_block *bb;
+
+	KASSERT(order < BUDDY_NORDERS);
+	KASSERT((i & ((1U << order) - 1)) == 0);
+	KASSERT(!coremap[i].cm_freehead);
+
+	bb = BUDDY_BLOCK(i);
+	bb->bb_prev = NULL;
+	bb->bb_next = buddy_lists[order];
+	if (bb->bb_next != NULL) {
+		bb->bb_next->bb_prev = bb;
+	}
+	buddy_lists[order] = bb;
+	buddy_counts[order]++;
+
+	coremap[i].cm_freehead = 1;
+	coremap[i].cm_order = order;
+}
+
+/*
+ * Take the free block starting at coremap index I off its list.
+ */
+static
+void
+buddy_remove(uint32_t i)
+{
+	struct buddy_block *bb;
+	unsigned order;
+
+	KASSERT(coremap[i].cm_freehead);
+	order = coremap[i].cm_order;
+
+	bb = BUDDY_BLOCK(i);
+	if (bb->bb_prev != NULL) {
+		bb->bb_prev->bb_next = bb->bb_next;
+	}
+	else {
+		KASSERT(buddy_lists[order] == bb);
+		buddy_lists[order] = bb->bb_next;
+	}
+	if (bb->bb_next != NULL) {
+		bb->bb_next->bb_prev = bb->bb_prev;
+	}
+	buddy_counts[order]--;
+
+	coremap[i].cm_freehead = 0;
+	coremap[i].cm_order = 0;
+}
+
+/*
+ * Page I has just become free: add it, coalescing with its buddy
+ * as long as the buddy is a whole free block of the same order.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+buddy_free_page(uint32_t i)
+{
+	uint32_t buddy;
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(!coremap[i].cm_allocated);
+
+	for (order = 0; order < BUDDY_NORDERS - 1; order++) {
+		buddy = i ^ (1U << order);
+		if (buddy >= num_coremap_entries ||
+		    !coremap[buddy].cm_freehead ||
+		    coremap[buddy].cm_order != order) {
+			break;
+		}
+		buddy_remove(buddy);
+		if (buddy < i) {
+			i = buddy;
+		}
+	}
+	buddy_insert(i, order);
+}
+
+/*
+ * Page I is about to be allocated: find the free block holding it and
+ * split that block down until I is a block by itself, then take it.
+ * Costs O(BUDDY_NORDERS) regardless of memory size.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+buddy_take_page(uint32_t i)
+{
+	uint32_t start, half;
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(!coremap[i].cm_allocated);
+
+	for (order = 0; order < BUDDY_NORDERS; order++) {
+		start = i & ~((1U << order) - 1);
+		if (coremap[start].cm_freehead &&
+		    coremap[start].cm_order == order) {
+			break;
+		}
+	}
+	KASSERT(order < BUDDY_NORDERS);
+
+	buddy_remove(start);
+	while (order > 0) {
+		order--;
+		half = 1U << order;
+		if (i < start + half) {
+			buddy_insert(start + half, order);
+		}
+		else {
+			buddy_insert(start, order);
+			start += half;
+		}
+	}
+	KASSERT(start == i);
+}
+
+/*
+ * Find NPAGES contiguous free, unpinned pages: the start of the first
+ * block on the smallest nonempty list big enough. (Free pages are only
+ * ever pinned briefly, by lpage_lock_and_pin losing a race, so skipping
+ * blocks with pinned pages rarely matters.) Returns the coremap index,
+ * or -1 if there's no such block.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+int
+buddy_findrun(unsigned npages)
+{
+	struct buddy_block *bb;
+	unsigned order, j;
+	uint32_t start;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (order = 0; (1U << order) < npages; order++);
+
+	for (; order < BUDDY_NORDERS; order++) {
+		for (bb = buddy_lists[order]; bb != NULL; bb = bb->bb_next) {
+			start = BUDDY_INDEX(bb);
+			for (j = 0; j < npages; j++) {
+				if (coremap[start + j].cm_pinned) {
+					break;
+				}
+			}
+			if (j == npages) {
+				return start;
+			}
+		}
+	}
+	return -1;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Page replacement code
+//
+
+/*
+ * To evict a page, it must be non-kernel and non-pinned.
+ *
+ * page_replace() takes no arguments and returns an index into the
+ * coremap (for the selected victim page), or -1 if every evictable
+ * page is pinned at the moment.
+ *
+ * The policy can be changed at runtime (from the kernel menu) with
+ * coremap_set_replacement(). The default is random if OPT_RANDPAGE is
+ * set and clock otherwise.
+ */
+
+static
+int
+page_evictable(uint32_t i)
+{
+	return coremap[i].cm_allocated && !coremap[i].cm_kernel &&
+		!coremap[i].cm_pinned;
+}
+
+/*
+ * Random page replacement.
+ *
+ * Repeatedly generates a random index into the coremap until the 
+ * selected page is not pinned and does not belong to the kernel.
+ */
+static
+int
+page_replace_random(void)
+{
+	uint32_t i, tries;
+
+	for (tries = 0; tries < 2*num_coremap_entries; tries++) {
+		i = random() % num_coremap_entries;
+		if (page_evictable(i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Sequential page replacement.
+ *
+ * Selects pages to be evicted from the coremap sequentially. Skips
+ * pages that are pinned or that belong to the kernel.
+ */
+static
+int
+page_replace_sequential(void)
+{
+	uint32_t i, n;
+
+	for (n = 0; n < num_coremap_entries; n++) {
+		i = replace_hand;
+		replace_hand = (replace_hand + 1) % num_coremap_entries;
+		if (page_evictable(i)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Clock (WSClock-style) page replacement.
+ *
+ * The MIPS has no hardware referenced bits, so we emulate them:
+ * cm_referenced is set whenever a page is entered into the TLB. When
+ * the hand passes a referenced page it clears the bit and drops the
+ * page's TLB entries, so that if the page is still in use the next
+ * access refaults and sets the bit again. (Entries on other CPUs are
+ * not worth a shootdown here; a page mapped on another CPU is just
+ * treated as in use.)
+ *
+ * Among unreferenced pages, clean ones are preferred because they can
+ * be discarded without I/O. If a whole lap turns up only dirty ones,
+ * we take the first of those; if there were none at all, the second
+ * lap takes the first unreferenced page, the bits having been cleared
+ * by the first.
+ */
+static
+int
+page_replace_clock(void)
+{
+	uint32_t i, scanned;
+	int dirtyvictim = -1;
+	struct lpage *lp;
+
+	for (scanned = 0; scanned < 2*num_coremap_entries; scanned++) {
+		if (scanned == num_coremap_entries && dirtyvictim >= 0) {
+			/* we don't sleep, so it's still evictable */
+			KASSERT(page_evictable(dirtyvictim));
+			ct_clock_dirtyvictims++;
+			return dirtyvictim;
+		}
+
+		i = replace_hand;
+		replace_hand = (replace_hand + 1) % num_coremap_entries;
+
+		if (!page_evictable(i)) {
+			ct_clock_busyskips++;
+			continue;
+		}
+
+		if (coremap[i].cm_referenced) {
+			coremap[i].cm_referenced = 0;
+			if (curcpu->c_vm.cvm_tlbcount[i] > 0) {
+				tlb_lock();
+				tlb_unmap_page(i);
+				tlb_unlock();
+				ct_clock_tlbdrops++;
+			}
+			ct_clock_refskips++;
+			continue;
+		}
+
+		if (tlb_present(i)) {
+			/* in another CPU's TLB, so in use */
+			ct_clock_refskips++;
+			continue;
+		}
+
+		/*
+		 * Peek at the dirty bit without locking the lpage. It's
+		 * only a hint, and the lpage can't go away while its
+		 * page is unpinned and we hold coremap_spinlock.
+		 */
+		lp = coremap[i].cm_lpage;
+		KASSERT(lp != NULL);
+		if (LP_ISDIRTY(lp) && scanned < num_coremap_entries) {
+			if (dirtyvictim < 0) {
+				dirtyvictim = i;
+			}
+			ct_clock_dirtyskips++;
+			continue;
+		}
+
+		if (LP_ISDIRTY(lp)) {
+			ct_clock_dirtyvictims++;
+		}
+		else {
+			ct_clock_cleanvictims++;
+		}
+		return i;
+	}
+	return -1;
+}
+
+static
+int
+page_replace(void)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	switch (replacement_policy) {
+	    case PR_RANDOM:
+		return page_replace_random();
+	    case PR_SEQUENTIAL:
+		return page_replace_sequential();
+	    case PR_CLOCK:
+		return page_replace_clock();
+	}
+	panic("page_replace: invalid policy %u\n", replacement_policy);
+	return -1;
+}
+
+/*
+ * Select the page replacement policy by name.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+int
+coremap_set_replacement(const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<sizeof(replacement_names)/sizeof(replacement_names[0]);
+	     i++) {
+		if (!strcmp(name, replacement_names[i])) {
+			spinlock_acquire(&coremap_spinlock);
+			replacement_policy = i;
+			spinlock_release(&coremap_spinlock);
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+/*
+ * Return the name of the current page replacement policy.
+ */
+const char *
+coremap_get_replacement(void)
+{
+	return replacement_names[replacement_policy];
+}
+
+////////////////////////////////////////////////////////////
+//
+// Resident set accounting
+
+/*
+ * Put the page at coremap index I on AS's resident list and charge it
+ * to AS. It goes in just behind the clock hand, so it's looked at last.
+ *
+ * Synchronization: assumes we hold coremap_rsslock.
+ */
+static
+void
+rss_link(uint32_t i, struct addrspace *as)
+{
+	uint32_t hand, prev;
+
+	KASSERT(spinlock_do_i_hold(&coremap_rsslock));
+	KASSERT(coremap[i].cm_owner == NULL);
+
+	if (as->as_rss == 0) {
+		coremap[i].cm_rssnext = i;
+		coremap[i].cm_rssprev = i;
+		as->as_rsshand = i;
+	}
+	else {
+		hand = as->as_rsshand;
+		prev = coremap[hand].cm_rssprev;
+		coremap[i].cm_rssnext = hand;
+		coremap[i].cm_rssprev = prev;
+		coremap[prev].cm_rssnext = i;
+		coremap[hand].cm_rssprev = i;
+	}
+	coremap[i].cm_owner = as;
+	as->as_rss++;
+}
+
+/*
+ * Take the page at coremap index I off its owner's resident list and
+ * drop the charge. If the clock hand was on it, it moves to the next
+ * page.
+ *
+ * Synchronization: assumes we hold coremap_rsslock.
+ */
+static
+void
+rss_unlink(uint32_t i)
+{
+	struct addrspace *as;
+	uint32_t next, prev;
+
+	KASSERT(spinlock_do_i_hold(&coremap_rsslock));
+
+	as = coremap[i].cm_owner;
+	KASSERT(as != NULL);
+	KASSERT(as->as_rss > 0);
+
+	next = coremap[i].cm_rssnext;
+	prev = coremap[i].cm_rssprev;
+	coremap[prev].cm_rssnext = next;
+	coremap[next].cm_rssprev = prev;
+	if (as->as_rsshand == i) {
+		as->as_rsshand = next;
+	}
+	coremap[i].cm_owner = NULL;
+	as->as_rss--;
+}
+
+/*
+ * Charge the user page at coremap index I to AS.
+ *
+ * Synchronization: takes coremap_rsslock. Does not block. The page
+ * must be pinned.
+ */
+static
+void
+rss_charge(uint32_t i, struct addrspace *as)
+{
+	KASSERT(coremap[i].cm_pinned);
+
+	spinlock_acquire(&coremap_rsslock);
+	rss_link(i, as);
+	if (as->as_rss > as->as_rsspeak) {
+		as->as_rsspeak = as->as_rss;
+	}
+	spinlock_release(&coremap_rsslock);
+}
+
+/*
+ * Drop the charge for the user page at coremap index I, if any, as
+ * it's being freed or evicted.
+ *
+ * Synchronization: takes coremap_rsslock. Does not block. The page
+ * must be pinned, or we must hold coremap_spinlock.
+ */
+static
+void
+rss_uncharge(uint32_t i)
+{
+	spinlock_acquire(&coremap_rsslock);
+	if (coremap[i].cm_owner != NULL) {
+		rss_unlink(i);
+	}
+	spinlock_release(&coremap_rsslock);
+}
+
+/*
+ * Local page replacement: clock over AS's resident list, for when AS
+ * is at its RSS limit. Referenced bits are handled as in
+ * page_replace_clock, but dirty pages aren't passed over - the point
+ * is to keep AS inside its limit, not to save I/O. Looks at no more
+ * than twice AS's resident set, so the time spent holding
+ * coremap_spinlock doesn't grow with the size of memory. Returns -1
+ * if AS has nothing evictable.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ * Takes coremap_rsslock only to step the hand; the page can be
+ * uncharged (and even recharged to someone else) by a page cache
+ * after we let go, in which case we just evict someone else's page
+ * once.
+ */
+static
+int
+page_replace_local(struct addrspace *as)
+{
+	uint32_t i, scanned;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (scanned = 0; ; scanned++) {
+		spinlock_acquire(&coremap_rsslock);
+		if (scanned >= 2*as->as_rss) {
+			spinlock_release(&coremap_rsslock);
+			break;
+		}
+		i = as->as_rsshand;
+		as->as_rsshand = coremap[i].cm_rssnext;
+		spinlock_release(&coremap_rsslock);
+
+		if (!page_evictable(i)) {
+			continue;
+		}
+
+		if (coremap[i].cm_referenced) {
+			coremap[i].cm_referenced = 0;
+			if (curcpu->c_vm.cvm_tlbcount[i] > 0) {
+				tlb_lock();
+				tlb_unmap_page(i);
+				tlb_unlock();
+			}
+			continue;
+		}
+
+		if (tlb_present(i)) {
+			/* in another CPU's TLB, so in use */
+			continue;
+		}
+
+		return i;
+	}
+	return -1;
+}
 
 
 ////////////////////////////////////////////////////////////
@@ -414,6 +2059,8 @@ coremap_bootstrap(void)
 	uint32_t i;
 	paddr_t first, last;
 	uint32_t npages, coremapsize;
+	uint32_t freemapwords;
+	vaddr_t zeropage;
 
 	ram_getsize(&first, &last);
 
@@ -440,205 +2087,689 @@ coremap_bootstrap(void)
 	 * coremap size.
 	 */
 	coremapsize = npages * sizeof(struct coremap_entry);
+
+	/* The free page index goes right after it. */
+	freemapwords = DIVROUNDUP(npages, 32);
+	freemap_summarywords = DIVROUNDUP(freemapwords, 32);
+	coremapsize += (freemapwords + freemap_summarywords) * sizeof(uint32_t);
+
 	coremapsize = ROUNDUP(coremapsize, PAGE_SIZE);
 	KASSERT((coremapsize & PAGE_FRAME) == coremapsize);
 
-	/*
-	 * Steal pages for the coremap.
-	 */
-	coremap = (struct coremap_entry *) PADDR_TO_KVADDR(first);
-	first += coremapsize;
+	/*
+	 * Steal pages for the coremap.
+	 */
+	coremap = (struct coremap_entry *) PADDR_TO_KVADDR(first);
+	freemap = (uint32_t *) &coremap[npages];
+	freemap_summary = freemap + freemapwords;
+	first += coremapsize;
+
+	if (first >= last) {
+		/* This cannot happen unless coremap_entry gets really huge */
+		panic("vm: coremap took up all of physical memory?\n");
+	}
+
+	/*
+	 * Now, set things up to reflect the range of memory we're
+	 * managing. Note that we skip the pages the coremap is using.
+	 */
+	base_coremap_page = first / PAGE_SIZE;
+	num_coremap_entries = (last / PAGE_SIZE) - base_coremap_page;
+	num_coremap_kernel = 0;
+	num_coremap_user = 0;
+	num_coremap_free = num_coremap_entries;
+
+	KASSERT(num_coremap_entries + (coremapsize/PAGE_SIZE) == npages);
+
+	pageout_lowater = CM_MIN_SLACK +
+		num_coremap_entries / CM_LOWATER_FRACTION;
+	pageout_hiwater = 2 * pageout_lowater;
+
+	/*
+	 * Initialize the coremap entries.
+	 */
+	for (i=0; i < num_coremap_entries; i++) {
+		coremap[i].cm_kernel = 0;
+		coremap[i].cm_notlast = 0;
+		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
+		coremap[i].cm_freehead = 0;
+		coremap[i].cm_order = 0;
+		coremap[i].cm_pinned = 0;
+		coremap[i].cm_lpage = NULL;
+		coremap[i].cm_owner = NULL;
+		coremap[i].cm_pte = NULL;
+		coremap[i].cm_rmap = NULL;
+	}
+
+	bzero(freemap, (freemapwords + freemap_summarywords) *
+	      sizeof(uint32_t));
+	for (i=0; i < num_coremap_entries; i++) {
+		freemap_update(i);
+		buddy_free_page(i);
+	}
+
+	coremap_pinchan = wchan_create("vmpin");
+	coremap_shootchan = wchan_create("tlbshoot");
+	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
+		panic("Failed allocating coremap wchans\n");
+	}
+
+	zeropage = alloc_kpages(1);
+	if (zeropage == 0) {
+		panic("Failed allocating the zero page\n");
+	}
+	bzero((void *)zeropage, PAGE_SIZE);
+	zero_paddr = KVADDR_TO_PADDR(zeropage);
+}	
+
+////////////////////////////////////////////////////////////
+//
+// Memory allocation
+//
+
+static
+int
+piggish_kernel(int proposed_kernel_pages)
+{
+	uint32_t nkp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	nkp = num_coremap_kernel + proposed_kernel_pages ;
+	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Evicting a page is done in two parts, so that the pageout thread
+ * can start on several victims, and get all their TLB shootdowns
+ * going at once, before finishing any of them. do_evict_start pins
+ * the page and starts its shootdowns; do_evict_finish waits for them
+ * and pages the page out.
+ */
+static
+void
+do_evict_start(int where)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	KASSERT(coremap[where].cm_pinned==0);
+	KASSERT(coremap[where].cm_allocated);
+	KASSERT(coremap[where].cm_kernel==0);
+	KASSERT(coremap[where].cm_lpage != NULL);
+
+	/*
+	 * Pin it now, so it doesn't get e.g. paged out by someone
+	 * else while we're waiting for TLB shootdown.
+	 */
+	coremap[where].cm_pinned = 1;
+
+	coremap_unmap_tlb_start(where);
+}
+
+static
+void
+do_evict_finish(int where)
+{
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+
+	lp = coremap[where].cm_lpage;
+	KASSERT(lp != NULL);
+
+	coremap_unmap_tlb_finish(where);
+	KASSERT(coremap[where].cm_lpage == lp);
+
+	/* properly we ought to lock the lpage to test this */
+	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
+
+	/* release the coremap spinlock in case we need to swap out */
+	spinlock_release(&coremap_spinlock);
+
+	lpage_evict(lp);
+
+	spinlock_acquire(&coremap_spinlock);
+
+	/* because the page is pinned these shouldn't have changed */
+	KASSERT(coremap[where].cm_allocated == 1);
+	KASSERT(coremap[where].cm_lpage == lp);
+	KASSERT(coremap[where].cm_pinned == 1);
+
+	rss_uncharge(where);
+	coremap[where].cm_allocated = 0;
+	coremap[where].cm_referenced = 0;
+	coremap[where].cm_lpage = NULL;
+	coremap[where].cm_pinned = 0;
+	freemap_update(where);
+	buddy_free_page(where);
+
+	num_coremap_user--;
+	num_coremap_free++;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+
+	wchan_wakeall(coremap_pinchan);
+}
+
+static
+void
+do_evict(int where)
+{
+	do_evict_start(where);
+	do_evict_finish(where);
+}
+
+static
+int
+do_page_replace(void)
+{
+	int where;
 
-	if (first >= last) {
-		/* This cannot happen unless coremap_entry gets really huge */
-		panic("vm: coremap took up all of physical memory?\n");
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	while ((where = page_replace()) < 0) {
+		/* everything we could evict is busy; wait for it */
+		coremap_pinwait();
 	}
 
-	/*
-	 * Now, set things up to reflect the range of memory we're
-	 * managing. Note that we skip the pages the coremap is using.
-	 */
-	base_coremap_page = first / PAGE_SIZE;
-	num_coremap_entries = (last / PAGE_SIZE) - base_coremap_page;
-	num_coremap_kernel = 0;
-	num_coremap_user = 0;
-	num_coremap_free = num_coremap_entries;
+	KASSERT(coremap[where].cm_pinned==0);
+	KASSERT(coremap[where].cm_kernel==0);
 
-	KASSERT(num_coremap_entries + (coremapsize/PAGE_SIZE) == npages);
+	if (coremap[where].cm_allocated) {
+		KASSERT(coremap[where].cm_lpage != NULL);
+		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
+		do_evict(where);
+	}
 
-	/*
-	 * Initialize the coremap entries.
-	 */
-	for (i=0; i < num_coremap_entries; i++) {
-		coremap[i].cm_kernel = 0;
-		coremap[i].cm_notlast = 0;
-		coremap[i].cm_allocated = 0;
-		coremap[i].cm_pinned = 0;
-		coremap[i].cm_tlbix = -1;
-		coremap[i].cm_cpunum = 0;
-		coremap[i].cm_lpage = NULL;
+	return where;
+}
+
+/*
+ * Evict one of AS's own pages, because it's at its RSS limit. If it
+ * has none we can evict right now, let it go over.
+ *
+ * Synchronization: takes coremap_spinlock. May block to swap out.
+ */
+static
+void
+rss_evict_local(struct addrspace *as)
+{
+	int where;
+
+	spinlock_acquire(&coremap_spinlock);
+	where = page_replace_local(as);
+	if (where >= 0) {
+		do_evict(where);
+		ct_rss_evictions++;
+		spinlock_acquire(&coremap_rsslock);
+		as->as_rsshits++;
+		spinlock_release(&coremap_rsslock);
 	}
+	spinlock_release(&coremap_spinlock);
+}
 
-	coremap_pinchan = wchan_create("vmpin");
-	coremap_shootchan = wchan_create("tlbshoot");
-	if (coremap_pinchan == NULL || coremap_shootchan == NULL) {
-		panic("Failed allocating coremap wchans\n");
+static
+void
+mark_pages_allocated(int start, int npages, int dopin, int iskern)
+{
+	int i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	for (i=start; i<start+npages; i++) {
+		KASSERT(coremap[i].cm_pinned==0);
+		KASSERT(coremap[i].cm_allocated==0);
+		KASSERT(coremap[i].cm_kernel==0);
+		KASSERT(coremap[i].cm_lpage==NULL);
+		KASSERT(coremap[i].cm_owner==NULL);
+		KASSERT(coremap[i].cm_pte==NULL);
+		KASSERT(!tlb_present(i));
+
+		buddy_take_page(i);
+		if (dopin) {
+			coremap[i].cm_pinned = 1;
+		}
+		coremap[i].cm_allocated = 1;
+		coremap[i].cm_referenced = 1;
+		if (iskern) {
+			coremap[i].cm_kernel = 1;
+		}
+
+		if (i < start+npages-1) {
+			coremap[i].cm_notlast = 1;
+		}
+		freemap_update(i);
 	}
-}	
+	if (iskern) {
+		num_coremap_kernel += npages;
+	}
+	else {
+		num_coremap_user += npages;
+	}
+	num_coremap_free -= npages;
+	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
+	       == num_coremap_entries);
+}
 
 ////////////////////////////////////////////////////////////
 //
-// Memory allocation
-//
+// Page migration
 
+/*
+ * Find a free, unpinned page to migrate into that isn't in the range
+ * LO to HI-1 (the range we're trying to clear): the highest one, like
+ * single-page allocations, to keep the low end of memory for
+ * multipage ones. Returns -1 if there isn't one.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
 static
 int
-piggish_kernel(int proposed_kernel_pages)
+migrate_finddest(uint32_t lo, uint32_t hi)
 {
-	uint32_t nkp;
+	uint32_t i, w;
+	int dest;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	dest = freemap_findlast();
+	if (dest < 0 || (uint32_t)dest < lo || (uint32_t)dest >= hi) {
+		return dest;
+	}
 
-	nkp = num_coremap_kernel + proposed_kernel_pages ;
-	if (nkp >= num_coremap_entries - CM_MIN_SLACK) {
-		return 1;
+	/* everything free above LO is in the range; look below it */
+	i = lo;
+	while (i > 0) {
+		i--;
+		w = freemap[i / 32];
+		if (i % 32 != 31) {
+			w &= ((uint32_t)1 << (i % 32 + 1)) - 1;
+		}
+		if (w != 0) {
+			return (i / 32) * 32 + freemap_highbit(w);
+		}
+		i -= i % 32;
 	}
-	return 0;
+	return -1;
 }
 
+/*
+ * Move the user page at coremap index WHERE to a free page outside LO
+ * to HI-1, instead of evicting it. Like eviction, the page is pinned
+ * and shot down from the TLB first, so its contents can't change while
+ * they're copied; its new page stays pinned until the lpage points at
+ * it. Returns false (having done nothing) if there's no free page to
+ * move it to, or we can't block here.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Releases it to
+ * copy the page, and may wait for a TLB shootdown.
+ */
 static
-void
-do_evict(int where)
+bool
+do_migrate(int where, uint32_t lo, uint32_t hi)
 {
 	struct lpage *lp;
+	struct addrspace *owner;
+	int dest;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-	KASSERT(lock_do_i_hold(global_paging_lock));
-
 	KASSERT(coremap[where].cm_pinned==0);
 	KASSERT(coremap[where].cm_allocated);
 	KASSERT(coremap[where].cm_kernel==0);
 
+	if (curthread == NULL || curthread->t_in_interrupt) {
+		return false;
+	}
+	dest = migrate_finddest(lo, hi);
+	if (dest < 0) {
+		return false;
+	}
+
 	lp = coremap[where].cm_lpage;
 	KASSERT(lp != NULL);
 
-	/*
-	 * Pin it now, so it doesn't get e.g. paged out by someone
-	 * else while we're waiting for TLB shootdown.
-	 */
 	coremap[where].cm_pinned = 1;
-
-	if (coremap[where].cm_tlbix >= 0) {
-		if (coremap[where].cm_cpunum != curcpu->c_number) {
-			/* yay, TLB shootdown */
-			struct tlbshootdown ts;
-			ts.ts_tlbix = coremap[where].cm_tlbix;
-			ts.ts_coremapindex = where;
-			ct_shootdowns_sent++;
-			ipi_tlbshootdown(coremap[where].cm_cpunum, &ts);
-			while (coremap[where].cm_tlbix != -1) {
-				tlb_shootwait();
-			}
-			KASSERT(coremap[where].cm_tlbix == -1);
-			KASSERT(coremap[where].cm_cpunum == 0);
-			KASSERT(coremap[where].cm_lpage == lp);
-		}
-		else {
-			tlb_invalidate(coremap[where].cm_tlbix);
-			coremap[where].cm_tlbix = -1;
-			coremap[where].cm_cpunum = 0;
-		}
-		DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-		      (unsigned long) COREMAP_TO_PADDR(where));
+	mark_pages_allocated(dest, 1 /* npages */, 1 /* dopin */,
+			     0 /* iskern */);
+	coremap[dest].cm_lpage = lp;
+
+	/* the charge moves with it */
+	spinlock_acquire(&coremap_rsslock);
+	owner = coremap[where].cm_owner;
+	if (owner != NULL) {
+		rss_unlink(where);
+		rss_link(dest, owner);
 	}
+	spinlock_release(&coremap_rsslock);
 
-	/* properly we ought to lock the lpage to test this */
-	KASSERT(COREMAP_TO_PADDR(where) == (lp->lp_paddr & PAGE_FRAME));
+	coremap_unmap_tlb(where);
+	KASSERT(coremap[where].cm_lpage == lp);
 
-	/* release the coremap spinlock in case we need to swap out */
 	spinlock_release(&coremap_spinlock);
-
-	lpage_evict(lp);
-
+	lpage_migrate(lp, COREMAP_TO_PADDR(where), COREMAP_TO_PADDR(dest));
 	spinlock_acquire(&coremap_spinlock);
 
-	/* because the page is pinned these shouldn't have changed */
+	/* because both pages are pinned these shouldn't have changed */
 	KASSERT(coremap[where].cm_allocated == 1);
-	KASSERT(coremap[where].cm_lpage == lp);
 	KASSERT(coremap[where].cm_pinned == 1);
+	KASSERT(coremap[dest].cm_lpage == lp);
+	KASSERT(coremap[dest].cm_pinned == 1);
 
 	coremap[where].cm_allocated = 0;
+	coremap[where].cm_referenced = 0;
 	coremap[where].cm_lpage = NULL;
 	coremap[where].cm_pinned = 0;
+	freemap_update(where);
+	buddy_free_page(where);
+
+	coremap[dest].cm_pinned = 0;
+	freemap_update(dest);
 
 	num_coremap_user--;
 	num_coremap_free++;
 	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
 	       == num_coremap_entries);
 
+	ct_compact_migrated++;
 	wchan_wakeall(coremap_pinchan);
+	return true;
 }
 
+/*
+ * Does memory need compacting? That is, is there plenty free but no
+ * free block of COMPACT_ORDER or bigger?
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
 static
-int
-do_page_replace(void)
+bool
+compact_needed(void)
 {
-	int where;
+	unsigned order;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	KASSERT(lock_do_i_hold(global_paging_lock));
 
-	where = page_replace();
+	if (num_coremap_free < pageout_lowater + (1U << COMPACT_ORDER)) {
+		return false;
+	}
+	for (order = COMPACT_ORDER; order < BUDDY_NORDERS; order++) {
+		if (buddy_counts[order] > 0) {
+			return false;
+		}
+	}
+	return true;
+}
 
-	KASSERT(coremap[where].cm_pinned==0);
-	KASSERT(coremap[where].cm_kernel==0);
+/*
+ * Wake the compaction daemon if memory needs compacting. Called after
+ * allocating.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+compact_check(void)
+{
+	if (compact_chan != NULL && compact_needed()) {
+		wchan_wakeone(compact_chan);
+	}
+}
 
-	if (coremap[where].cm_allocated) {
-		KASSERT(coremap[where].cm_lpage != NULL);
-		KASSERT(curthread != NULL && !curthread->t_in_interrupt);
-		do_evict(where);
+////////////////////////////////////////////////////////////
+//
+// Per-CPU free page caches
+
+/*
+ * Give a page from a cache back to the coremap.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+pcache_release_page(uint32_t i)
+{
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(coremap[i].cm_allocated);
+	KASSERT(coremap[i].cm_pinned);
+	KASSERT(!coremap[i].cm_kernel);
+	KASSERT(coremap[i].cm_lpage == NULL);
+	KASSERT(coremap[i].cm_owner == NULL);
+	KASSERT(coremap[i].cm_pte == NULL);
+	KASSERT(!tlb_present(i));
+
+	coremap[i].cm_allocated = 0;
+	coremap[i].cm_referenced = 0;
+	coremap[i].cm_pinned = 0;
+	freemap_update(i);
+	buddy_free_page(i);
+
+	num_coremap_user--;
+	num_coremap_free++;
+}
+
+/*
+ * Give up to N pages from CVM's cache back to the coremap. Returns
+ * how many.
+ *
+ * Synchronization: assumes we hold coremap_spinlock and the cache
+ * lock. Does not block.
+ */
+static
+unsigned
+pcache_drain(struct cpu_vm_machdep *cvm, unsigned n)
+{
+	unsigned done;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+	KASSERT(spinlock_do_i_hold(&cvm->cvm_pcache_lock));
+
+	for (done = 0; done < n && cvm->cvm_pcache_count > 0; done++) {
+		pcache_release_page(cvm->cvm_pcache[--cvm->cvm_pcache_count]);
 	}
+	return done;
+}
 
-	return where;
+/*
+ * Take every page in every CPU's cache back. Used when memory is
+ * tight, or a multipage allocation needs them. Returns how many.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+unsigned
+pcache_reclaim(void)
+{
+	struct cpu_vm_machdep *cvm;
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	n = 0;
+	for (i=0; i<vm_ncpus; i++) {
+		cvm = vm_cpus[i];
+		spinlock_acquire(&cvm->cvm_pcache_lock);
+		n += pcache_drain(cvm, PCACHE_MAX);
+		spinlock_release(&cvm->cvm_pcache_lock);
+	}
+	if (n > 0) {
+		wchan_wakeall(coremap_pinchan);
+	}
+	return n;
 }
 
+/*
+ * Refill CVM's cache with up to PCACHE_BATCH free pages. We don't
+ * evict anything for it, or take pages the pageout daemon is trying
+ * to keep free; the allocation goes the slow way instead.
+ *
+ * Synchronization: takes coremap_spinlock and the cache lock. Does
+ * not block.
+ */
 static
 void
-mark_pages_allocated(int start, int npages, int dopin, int iskern)
+pcache_refill(struct cpu_vm_machdep *cvm)
+{
+	int i;
+
+	spinlock_acquire(&coremap_spinlock);
+	spinlock_acquire(&cvm->cvm_pcache_lock);
+
+	cvm->cvm_pcache_misses++;
+	while (cvm->cvm_pcache_count < PCACHE_BATCH &&
+	       num_coremap_free > pageout_lowater) {
+		i = freemap_findlast();
+		if (i < 0) {
+			break;
+		}
+		mark_pages_allocated(i, 1 /* npages */, 1 /* dopin */,
+				     0 /* iskern */);
+		cvm->cvm_pcache[cvm->cvm_pcache_count++] = i;
+	}
+
+	spinlock_release(&cvm->cvm_pcache_lock);
+	compact_check();
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * Allocate a user page for LP from this CPU's cache, refilling it if
+ * it's empty. Returns INVALID_PADDR if there's nothing to be had that
+ * way. The page comes back pinned, like from coremap_allocuser.
+ *
+ * Synchronization: takes the cache lock; if that doesn't do, see
+ * pcache_refill. Does not block.
+ */
+static
+paddr_t
+pcache_alloc(struct lpage *lp)
+{
+	struct cpu_vm_machdep *cvm;
+	uint32_t i;
+
+	/* if we migrate after this, we just use the other CPU's cache */
+	cvm = &curcpu->c_vm;
+
+	spinlock_acquire(&cvm->cvm_pcache_lock);
+	if (cvm->cvm_pcache_count > 0) {
+		cvm->cvm_pcache_hits++;
+	}
+	else {
+		spinlock_release(&cvm->cvm_pcache_lock);
+		pcache_refill(cvm);
+		spinlock_acquire(&cvm->cvm_pcache_lock);
+		if (cvm->cvm_pcache_count == 0) {
+			spinlock_release(&cvm->cvm_pcache_lock);
+			return INVALID_PADDR;
+		}
+	}
+	i = cvm->cvm_pcache[--cvm->cvm_pcache_count];
+	spinlock_release(&cvm->cvm_pcache_lock);
+
+	KASSERT(coremap[i].cm_allocated && coremap[i].cm_pinned);
+	KASSERT(coremap[i].cm_lpage == NULL);
+	coremap[i].cm_lpage = lp;
+
+	return COREMAP_TO_PADDR(i);
+}
+
+/*
+ * First half of freeing a user page through the caches: called from
+ * coremap_free. If the page isn't in any TLB or page table we just
+ * detach it from its lpage, leaving it allocated and pinned, and
+ * return true; the caller's coremap_unpin (pcache_put) then puts it in
+ * the cache. Otherwise it has to go the slow way to get the TLB entry
+ * shot down or the page table entry cleared.
+ *
+ * Synchronization: none. The page is pinned by us, so nobody else
+ * will look at its coremap entry, except to read cm_lpage (which we
+ * can't write atomically with the bitfields, so we don't write those).
+ * cm_pte can't become non-NULL while the page is pinned, nor can the
+ * page go into a TLB; and with no page table entries, no refill can
+ * be loading it either. So if it's in none now it stays that way.
+ */
+static
+bool
+pcache_free(uint32_t i)
+{
+	if (curthread == NULL || curthread->t_in_interrupt) {
+		return false;
+	}
+	if (!coremap[i].cm_allocated || coremap[i].cm_kernel ||
+	    coremap[i].cm_notlast || tlb_present(i) ||
+	    coremap[i].cm_pte != NULL) {
+		/* let the slow path sort it out (or complain) */
+		return false;
+	}
+	KASSERT(coremap[i].cm_pinned);
+	KASSERT(coremap[i].cm_lpage != NULL);
+
+	rss_uncharge(i);
+	coremap[i].cm_lpage = NULL;
+	return true;
+}
+
+/*
+ * Second half: called from coremap_unpin. If the page was freed by
+ * pcache_free, push it on this CPU's cache and return true. If the
+ * cache is full, drain a batch of it to the coremap first.
+ *
+ * Synchronization: takes the cache lock, and if the cache is full,
+ * coremap_spinlock. Does not block.
+ */
+static
+bool
+pcache_put(uint32_t i)
 {
-	int i;
+	struct cpu_vm_machdep *cvm;
 
-	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
-	for (i=start; i<start+npages; i++) {
-		KASSERT(coremap[i].cm_pinned==0);
-		KASSERT(coremap[i].cm_allocated==0);
-		KASSERT(coremap[i].cm_kernel==0);
-		KASSERT(coremap[i].cm_lpage==NULL);
-		KASSERT(coremap[i].cm_tlbix<0);
-		KASSERT(coremap[i].cm_cpunum == 0);
+	if (!coremap[i].cm_allocated || coremap[i].cm_kernel ||
+	    coremap[i].cm_lpage != NULL) {
+		return false;
+	}
+	KASSERT(coremap[i].cm_pinned);
+	KASSERT(curthread != NULL && !curthread->t_in_interrupt);
 
-		if (dopin) {
-			coremap[i].cm_pinned = 1;
-		}
-		coremap[i].cm_allocated = 1;
-		if (iskern) {
-			coremap[i].cm_kernel = 1;
-		}
+	cvm = &curcpu->c_vm;
 
-		if (i < start+npages-1) {
-			coremap[i].cm_notlast = 1;
-		}
+	spinlock_acquire(&cvm->cvm_pcache_lock);
+	if (cvm->cvm_pcache_count < PCACHE_MAX) {
+		cvm->cvm_pcache[cvm->cvm_pcache_count++] = i;
+		spinlock_release(&cvm->cvm_pcache_lock);
+		return true;
 	}
-	if (iskern) {
-		num_coremap_kernel += npages;
+	spinlock_release(&cvm->cvm_pcache_lock);
+
+	spinlock_acquire(&coremap_spinlock);
+	spinlock_acquire(&cvm->cvm_pcache_lock);
+	pcache_drain(cvm, PCACHE_BATCH);
+	if (cvm->cvm_pcache_count < PCACHE_MAX) {
+		cvm->cvm_pcache[cvm->cvm_pcache_count++] = i;
 	}
 	else {
-		num_coremap_user += npages;
+		pcache_release_page(i);
 	}
-	num_coremap_free -= npages;
-	KASSERT(num_coremap_kernel+num_coremap_user+num_coremap_free
-	       == num_coremap_entries);
+	spinlock_release(&cvm->cvm_pcache_lock);
+	wchan_wakeall(coremap_pinchan);
+	spinlock_release(&coremap_spinlock);
+	return true;
+}
+
+/*
+ * Count the pages in all the caches, for coremap_print_short.
+ */
+static
+unsigned
+pcache_count(void)
+{
+	unsigned i, n;
+
+	n = 0;
+	for (i=0; i<vm_ncpus; i++) {
+		n += vm_cpus[i]->cvm_pcache_count;
+	}
+	return n;
 }
 
 /*
@@ -652,19 +2783,10 @@ static
 paddr_t
 coremap_alloc_one_page(struct lpage *lp, int dopin)
 {
-	int candidate, i, iskern;
+	int candidate, iskern;
 
 	iskern = (lp == NULL);
 
-	/*
-	 * Hold this while allocating to reduce starvation of multipage
-	 * allocations. (But we can't if we're in an interrupt, or if
-	 * we're still very early in boot.)
-	 */
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
-	}
-
 	spinlock_acquire(&coremap_spinlock);
 
 	/*
@@ -673,9 +2795,6 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	if (iskern && piggish_kernel(1)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting 1 page\n");
 		return INVALID_PADDR;
 	}
@@ -691,26 +2810,29 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 
 	if (num_coremap_free > 0) {
 		/* There's a free page. Find it. */
-
-		for (i = num_coremap_entries-1; i>=0; i--) {
-			if (coremap[i].cm_pinned || coremap[i].cm_allocated) {
-				continue;
-			}
-			KASSERT(coremap[i].cm_kernel==0);
-			KASSERT(coremap[i].cm_lpage==NULL);
-			candidate = i;
-			break;
+		candidate = freemap_findlast();
+		if (candidate >= 0) {
+			KASSERT(coremap[candidate].cm_allocated==0);
+			KASSERT(coremap[candidate].cm_pinned==0);
+			KASSERT(coremap[candidate].cm_kernel==0);
+			KASSERT(coremap[candidate].cm_lpage==NULL);
 		}
 	}
 
+	if (candidate < 0 && pcache_reclaim() > 0) {
+		/* the per-CPU caches had some */
+		candidate = freemap_findlast();
+		KASSERT(candidate >= 0);
+	}
+
 	if (candidate < 0 && curthread != NULL && !curthread->t_in_interrupt) {
 		KASSERT(num_coremap_free==0);
 		candidate = do_page_replace();
+		ct_sync_evictions++;
 	}
 
 	if (candidate < 0) {
 		spinlock_release(&coremap_spinlock);
-		/* we don't hold global_paging_lock; don't unlock it */
 		return INVALID_PADDR;
 	}
 
@@ -719,13 +2841,14 @@ coremap_alloc_one_page(struct lpage *lp, int dopin)
 	coremap[candidate].cm_lpage = lp;
 
 	// free pages should not be in the TLB
-	KASSERT(coremap[candidate].cm_tlbix < 0);
-	KASSERT(coremap[candidate].cm_cpunum == 0);
+	KASSERT(!tlb_present(candidate));
 
-	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
+	if (num_coremap_free < pageout_lowater && pageout_chan != NULL) {
+		wchan_wakeone(pageout_chan);
 	}
+	compact_check();
+
+	spinlock_release(&coremap_spinlock);
 
 	return COREMAP_TO_PADDR(candidate);
 }
@@ -736,29 +2859,43 @@ coremap_alloc_multipages(unsigned npages)
 {
 	int base, bestbase;
 	int badness, bestbadness;
-	int evicted;
+	int moved;
 	unsigned i;
 
 	KASSERT(npages>1);
 
 	/*
-	 * Get this early and hold it during the allocation so nobody else
-	 * can start paging while we're trying to page out the victims in
-	 * the allocation range.
+	 * Usually there's a free run of the right size in the buddy
+	 * lists.
 	 */
-
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_acquire(global_paging_lock);
+	spinlock_acquire(&coremap_spinlock);
+	if (!piggish_kernel(npages)) {
+		base = buddy_findrun(npages);
+		if (base < 0 && pcache_reclaim() > 0) {
+			/* pages in the per-CPU caches may fill the gap */
+			base = buddy_findrun(npages);
+		}
+		if (base >= 0) {
+			mark_pages_allocated(base, npages, 
+					     0 /* dopin */, 1 /* kernel */);
+			ct_buddy_allocs++;
+			spinlock_release(&coremap_spinlock);
+			return COREMAP_TO_PADDR(base);
+		}
 	}
+	spinlock_release(&coremap_spinlock);
+
+	/*
+	 * Otherwise, fall back to making room by moving user pages out
+	 * of the way: migrating them to free pages elsewhere if there
+	 * are any, and evicting them if not.
+	 */
 
 	spinlock_acquire(&coremap_spinlock);
 
 	if (piggish_kernel(npages)) {
 		coremap_print_short();
 		spinlock_release(&coremap_spinlock);
-		if (curthread != NULL && !curthread->t_in_interrupt) {
-			lock_release(global_paging_lock);
-		}
 		kprintf("alloc_kpages: kernel heap full getting %u pages\n",
 			npages);
 		return INVALID_PADDR;
@@ -766,7 +2903,7 @@ coremap_alloc_multipages(unsigned npages)
 
 	/*
 	 * Look for the best block of this length.
-	 * "badness" counts how many evictions we need to do.
+	 * "badness" counts how many pages we need to move.
 	 * Find the block where it's smallest.
 	 */
 
@@ -816,51 +2953,47 @@ coremap_alloc_multipages(unsigned npages)
 		if (bestbase < 0) {
 			/* no good */
 			spinlock_release(&coremap_spinlock);
-			if (curthread != NULL && !curthread->t_in_interrupt) {
-				lock_release(global_paging_lock);
-			}
 			return INVALID_PADDR;
 		}
 
 		/*
-		 * If any pages need evicting, evict them and try the
-		 * whole schmear again. Because we are holding
-		 * global_paging_lock, nobody else *ought* to allocate
-		 * or pin these pages until we're done. But the
-		 * contract with global_paging_lock is that it's
-		 * advisory -- so tolerate and retry if/in case
-		 * something changes while we're paging.
+		 * If any pages need moving, move them and try the
+		 * whole schmear again. do_migrate and do_evict drop
+		 * the coremap lock, so other threads may allocate or
+		 * pin pages in the range while we're at it; tolerate
+		 * that and retry if it happens.
 		 */
 
-		evicted = 0;
+		moved = 0;
 		for (i=bestbase; i<bestbase+npages; i++) {
 			if (coremap[i].cm_pinned || coremap[i].cm_kernel) {
 				/* Whoops... retry */
-				KASSERT(evicted==1);
+				KASSERT(moved==1);
 				break;
 			}
 			if (coremap[i].cm_allocated) {
 				if (curthread == NULL ||
 				    curthread->t_in_interrupt) {
-					/* Can't evict here */
+					/* Can't move anything here */
 					spinlock_release(&coremap_spinlock);
-					/* don't need to unlock */
 					return INVALID_PADDR;
 				}
-				do_evict(i);
-				evicted = 1;
+				if (!do_migrate(i, bestbase,
+						bestbase + npages)) {
+					do_evict(i);
+					ct_compact_evicted++;
+				}
+				moved = 1;
 			}
 		}
-	} while (evicted);
+	} while (moved);
 
 	mark_pages_allocated(bestbase, npages, 
 			     0 /* dopin -- not needed for kernel pages */,
 			     1 /* kernel */);
+	ct_buddy_moveallocs++;
 				     
 	spinlock_release(&coremap_spinlock);
-	if (curthread != NULL && !curthread->t_in_interrupt) {
-		lock_release(global_paging_lock);
-	}
 	return COREMAP_TO_PADDR(bestbase);
 }
 
@@ -876,8 +3009,76 @@ coremap_alloc_multipages(unsigned npages)
 paddr_t
 coremap_allocuser(struct lpage *lp)
 {
+	struct addrspace *as;
+	paddr_t pa;
+
+	KASSERT(!curthread->t_in_interrupt);
+
+	as = curthread->t_addrspace;
+	if (as != NULL && as->as_rsslimit > 0 &&
+	    as->as_rss >= as->as_rsslimit) {
+		/* (unlocked peek; being a page over now and then is ok) */
+		rss_evict_local(as);
+	}
+
+	pa = pcache_alloc(lp);
+	if (pa == INVALID_PADDR) {
+		pa = coremap_alloc_one_page(lp, 1 /* dopin */);
+	}
+	if (pa != INVALID_PADDR && as != NULL) {
+		rss_charge(PADDR_TO_COREMAP(pa), as);
+	}
+	return pa;
+}
+
+/*
+ * coremap_disown
+ *
+ * Drop all the charges to AS, which is going away. Pages it faulted
+ * in that are still in use (shared with other address spaces, or not
+ * yet freed) stay resident but aren't charged to anyone.
+ *
+ * Synchronization: takes coremap_rsslock. Does not block.
+ */
+void
+coremap_disown(struct addrspace *as)
+{
+	spinlock_acquire(&coremap_rsslock);
+	while (as->as_rss > 0) {
+		rss_unlink(as->as_rsshand);
+	}
+	spinlock_release(&coremap_rsslock);
+}
+
+/*
+ * coremap_evictas
+ *
+ * Evict every page charged to AS that isn't pinned, for the load
+ * controller, which swaps out suspended processes. Returns how many
+ * were evicted. Pages AS shares with others go too if it faulted
+ * them in; they'll be faulted back in if still needed.
+ *
+ * Synchronization: takes coremap_spinlock. Blocks to swap out.
+ */
+unsigned
+coremap_evictas(struct addrspace *as)
+{
+	uint32_t i;
+	unsigned n;
+
 	KASSERT(!curthread->t_in_interrupt);
-	return coremap_alloc_one_page(lp, 1 /* dopin */);
+
+	n = 0;
+	spinlock_acquire(&coremap_spinlock);
+	for (i=0; i<num_coremap_entries; i++) {
+		/* (cm_owner is only a hint without coremap_rsslock) */
+		if (coremap[i].cm_owner == as && page_evictable(i)) {
+			do_evict(i);
+			n++;
+		}
+	}
+	spinlock_release(&coremap_spinlock);
+	return n;
 }
 
 /*
@@ -887,7 +3088,8 @@ coremap_allocuser(struct lpage *lp)
  * the same block. Cross-checks the iskern flag against the flags
  * maintained in the coremap entry.
  *
- * Synchronization: takes coremap_spinlock. Does not block.
+ * Synchronization: takes coremap_spinlock. Does not block for kernel
+ * pages; may block for TLB shootdown when freeing a user page.
  */
 void
 coremap_free(paddr_t page, bool iskern)
@@ -895,11 +3097,15 @@ coremap_free(paddr_t page, bool iskern)
 	uint32_t i, ppn;
 
 	ppn = PADDR_TO_COREMAP(page);	
-	
-	spinlock_acquire(&coremap_spinlock);
-
 	KASSERT(ppn<num_coremap_entries);
 
+	if (!iskern && pcache_free(ppn)) {
+		/* coremap_unpin will finish the job */
+		return;
+	}
+
+	spinlock_acquire(&coremap_spinlock);
+
 	for (i = ppn; i < num_coremap_entries; i++) {
 		if (!coremap[i].cm_allocated) {
 			panic("coremap_free: freeing free page (pa 0x%x)\n",
@@ -913,85 +3119,396 @@ coremap_free(paddr_t page, bool iskern)
 		 */
 		KASSERT(iskern || coremap[i].cm_pinned);
 
-		/* flush any live mapping */
-		if (coremap[i].cm_tlbix >= 0) {
-			/* should only release one's own pages */
-			KASSERT(coremap[i].cm_cpunum == curcpu->c_number);
+		/*
+		 * Flush any live mapping. Kernel pages are never in
+		 * the TLB; a user page may still be in other CPUs'
+		 * TLBs if address spaces that mapped it ran there, so
+		 * this may have to wait for shootdowns.
+		 */
+		if (coremap[i].cm_pte != NULL || tlb_present(i)) {
+			KASSERT(!iskern);
+			coremap_unmap_tlb(i);
+		}
+
+		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
+		      COREMAP_TO_PADDR(i));
+
+		/* now we can actually deallocate the page */
+
+		coremap[i].cm_allocated = 0;
+		coremap[i].cm_referenced = 0;
+		if (coremap[i].cm_kernel) {
+			KASSERT(coremap[i].cm_lpage == NULL);
+			num_coremap_kernel--;
+			KASSERT(iskern);
+			coremap[i].cm_kernel = 0;
+		}
+		else {
+			KASSERT(coremap[i].cm_lpage != NULL);
+			rss_uncharge(i);
+			KASSERT(coremap[i].cm_pte == NULL);
+			num_coremap_user--;
+			KASSERT(!iskern);
+		}
+		num_coremap_free++;
+
+		coremap[i].cm_lpage = NULL;
+		freemap_update(i);
+		buddy_free_page(i);
+
+		if (!coremap[i].cm_notlast) {
+			break;
+		}
+
+		coremap[i].cm_notlast = 0;
+	}
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * alloc_kpages
+ *
+ * Allocate some kernel-space virtual pages.
+ * This is the interface kmalloc uses to get pages for its use.
+ *
+ * Synchronization: takes coremap_spinlock.
+ * May block to swap pages out.
+ */
+vaddr_t 
+alloc_kpages(int npages)
+{
+	paddr_t pa;
+	if (npages > 1) {
+		pa = coremap_alloc_multipages(npages);
+	}
+	else {
+		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
+	}
+	if (pa==INVALID_PADDR) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+/*
+ * free_kpages
+ *
+ * Free pages allocated with alloc_kpages.
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void 
+free_kpages(vaddr_t addr)
+{
+	coremap_free(KVADDR_TO_PADDR(addr), true /* iskern */);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pageout daemon
+
+/*
+ * Write out up to SWAP_CLUSTER_MAX dirty pages the clock hand is
+ * about to reach, skipping ones that look in use, as one cluster.
+ * The pages are pinned (and not in the TLB) while they're written, so
+ * they can't be redirtied behind our back; lpage_clean clears their
+ * dirty bits. Pages a refill loads into a TLB just as we pick them
+ * are put back.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Releases it to
+ * do I/O.
+ */
+static
+void
+pageout_clean_ahead(void)
+{
+	struct lpage *lps[SWAP_CLUSTER_MAX];
+	uint32_t where[SWAP_CLUSTER_MAX];
+	uint32_t i, n, nfound, nkept;
+	struct lpage *lp;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	nfound = 0;
+	for (n = 0; n < num_coremap_entries && nfound < SWAP_CLUSTER_MAX;
+	     n++) {
+		i = (replace_hand + n) % num_coremap_entries;
+		if (!page_evictable(i) || coremap[i].cm_referenced ||
+		    tlb_present(i)) {
+			continue;
+		}
+		lp = coremap[i].cm_lpage;
+		KASSERT(lp != NULL);
+		if (!LP_ISDIRTY(lp)) {
+			continue;
+		}
+
+		coremap[i].cm_pinned = 1;
+		/* so the next write faults and redirties it */
+		pt_clear(i);
+		lps[nfound] = lp;
+		where[nfound] = i;
+		nfound++;
+	}
+
+	/* mmu_refill doesn't take coremap_spinlock; catch any that got in */
+	tlb_sync();
+	nkept = 0;
+	for (n = 0; n < nfound; n++) {
+		i = where[n];
+		if (tlb_present(i)) {
+			coremap[i].cm_pinned = 0;
+			wchan_wakeall(coremap_pinchan);
+			continue;
+		}
+		lps[nkept] = lps[n];
+		where[nkept] = i;
+		nkept++;
+	}
+	nfound = nkept;
+
+	if (nfound == 0) {
+		return;
+	}
+
+	spinlock_release(&coremap_spinlock);
+	lpage_clean(lps, nfound);
+	spinlock_acquire(&coremap_spinlock);
+
+	for (n = 0; n < nfound; n++) {
+		i = where[n];
+		KASSERT(coremap[i].cm_pinned);
+		KASSERT(coremap[i].cm_lpage == lps[n]);
+		coremap[i].cm_pinned = 0;
+	}
+	wchan_wakeall(coremap_pinchan);
+	ct_pageout_cleaned += nfound;
+}
+
+/*
+ * Evict up to PAGEOUT_BATCH victims chosen by the replacement policy,
+ * but no more than it takes to reach the high watermark. Their TLB
+ * shootdowns all go out before we page out the first one, so they're
+ * usually done by the time we get to the rest. Returns the number
+ * evicted, which is 0 if there was nothing we could evict.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Releases it to
+ * do I/O and to wait for shootdowns.
+ */
+static
+unsigned
+pageout_evict_batch(void)
+{
+	int where[PAGEOUT_BATCH];
+	unsigned i, n;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (n = 0; n < PAGEOUT_BATCH &&
+		     num_coremap_free + n < pageout_hiwater; n++) {
+		where[n] = page_replace();
+		if (where[n] < 0) {
+			break;
+		}
+		do_evict_start(where[n]);
+	}
+	tlb_shootdown_flush();
+
+	for (i = 0; i < n; i++) {
+		do_evict_finish(where[i]);
+	}
+	return n;
+}
+
+/*
+ * The pageout daemon. Sleeps until free pages drop below the low
+ * watermark, then evicts (with the current replacement policy) until
+ * they're back at the high watermark, a batch at a time, cleaning
+ * ahead of the hand every SWAP_CLUSTER_MAX pages. It drops the coremap
+ * lock between steps, and pages being written are only pinned, so
+ * faulting threads paging in go ahead alongside it.
+ */
+static
+void
+pageout_thread(void *data1, unsigned long data2)
+{
+	unsigned n, sinceclean;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&coremap_spinlock);
+		while (num_coremap_free >= pageout_lowater) {
+			wchan_lock(pageout_chan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(pageout_chan);
+			spinlock_acquire(&coremap_spinlock);
+		}
+		ct_pageout_wakeups++;
+		spinlock_release(&coremap_spinlock);
+
+		sinceclean = SWAP_CLUSTER_MAX;
+		while (1) {
+			spinlock_acquire(&coremap_spinlock);
+			if (num_coremap_free >= pageout_hiwater) {
+				pageout_clean_ahead();
+				spinlock_release(&coremap_spinlock);
+				break;
+			}
+			if (sinceclean >= SWAP_CLUSTER_MAX) {
+				pageout_clean_ahead();
+				sinceclean = 0;
+				spinlock_release(&coremap_spinlock);
+				continue;
+			}
+			n = pageout_evict_batch();
+			if (n == 0 && pcache_reclaim() > 0) {
+				spinlock_release(&coremap_spinlock);
+				continue;
+			}
+			if (n == 0) {
+				/* Everything is pinned. Wait for an unpin. */
+				coremap_pinwait();
+				spinlock_release(&coremap_spinlock);
+				continue;
+			}
+			ct_pageout_evicted += n;
+			sinceclean += n;
+			spinlock_release(&coremap_spinlock);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Compaction daemon
+
+/*
+ * Clear one aligned block of 2^ORDER pages by migrating the user pages
+ * in it elsewhere: the block with the fewest, among those with no
+ * kernel or pinned pages. Returns true if the block ended up free.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Releases it to
+ * migrate pages.
+ */
+static
+bool
+compact_block(unsigned order)
+{
+	uint32_t n, start, beststart, i;
+	unsigned badness, bestbadness;
 
-			tlb_invalidate(coremap[i].cm_tlbix);
-			coremap[i].cm_tlbix = -1;
-			coremap[i].cm_cpunum = 0;
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 
-			DEBUG(DB_TLB, "... pa 0x%05lx --> tlb --\n", 
-				(unsigned long) COREMAP_TO_PADDR(i));
+	n = 1U << order;
+	beststart = 0;
+	bestbadness = n + 1;
+	for (start = 0; start + n <= num_coremap_entries; start += n) {
+		badness = 0;
+		for (i = start; i < start + n; i++) {
+			if (coremap[i].cm_kernel || coremap[i].cm_pinned) {
+				badness = n + 1;
+				break;
+			}
+			if (coremap[i].cm_allocated) {
+				badness++;
+			}
 		}
+		if (badness < bestbadness) {
+			beststart = start;
+			bestbadness = badness;
+		}
+	}
 
-		DEBUG(DB_VM,"coremap_free: freeing pa 0x%x\n",
-		      COREMAP_TO_PADDR(i));
-
-		/* now we can actually deallocate the page */
+	/* (a block with nothing in it would already be free) */
+	if (bestbadness == 0 || bestbadness > n ||
+	    bestbadness > num_coremap_free - (n - bestbadness)) {
+		return false;
+	}
 
-		coremap[i].cm_allocated = 0;
-		if (coremap[i].cm_kernel) {
-			KASSERT(coremap[i].cm_lpage == NULL);
-			num_coremap_kernel--;
-			KASSERT(iskern);
-			coremap[i].cm_kernel = 0;
+	for (i = beststart; i < beststart + n; i++) {
+		if (coremap[i].cm_kernel || coremap[i].cm_pinned) {
+			/* someone got in while we were migrating */
+			return false;
 		}
-		else {
-			KASSERT(coremap[i].cm_lpage != NULL);
-			num_coremap_user--;
-			KASSERT(!iskern);
+		if (coremap[i].cm_allocated &&
+		    !do_migrate(i, beststart, beststart + n)) {
+			return false;
 		}
-		num_coremap_free++;
+	}
+	return true;
+}
 
-		coremap[i].cm_lpage = NULL;
+/*
+ * The compaction daemon. Sleeps until an allocation leaves memory
+ * fragmented (see compact_needed), then clears blocks of COMPACT_ORDER
+ * until it isn't. The per-CPU caches are emptied first, since pages
+ * sitting in them can't be moved.
+ */
+static
+void
+compact_thread(void *data1, unsigned long data2)
+{
+	bool done;
 
-		if (!coremap[i].cm_notlast) {
-			break;
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&coremap_spinlock);
+		while (!compact_needed()) {
+			wchan_lock(compact_chan);
+			spinlock_release(&coremap_spinlock);
+			wchan_sleep(compact_chan);
+			spinlock_acquire(&coremap_spinlock);
 		}
+		ct_compact_wakeups++;
 
-		coremap[i].cm_notlast = 0;
-	}
+		done = true;
+		pcache_reclaim();
+		while (compact_needed()) {
+			if (!compact_block(COMPACT_ORDER)) {
+				done = false;
+				break;
+			}
+			ct_compact_blocks++;
+		}
+		spinlock_release(&coremap_spinlock);
 
-	spinlock_release(&coremap_spinlock);
+		if (!done) {
+			/* nothing we can do right now; don't spin */
+			clocksleep(COMPACT_BACKOFF);
+		}
+	}
 }
 
 /*
- * alloc_kpages
- *
- * Allocate some kernel-space virtual pages.
- * This is the interface kmalloc uses to get pages for its use.
- *
- * Synchronization: takes coremap_spinlock.
- * May block to swap pages out.
+ * Start the pageout and compaction daemons. Called once swap is
+ * available.
  */
-vaddr_t 
-alloc_kpages(int npages)
+void
+coremap_pageout_bootstrap(void)
 {
-	paddr_t pa;
-	if (npages > 1) {
-		pa = coremap_alloc_multipages(npages);
-	}
-	else {
-		pa = coremap_alloc_one_page(NULL, 0 /* dopin */);
+	int result;
+
+	pageout_chan = wchan_create("pageout");
+	compact_chan = wchan_create("compact");
+	if (pageout_chan == NULL || compact_chan == NULL) {
+		panic("Failed allocating pageout wchans\n");
 	}
-	if (pa==INVALID_PADDR) {
-		return 0;
+
+	result = thread_fork("pageout", pageout_thread, NULL, 0, NULL);
+	if (result) {
+		panic("Failed starting pageout daemon: %s\n",
+		      strerror(result));
 	}
-	return PADDR_TO_KVADDR(pa);
-}
 
-/*
- * free_kpages
- *
- * Free pages allocated with alloc_kpages.
- * Synchronization: takes coremap_spinlock. Does not block.
- */
-void 
-free_kpages(vaddr_t addr)
-{
-	coremap_free(KVADDR_TO_PADDR(addr), true /* iskern */);
+	result = thread_fork("compact", compact_thread, NULL, 0, NULL);
+	if (result) {
+		panic("Failed starting compaction daemon: %s\n",
+		      strerror(result));
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1007,12 +3524,31 @@ void
 coremap_print_short(void)
 {
 	uint32_t i, atbol=1;
+	uint32_t run, maxrun;
 
 	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
 		
-	kprintf("Coremap: %u entries, %uk/%uu/%uf\n",
+	kprintf("Coremap: %u entries, %uk/%uu/%uf, %u in per-CPU caches\n",
 		num_coremap_entries,
-		num_coremap_kernel, num_coremap_user, num_coremap_free);
+		num_coremap_kernel, num_coremap_user, num_coremap_free,
+		pcache_count());
+
+	kprintf("Free blocks by order:");
+	for (i=0; i<BUDDY_NORDERS; i++) {
+		kprintf(" %u:%u", i, buddy_counts[i]);
+	}
+	kprintf("\n");
+
+	run = maxrun = 0;
+	for (i=0; i<num_coremap_entries; i++) {
+		run = coremap[i].cm_allocated ? 0 : run + 1;
+		if (run > maxrun) {
+			maxrun = run;
+		}
+	}
+	kprintf("Compaction: %u pages migrated, %u evicted, "
+		"largest free run %u pages\n", ct_compact_migrated,
+		ct_compact_evicted, maxrun);
 
 	for (i=0; i<num_coremap_entries; i++) {
 		if (atbol) {
@@ -1025,6 +3561,10 @@ coremap_print_short(void)
 		else if (coremap[i].cm_kernel) {
 			kprintf("K");
 		}
+		else if (coremap[i].cm_allocated &&
+			 coremap[i].cm_lpage == NULL) {
+			kprintf("c");
+		}
 		else if (coremap[i].cm_allocated && coremap[i].cm_pinned) {
 			kprintf("&");
 		}
@@ -1045,19 +3585,6 @@ coremap_print_short(void)
 }
 #undef NCOLS
 
-/*
- * coremap_pinwait: wait for a pinned page to unpin.
- */
-static
-void
-coremap_pinwait(void)
-{
-	wchan_lock(coremap_pinchan);
-	spinlock_release(&coremap_spinlock);
-	wchan_sleep(coremap_pinchan);
-	spinlock_acquire(&coremap_spinlock);
-}
-
 /*
  * coremap_pin: mark page pinned for manipulation of contents.
  *
@@ -1076,9 +3603,21 @@ coremap_pin(paddr_t paddr)
 		coremap_pinwait();
 	}
 	coremap[ix].cm_pinned = 1;
+	freemap_update(ix);
 	spinlock_release(&coremap_spinlock);
 }
 
+/*
+ * coremap_npages: return the number of physical pages in the coremap.
+ *
+ * Synchronization: none; it doesn't change after bootstrap.
+ */
+unsigned
+coremap_npages(void)
+{
+	return num_coremap_entries;
+}
+
 /*
  * coremap_pageispinned: checks if page is marked pinned.
  *
@@ -1115,9 +3654,15 @@ coremap_unpin(paddr_t paddr)
 	ix = PADDR_TO_COREMAP(paddr);
 	KASSERT(ix<num_coremap_entries);
 
+	if (pcache_put(ix)) {
+		/* it was freed, and went into a per-CPU cache */
+		return;
+	}
+
 	spinlock_acquire(&coremap_spinlock);
 	KASSERT(coremap[ix].cm_pinned);
 	coremap[ix].cm_pinned = 0;
+	freemap_update(ix);
 	wchan_wakeall(coremap_pinchan);
 	spinlock_release(&coremap_spinlock);
 }
@@ -1174,79 +3719,192 @@ coremap_copy_page(paddr_t oldpaddr, paddr_t newpaddr)
 void
 mmu_setas(struct addrspace *as)
 {
+	uint32_t asid;
+
 	spinlock_acquire(&coremap_spinlock);
-	if (as != curcpu->c_vm.cvm_lastas) {
-		curcpu->c_vm.cvm_lastas = as;
-		tlb_clear();
+	tlb_lock();
+	tlb_purgedead();
+	/*
+	 * Look up the ASID even if AS is the same pointer as last
+	 * time: the old address space may have been destroyed and the
+	 * memory reused, in which case the new one has no ASID yet.
+	 */
+	asid = (as == NULL) ? 0 : tlb_getasid(as);
+	if (as != NULL) {
+		as->as_machdep.am_cpumask |= (uint32_t)1 << curcpu->c_number;
+	}
+	curcpu->c_vm.cvm_lastas = as;
+	if (asid != curcpu->c_vm.cvm_curasid) {
+		curcpu->c_vm.cvm_curasid = asid;
+		tlb_setasid(asid);
 	}
+	tlb_unlock();
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
- * mmu_unmap: Remove a translation from the MMU.
+ * tlb_retire_others: retire AS's ASIDs on the CPUs other than this
+ * one (see tlb_retire). It'll get a fresh ASID next time it runs
+ * there, which puts that CPU back in am_cpumask.
+ *
+ * Synchronization: assumes we hold coremap_spinlock. Does not block.
+ */
+static
+void
+tlb_retire_others(struct addrspace *as)
+{
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&coremap_spinlock));
+
+	for (i=0; i<MAXCPUS; i++) {
+		if (i != curcpu->c_number &&
+		    (as->as_machdep.am_cpumask & ((uint32_t)1 << i))) {
+			tlb_retire(&as->as_machdep, i);
+		}
+	}
+	as->as_machdep.am_cpumask &= (uint32_t)1 << curcpu->c_number;
+}
+
+/*
+ * mmu_unmap: Remove a translation from the MMU. A page can be in more
+ * than one TLB entry, so AS may still have the translation on a CPU
+ * it ran on before; rather than go looking, retire its ASIDs there.
  *
  * Synchronization: takes coremap_spinlock. Does not block.
  */
 void
 mmu_unmap(struct addrspace *as, vaddr_t va)
 {
+	uint32_t asid;
+
+	spinlock_acquire(&coremap_spinlock);
+	pt_unmap(&as->as_machdep, va);
+	tlb_retire_others(as);
+	asid = tlb_asidof(as);
+	if (asid != 0) {
+		tlb_lock();
+		tlb_unmap(va, asid);
+		tlb_unlock();
+	}
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_writeprotect: make all of AS's translations read-only, as when
+ * fork makes its pages copy-on-write. Rather than going through the
+ * pages one at a time, clear the dirty bit in every entry of its page
+ * table and retire all its TLB entries at once by making its ASIDs
+ * stale, here as well as on the other CPUs; here it gets a fresh one
+ * right away. Its pages then come back read-only through mmu_refill,
+ * and the first write to each takes the full fault path.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void
+mmu_writeprotect(struct addrspace *as)
+{
+	struct addrspace_machdep *am = &as->as_machdep;
+	uint32_t *pt, asid;
+	unsigned i, j;
+
 	spinlock_acquire(&coremap_spinlock);
+
+	if (am->am_pagetable != NULL) {
+		for (i=0; i<PT_NDIR; i++) {
+			pt = am->am_pagetable[i];
+			if (pt == NULL) {
+				continue;
+			}
+			for (j=0; j<PT_NPTES; j++) {
+				pt[j] &= ~(uint32_t)TLBLO_DIRTY;
+			}
+		}
+	}
+
+	tlb_retire_others(as);
+	tlb_retire(am, curcpu->c_number);
+	tlb_lock();
+	tlb_purgedead();
 	if (as == curcpu->c_vm.cvm_lastas) {
-		tlb_unmap(va);
+		asid = tlb_getasid(as);
+		curcpu->c_vm.cvm_curasid = asid;
+		tlb_setasid(asid);
 	}
+	tlb_unlock();
+
 	spinlock_release(&coremap_spinlock);
 }
 
 /*
  * mmu_map: Enter a translation into the MMU. (This is the end result
- * of fault handling.)
+ * of fault handling.) It also goes in the page table, so that the next
+ * time it falls out of the TLB mmu_refill can put it back.
  *
- * Synchronization: Takes coremap_spinlock. Does not block.
+ * The page may be in other TLB entries too, here or on other CPUs, for
+ * other address spaces sharing it or at other addresses in this one;
+ * that's fine, since they all map it read-only unless it's private.
+ *
+ * Synchronization: Takes coremap_spinlock. May block to allocate page
+ * table space.
  */
 void
 mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 {
 	int tlbix;
-	uint32_t ehi, elo;
+	uint32_t ehi, elo, asid, *pte;
 	unsigned cmix;
 	
 	KASSERT(pa/PAGE_SIZE >= base_coremap_page);
 	KASSERT(pa/PAGE_SIZE - base_coremap_page < num_coremap_entries);
+
+	pt_prepare(&as->as_machdep, va);
 	
 	spinlock_acquire(&coremap_spinlock);
 
-	KASSERT(as == curcpu->c_vm.cvm_lastas);
-
 	cmix = PADDR_TO_COREMAP(pa);
 	KASSERT(cmix < num_coremap_entries);
 
 	/* Page must be pinned. */
 	KASSERT(coremap[cmix].cm_pinned);
 
-	tlbix = tlb_probe(va, 0);
-	if (tlbix < 0) {
-		KASSERT(coremap[cmix].cm_tlbix == -1);
-		KASSERT(coremap[cmix].cm_cpunum == 0);
-		tlbix = mipstlb_getslot();
-		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
-		coremap[cmix].cm_tlbix = tlbix;
-		coremap[cmix].cm_cpunum = curcpu->c_number;
-		DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
-			(unsigned long) COREMAP_TO_PADDR(cmix), tlbix);
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+	asid = curcpu->c_vm.cvm_curasid;
+	KASSERT(asid > 0 && asid < NUM_ASID);
+	ehi = (va & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+
+	tlb_lock();
+	tlbix = tlb_probe(ehi, 0);
+	if (tlbix >= 0) {
+		/*
+		 * VA is mapped already: read-only, or to a different
+		 * page (e.g. the old shared page after a copy-on-write
+		 * split). Reuse the slot.
+		 */
+		tlb_invalidate(tlbix);
 	}
 	else {
-		KASSERT(tlbix>=0 && tlbix<NUM_TLB);
-		KASSERT(coremap[cmix].cm_tlbix == tlbix);
-		KASSERT(coremap[cmix].cm_cpunum == curcpu->c_number);
+		tlbix = mipstlb_getslot();
+		ct_tlb_refills++;
 	}
+	KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+	DEBUG(DB_TLB, "... pa 0x%05lx <-> tlb %d\n", 
+	      (unsigned long) COREMAP_TO_PADDR(cmix), tlbix);
 
-	ehi = va & TLBHI_VPAGE;
 	elo = (pa & TLBLO_PPAGE) | TLBLO_VALID;
 	if (writable) {
 		elo |= TLBLO_DIRTY;
 	}
 
 	tlb_write(ehi, elo, tlbix);
+	curcpu->c_vm.cvm_tlbcount[cmix]++;
+	tlb_unlock();
+	coremap[cmix].cm_referenced = 1;
+
+	pte = pt_lookup(&as->as_machdep, va);
+	if (pte != NULL) {
+		pt_set(pte, cmix, elo);
+	}
 
 	/* Unpin the page. */
 	coremap[cmix].cm_pinned = 0;
@@ -1254,3 +3912,213 @@ mmu_map(struct addrspace *as, vaddr_t va, paddr_t pa, int writable)
 
 	spinlock_release(&coremap_spinlock);
 }
+
+/*
+ * mmu_refill: the fast path for TLB misses. If AS's page table has a
+ * usable entry for VA, load it into the TLB and return true; the fault
+ * is then handled without touching the address space, the vm_object,
+ * or the lpage. Otherwise return false and the caller takes the full
+ * fault path (which calls mmu_map, so the entry is there next time).
+ *
+ * We give up on write faults on pages mapped read-only (they need to
+ * be dirtied, or copied on write), which are rare.
+ *
+ * This takes only this CPU's TLB lock, not coremap_spinlock, so TLB
+ * misses on different CPUs don't contend. The page table entry is
+ * read without coremap_spinlock: it's one word, and every entry that
+ * stops being valid is cleared before the page's TLB entries are
+ * revoked. Whoever clears it either is AS's own thread (which is here,
+ * not there) or calls tlb_sync before looking at the TLB counts, which
+ * waits for us; so whatever we load here gets counted in time to be
+ * shot down. For the same reason we don't look at cm_pinned: a page
+ * that's being taken away has no entries left to find. Nor do we set
+ * cm_referenced; the clock counts a page in a TLB as in use anyway.
+ *
+ * It's in C, called from vm_fault, rather than in the assembler
+ * refill handler, because loading a page into the TLB has to update
+ * this CPU's TLB count for it (cvm_tlbcount).
+ *
+ * Synchronization: takes this CPU's TLB lock. Does not block.
+ */
+bool
+mmu_refill(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	struct cpu_vm_machdep *cvm;
+	int tlbix, spl;
+	uint32_t ehi, elo, asid, *pte;
+	unsigned cmix;
+	bool ret = false;
+
+	if (!mmu_fastrefill || faulttype == VM_FAULT_READONLY) {
+		return false;
+	}
+
+	/* interrupts off first, so we stay on the CPU whose TLB we lock */
+	spl = splhigh();
+	cvm = &curcpu->c_vm;
+	spinlock_acquire(&cvm->cvm_tlblock);
+
+	pte = pt_lookup(&as->as_machdep, va);
+	if (pte == NULL || as != cvm->cvm_lastas) {
+		goto done;
+	}
+	elo = *pte;
+	if (elo == 0) {
+		goto done;
+	}
+	if (faulttype == VM_FAULT_WRITE && (elo & TLBLO_DIRTY) == 0) {
+		goto done;
+	}
+
+	cmix = PADDR_TO_COREMAP(elo & TLBLO_PPAGE);
+	KASSERT(cmix < num_coremap_entries);
+
+	asid = cvm->cvm_curasid;
+	KASSERT(asid > 0 && asid < NUM_ASID);
+	ehi = (va & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+
+	tlbix = tlb_probe(ehi, 0);
+	if (tlbix >= 0) {
+		tlb_invalidate(tlbix);
+	}
+	else {
+		tlbix = mipstlb_getslot();
+	}
+	KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+
+	tlb_write(ehi, elo, tlbix);
+	cvm->cvm_tlbcount[cmix]++;
+	cvm->cvm_fastrefills++;
+	ret = true;
+
+ done:
+	spinlock_release(&cvm->cvm_tlblock);
+	splx(spl);
+	return ret;
+}
+
+/*
+ * mmu_set_fastrefill/mmu_get_fastrefill: turn mmu_refill on and off,
+ * for comparing the two paths.
+ */
+void
+mmu_set_fastrefill(bool on)
+{
+	mmu_fastrefill = on;
+}
+
+bool
+mmu_get_fastrefill(void)
+{
+	return mmu_fastrefill;
+}
+
+/*
+ * mmu_map_zero: map VA read-only to the zero page. This is for read
+ * faults on zero-fill pages that haven't been materialized. The zero
+ * page's TLB entries aren't tracked, so instead we note that AS has
+ * some; mmu_unmap_zero gets rid of them.
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void
+mmu_map_zero(struct addrspace *as, vaddr_t va)
+{
+	int tlbix;
+	uint32_t ehi, elo, asid;
+
+	spinlock_acquire(&coremap_spinlock);
+
+	KASSERT(as == curcpu->c_vm.cvm_lastas);
+	asid = curcpu->c_vm.cvm_curasid;
+	KASSERT(asid > 0 && asid < NUM_ASID);
+	ehi = (va & TLBHI_VPAGE) | (asid << TLBHI_PIDSHIFT);
+
+	tlb_lock();
+	tlbix = tlb_probe(ehi, 0);
+	if (tlbix >= 0) {
+		tlb_invalidate(tlbix);
+	}
+	else {
+		tlbix = mipstlb_getslot();
+		ct_tlb_refills++;
+	}
+	KASSERT(tlbix>=0 && tlbix<NUM_TLB);
+
+	elo = (zero_paddr & TLBLO_PPAGE) | TLBLO_VALID;
+	tlb_write(ehi, elo, tlbix);
+	tlb_unlock();
+	as->as_machdep.am_zeromapped = true;
+
+	/* any page VA had before is gone (e.g. truncated away) */
+	pt_unmap(&as->as_machdep, va);
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_unmap_zero: remove all of AS's translations to the zero page.
+ * This has to happen before a page AS may have mapped to it gets
+ * materialized or unmapped. On this CPU we look for them; on the
+ * others AS has run on (am_cpumask) it may have some left from before
+ * it last moved, and there we make its ASID stale instead, which
+ * retires all its entries at once. (They'll get a fresh one next time
+ * AS runs there, which puts them back in the mask.)
+ *
+ * Synchronization: takes coremap_spinlock. Does not block.
+ */
+void
+mmu_unmap_zero(struct addrspace *as)
+{
+	uint32_t ehi, elo, asid;
+	unsigned i;
+
+	spinlock_acquire(&coremap_spinlock);
+
+	if (!as->as_machdep.am_zeromapped) {
+		spinlock_release(&coremap_spinlock);
+		return;
+	}
+
+	tlb_retire_others(as);
+
+	asid = tlb_asidof(as);
+	if (asid != 0) {
+		tlb_lock();
+		for (i=0; i<NUM_TLB; i++) {
+			tlb_read(&ehi, &elo, i);
+			if ((elo & TLBLO_VALID) &&
+			    (elo & TLBLO_PPAGE) == zero_paddr &&
+			    (ehi & TLBHI_PID) >> TLBHI_PIDSHIFT == asid) {
+				tlb_invalidate(i);
+			}
+		}
+		tlb_unlock();
+	}
+	as->as_machdep.am_zeromapped = false;
+	ct_zero_unmaps++;
+
+	spinlock_release(&coremap_spinlock);
+}
+
+/*
+ * mmu_invalidate_page: Remove any translation for a physical page from
+ * the MMU, whichever address space and CPU it belongs to. Used to
+ * write-protect pages that are becoming shared copy-on-write. The page
+ * must be pinned.
+ *
+ * Synchronization: takes coremap_spinlock. May block for TLB shootdown.
+ */
+void
+mmu_invalidate_page(paddr_t pa)
+{
+	unsigned cmix;
+
+	cmix = PADDR_TO_COREMAP(pa);
+	KASSERT(cmix < num_coremap_entries);
+
+	spinlock_acquire(&coremap_spinlock);
+	KASSERT(coremap[cmix].cm_pinned);
+	coremap_unmap_tlb(cmix);
+	spinlock_release(&coremap_spinlock);
+}
@@ -39,7 +39,6 @@
 #include <machine/coremap.h>
 #include <mainbus.h>
 
-#include "opt-randpage.h"
 #include "opt-randtlb.h"
 
 
@@ -60,11 +59,7 @@ void
 vm_bootstrap(void)
 {
 
-#if OPT_RANDPAGE
-	kprintf("vm: Page replacement: random\n");
-#else
-	kprintf("vm: Page replacement: sequential\n");
-#endif
+	kprintf("vm: Page replacement: %s\n", coremap_get_replacement());
 
 #if OPT_RANDTLB
 	kprintf("vm: TLB replacement: random\n");
@@ -74,12 +69,17 @@ vm_bootstrap(void)
 
 	coremap_bootstrap();
 
-	global_paging_lock = lock_create("global_paging_lock");
+	lpage_bootstrap();
+	vm_object_bootstrap();
+	as_bootstrap();
 }
 
 /*
  * vm_fault: TLB fault handler. Hands off to the current thread's
- * address space.
+ * address space, after stopping if load control has suspended it.
+ * (Not in copyin/copyout, though, where the thread may be holding
+ * locks that others need.) Plain TLB misses on resident pages are
+ * refilled from the page table by mmu_refill without going that far.
  *
  * Synchronization: none.
  */
@@ -96,6 +96,14 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	if (curthread->t_machdep.tm_badfaultfunc == NULL) {
+		loadctl_wait(as);
+	}
+
+	if (mmu_refill(as, faulttype, faultaddress)) {
+		return 0;
+	}
+
 	return as_fault(as, faulttype, faultaddress);
 }
 
@@ -44,13 +44,28 @@ struct vm_object; /* from vmprivate.h */
 
 DECLARRAY_BYTYPE(vm_object_array, struct vm_object);
 
+/* Space for a process name in the per-process stats. */
+#define AS_NAMELEN	16
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
  * In the solution set VM, the address space contains an array of
  * vm_objects. Normally there will be one each for text, data/bss,
- * stack, and heap. More can be added if needed.
+ * stack, and heap. More can be added if needed. The array is kept
+ * sorted by base address, so faults can binary search it, and
+ * as_lastobj remembers the object the last fault was in.
+ *
+ * as_lock is held while the vm_objects are changed or faulted on.
+ * Only the owning thread does that, except for the page merger
+ * (pagemerge.c), which replaces lpages in them from its own thread.
+ *
+ * Each user page in RAM is charged to the address space that faulted
+ * it in; as_rss counts them. If as_rsslimit is set, faulting in a page
+ * past the limit first evicts one of the address space's own pages
+ * (local replacement; see coremap.c). The as_rss* fields belong to
+ * the coremap and are protected by its locks.
  */
 
 struct addrspace {
@@ -65,6 +80,27 @@ struct addrspace {
 #else
         /* Add additional address space objects here as necessary. */
         struct vm_object_array *as_objects;
+        struct vm_object *as_lastobj;	/* last faulted on, or NULL */
+        struct vm_object *as_heap;	/* also in as_objects */
+        vaddr_t as_heapend;		/* current break (sbrk) */
+        struct addrspace_machdep as_machdep;	/* MMU state (ASIDs) */
+        struct lock *as_lock;		/* see above */
+
+        /* resident set; see above */
+        unsigned as_rss;		/* pages charged to us */
+        unsigned as_rsspeak;		/* most as_rss has been */
+        unsigned as_rsslimit;		/* in pages, or 0 for none */
+        unsigned as_rsshits;		/* evictions for the limit */
+        unsigned as_rsshand;		/* local replacement clock hand */
+
+        /* per-process stats */
+        char as_name[AS_NAMELEN];	/* of the first thread to run */
+        unsigned as_faults;
+        unsigned as_majfaults;
+
+        /* load control; see loadctl.c */
+        bool as_suspended;		/* stop at next fault */
+        unsigned as_lcmajfaults;	/* as_majfaults when last checked */
 #endif
 };
 
@@ -91,11 +127,15 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_fileregion - set up a region of memory whose contents
+ *                come from a file, paged in on demand.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
  *    as_complete_load - this is called when loading from an executable
- *                is complete.
+ *                is complete. Sets up the (empty) heap above the
+ *                segments loaded.
  *
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
@@ -118,6 +158,15 @@ int               as_define_region(struct addrspace *as,
                                    int readable, 
                                    int writeable,
                                    int executable);
+#if !OPT_DUMBVM
+int               as_define_fileregion(struct addrspace *as,
+                                       vaddr_t vaddr, size_t sz,
+                                       struct vnode *v, off_t offset,
+                                       size_t filesize,
+                                       int readable,
+                                       int writeable,
+                                       int executable);
+#endif
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
@@ -126,8 +175,18 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 /*
  * as_fault - handle fault in (the current) address space.
  * as_sbrk - adjust the heap, like the sbrk() system call.
+ * as_mmap, as_munmap, as_msync - VM parts of mmap(), munmap(), and
+ *           msync(). The caller checks the arguments.
  */
 int as_fault(struct addrspace *as, int faulttype, vaddr_t va);
+#if !OPT_DUMBVM
+int as_sbrk(struct addrspace *as, intptr_t change, vaddr_t *oldbreak);
+int as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int prot,
+	    int flags, struct vnode *v, off_t offset, size_t filesize,
+	    vaddr_t *retaddr);
+int as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int as_msync(struct addrspace *as, vaddr_t addr, size_t len);
+#endif
 
 /*
  * Functions in loadelf.c
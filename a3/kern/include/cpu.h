@@ -153,6 +153,7 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch carries several, with one interrupt.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +168,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_batch(unsigned targetcpu,
+			    const struct tlbshootdown *mappings, unsigned n);
 
 void interprocessor_interrupt(void);
 
@@ -169,6 +169,20 @@ int snprintf(char *buf, size_t maxlen, const char *fmt, ...) __PF(3,4);
 
 const char *strerror(int errcode);
 
+/*
+ * LZ compression, for compressing pages (see lib/lz.c).
+ *
+ * lz_compress returns the compressed length, or 0 if the output
+ * would exceed DSTMAX; LEN may be at most 65535. WORK is scratch
+ * space of LZ_WORKSIZE bytes. lz_decompress returns the decompressed
+ * length, or 0 if the input is corrupt or won't fit in DSTMAX.
+ */
+#define LZ_WORKSIZE	(4096 * sizeof(uint16_t))
+size_t lz_compress(const void *src, size_t len, void *dst, size_t dstmax,
+		   void *work);
+size_t lz_decompress(const void *src, size_t srclen, void *dst,
+		     size_t dstmax);
+
 /*
  * Low-level console access.
  */
@@ -87,4 +87,11 @@ int sys_fstat(int fd, userptr_t statptr);
 
 /* END A3 SETUP */
 
+/* VM system calls (vm_syscalls.c); not available with dumbvm. */
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+
 #endif /* _SYSCALL_H_ */
@@ -49,6 +49,7 @@ int waittest(int, char **);
 /* lib tests */
 int arraytest(int, char **);
 int bitmaptest(int, char **);
+int lztest(int, char **);
 int queuetest(int, char **);
 
 /* thread tests */
@@ -73,6 +74,10 @@ int malloctest(int, char **);
 int mallocstress(int, char **);
 int coremaptest(int, char **);
 int coremapstress(int, char **);
+int faultbench(int, char **);
+int regionbench(int, char **);
+int thrashbench(int, char **);
+int minorbench(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
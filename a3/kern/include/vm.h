@@ -58,9 +58,38 @@ void swap_bootstrap(void);
 /* Shutdown function for swapfile; closes swap vnode. */
 void swap_shutdown(void);
 
+/* Swap overcommit mode: "strict", "heuristic", or "always". */
+int swap_set_overcommit(const char *name);
+const char *swap_get_overcommit(void);
+
+/* Page merging scan rate, in pages per second; 0 turns it off. */
+void pagemerge_setrate(unsigned pagespersec);
+unsigned pagemerge_getrate(void);
+
+/*
+ * Load control: major faults per second above which processes get
+ * suspended (0 turns it off), and whether they're swapped out too.
+ */
+void loadctl_setthreshold(unsigned faultspersec, bool swapout);
+unsigned loadctl_getthreshold(bool *swapout);
+
+/*
+ * Whether TLB misses on resident pages are refilled straight from the
+ * page tables (on by default; off is for comparison).
+ */
+void mmu_set_fastrefill(bool on);
+bool mmu_get_fastrefill(void);
+
+/* RSS limit for new processes, in pages; 0 means none. */
+void as_setrsslimit(unsigned npages);
+unsigned as_getrsslimit(void);
+
 /* Print VM counters */
 void vm_printstats(void);
 
+/* Print per-process RSS and fault counts */
+void as_printprocs(void);
+
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
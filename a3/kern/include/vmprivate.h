@@ -44,6 +44,7 @@
 #include <array.h>
 #include <spinlock.h>
 struct addrspace;
+struct vnode;
 
 #include "opt-dumbvm.h"
 #if !OPT_DUMBVM
@@ -74,24 +75,63 @@ struct addrspace;
  * to hold flags.
  *
  *     LPF_DIRTY    is set if the page has been modified.
- *     LPF_PINNED   is set if the page is in transit to/from disk.
+ *     LPF_BUSY     is set while the page is being read in. lp_paddr
+ *                  is otherwise INVALID_PADDR until it's done, and
+ *                  anyone else who wants the page waits for it
+ *                  (lpage_pagein) rather than reading it again.
+ *     LPF_READAHEAD is set if the page was read in from swap ahead of
+ *                  need and hasn't been faulted on since.
  *
- * A vm_object contains an array of lpages, each of which corresponds
+ * A page being written out is pinned in the coremap instead, which
+ * anyone wanting it waits on in lpage_lock_and_pin.
+ *
+ * A vm_object contains a table of lpages, each of which corresponds
  * to a virtual page in the address space of a process.
  *
- * It is assumed in the solution set VM that lpages are never shared
- * between processes.
+ * After fork, lpages are shared copy-on-write between the parent and
+ * child vm_objects. lp_refcount counts the vm_object slots that point
+ * at the lpage; while it is greater than one the page is only ever
+ * mapped read-only, and the first write fault through any of the
+ * slots gives that slot a private copy (see lpage_fault).
+ *
+ * Swap accounting for shared lpages: each vm_object slot with an
+ * lpage holds one unit of swap, either reserved or allocated. A
+ * shared lpage owns one allocated swap page and each of its other
+ * lp_refcount-1 sharers keeps its slot's reservation until it drops
+ * its reference. Untouched slots hold a reservation only if their
+ * vm_object was made in strict overcommit mode (vmo_reserved);
+ * otherwise the page is reserved when it is materialized.
+ *
+ * The exception is pages of read-only file-backed vm_objects (program
+ * text). These never get dirty, so they hold no swap at all: their
+ * lp_swapaddr stays INVALID_SWAPADDR, eviction just discards them,
+ * and they are read in again from the file when next needed.
  */
 
 struct lpage {
 	volatile paddr_t lp_paddr;
 	off_t lp_swapaddr;
+	unsigned lp_refcount;
 	struct spinlock lp_spinlock;
 };
 
+/*
+ * Where the contents of a page of a file-backed vm_object come from:
+ * VB_LEN bytes at VB_OFFSET in VB_VNODE, placed VB_SKIP bytes into the
+ * page. The rest of the page is zero.
+ */
+struct vm_backing {
+	struct vnode *vb_vnode;
+	off_t vb_offset;
+	size_t vb_skip;
+	size_t vb_len;
+};
+
 /* lpage flags */
 #define LPF_DIRTY		0x1
-#define LPF_MASK		0x1	// mask for the above
+#define LPF_READAHEAD		0x2
+#define LPF_BUSY		0x4
+#define LPF_MASK		0x7	// mask for the above
 
 #define LP_ISDIRTY(lp)		((lp)->lp_paddr & LPF_DIRTY)
 
@@ -101,48 +141,170 @@ struct lpage {
 /*
  * Functions in lpage.c
  *
+ *    lpage_bootstrap - set up the wait channels for busy lpages
  *    lpage_create - create a blank, non-materialized lpage structure.
- *    lpage_destroy - destroy an lpage
+ *    lpage_destroy - drop a reference to an lpage; destroy it with the last
+ *    lpage_share - add a copy-on-write reference to an lpage (for fork)
+ *    lpage_hold - add a reference not in any vm_object (page merging)
+ *    lpage_unhold - drop such a reference
  *    lpage_lock/unlock - for exclusive access to an lpage
  *    lpage_lock_and_pin - also pin physical page (see lpage.c for details)
  *
  *    lpage_copy - clone an lpage, including the contents
  *    lpage_zerofill - materialize an lpage and zero-fill it
- *    lpage_fault - handle a fault on an lpage
+ *    lpage_zeromap - map the zero page for a read of an untouched page
+ *    lpage_filein - materialize an lpage and read it from a file
+ *    lpage_writefile - write an lpage's contents back to its file
+ *    lpage_fault - handle a fault on an lpage; may replace the lpage
+ *                  with a private copy if it was shared. Pages with
+ *                  no swap are read from the vm_backing given.
  *    lpage_evict - evict an lpage
+ *    lpage_migrate - move an lpage to another physical page (compaction)
+ *    lpage_clean - write a batch of dirty lpages to swap without
+ *                  evicting them
+ *    lpage_readahead - page in a batch of lpages whose swap pages are
+ *                  consecutive, in one I/O
+ *    lpage_readahead_window - current readahead size, in pages
+ *    lpage_premap - map an lpage into the TLB if it's already resident
+ *    lpage_hash - hash a resident lpage's contents (page merging)
+ *    lpage_merge - replace an lpage with a held one with the same
+ *                  contents (page merging)
+ *    lpage_majfaults - major faults so far (for benchmarks)
  */
+void              lpage_bootstrap(void);
 struct lpage     *lpage_create(void);
 void              lpage_destroy(struct lpage *lp);
+void              lpage_share(struct lpage *lp);
+int               lpage_hold(struct lpage *lp);
+void              lpage_unhold(struct lpage *lp);
 void              lpage_lock(struct lpage *lp);
 void              lpage_unlock(struct lpage *lp);
 void              lpage_lock_and_pin(struct lpage *lp);
 
 int	              lpage_copy(struct lpage *from, struct lpage **toret);
-int               lpage_zerofill(struct lpage **lpret);
-int               lpage_fault(struct lpage *lp, struct addrspace *,
-			                  int faulttype, vaddr_t va);
+int               lpage_zerofill(struct lpage **lpret, bool reserved);
+void              lpage_zeromap(struct addrspace *as, vaddr_t va);
+int               lpage_filein(struct lpage **lpret,
+			       const struct vm_backing *vb, bool needswap,
+			       bool reserved);
+int               lpage_writefile(struct lpage *lp,
+				  const struct vm_backing *vb);
+int               lpage_fault(struct lpage **lpp, struct addrspace *,
+			                  int faulttype, vaddr_t va,
+			                  const struct vm_backing *vb,
+			                  bool *majorret);
 void              lpage_evict(struct lpage *victim);
+void              lpage_migrate(struct lpage *lp, paddr_t oldpa,
+				paddr_t newpa);
+void              lpage_clean(struct lpage **lps, unsigned n);
+void              lpage_readahead(struct lpage **lps, unsigned n,
+				  off_t swapaddr);
+unsigned          lpage_readahead_window(void);
+void              lpage_premap(struct lpage *lp, struct addrspace *as,
+			       vaddr_t va);
+bool              lpage_hash(struct lpage *lp, uint32_t *hashret);
+bool              lpage_merge(struct lpage *keep, struct lpage **lpp,
+			      bool *freedret);
+uint32_t          lpage_majfaults(void);
 
 ////////////////////////////////////////////////////////////
 //
 // vm_object - block of virtual memory
 //
 
-DECLARRAY_BYTYPE(lpage_array, struct lpage);
+/*
+ * lpage_table - the lpages of a vm_object, by page index.
+ *
+ * This is a two-level table: a directory of pointers to chunks of
+ * LPT_CHUNKPAGES lpage pointers each. A chunk is only allocated once
+ * something non-NULL is stored in it, so a big region that's mostly
+ * untouched (the stack, a large mmap) costs one directory slot per
+ * chunk rather than one pointer per page, and lpage_table_next can
+ * step over empty chunks without looking at them.
+ *
+ * lpage_table_set never fails; storing a non-NULL lpage requires that
+ * its chunk exist, which lpage_table_prepare sees to.
+ *
+ *    lpage_table_create - allocate an empty table
+ *    lpage_table_destroy - free a table, which must have size 0
+ *    lpage_table_num - size of the table, in pages
+ *    lpage_table_setsize - grow or shrink the table; new slots are
+ *                  NULL, and the lpages in slots that go away are
+ *                  forgotten (the caller gets rid of them first)
+ *    lpage_table_get - fetch the lpage in a slot (maybe NULL)
+ *    lpage_table_prepare - make sure a slot can hold a non-NULL lpage
+ *    lpage_table_set - store into a slot
+ *    lpage_table_next - first slot at or after the one given that
+ *                  isn't NULL, or the table size if none
+ */
+#define LPT_CHUNKSHIFT	6
+#define LPT_CHUNKPAGES	(1 << LPT_CHUNKSHIFT)
+
+struct lpage_table {
+	unsigned lt_num;		/* size, in pages */
+	unsigned lt_maxchunks;		/* size of lt_chunks */
+	struct lpage ***lt_chunks;	/* chunk directory */
+};
+
+struct lpage_table *lpage_table_create(void);
+void              lpage_table_destroy(struct lpage_table *lt);
+unsigned          lpage_table_num(const struct lpage_table *lt);
+int               lpage_table_setsize(struct lpage_table *lt, unsigned num);
+struct lpage     *lpage_table_get(const struct lpage_table *lt,
+				  unsigned index);
+int               lpage_table_prepare(struct lpage_table *lt,
+				      unsigned index);
+void              lpage_table_set(struct lpage_table *lt, unsigned index,
+				  struct lpage *lp);
+unsigned          lpage_table_next(const struct lpage_table *lt,
+				   unsigned index);
 
 /*
  * vm_object - data structure associated with a mapped (that is, valid)
  * block of process virtual memory.
  *
- * Each vm object contains an array of lpages and a base address. It
+ * Each vm object contains a table of lpages and a base address. It
  * also allows a redzone on the lower end in which other vm_objects are
  * not allowed to fall. This is used to implement a guard band under the
  * stack.
+ *
+ * A vm_object may also be backed by part of a file (vmo_vnode is not
+ * NULL): vmo_filesize bytes from file offset vmo_fileoff, placed
+ * vmo_filestart bytes into the object. Its pages are read in from the
+ * file on first touch instead of being zero-filled. If the object is
+ * not writeable, writes to it fault; if it is also file-backed, it
+ * holds no swap (see above).
+ *
+ * A vm_object made by mmap with MAP_SHARED (vmo_shared) is not copied
+ * at fork: the child gets the same object, counted by vmo_refcount.
+ * Since it may then be used by more than one process, faults on it
+ * are serialized by vmo_lock, except that a read-only file-backed one
+ * only needs it to install an lpage (see as_fault_readonly), so a
+ * file read doesn't hold up faults on its other pages. A shared,
+ * writeable, file-backed object is written back to its file by msync
+ * and when the last reference goes away.
+ *
+ * A read-only file region of a program (vmo_text) is a shared object
+ * too, made by vm_object_gettext: every address space that maps the
+ * same part of the same file at the same address (that is, every
+ * process running the program) gets a reference to the one object,
+ * so they all use the same pages. The text objects in use are kept
+ * in a list so later execs can find them.
  */
 struct vm_object {
-	struct lpage_array *vmo_lpages;
+	struct lpage_table *vmo_lpages;
 	vaddr_t vmo_base;
 	size_t vmo_lower_redzone;
+	struct vnode *vmo_vnode;
+	off_t vmo_fileoff;
+	size_t vmo_filestart;
+	size_t vmo_filesize;
+	bool vmo_writeable;
+	bool vmo_reserved;		/* untouched pages hold swap */
+	bool vmo_shared;
+	bool vmo_text;			/* in the shared text list */
+	unsigned vmo_refcount;		/* only used if vmo_shared */
+	struct lock *vmo_lock;		/* only exists if vmo_shared */
 };
 
 /*
@@ -150,20 +312,67 @@ struct vm_object {
  * 
  * vm_object_create:  allocates a blank vm_object with the requested
  *                    number of struct lpage's set for zero-fill.
- * vm_object_copy:    clone a vm_object, as at fork time.
+ * vm_object_create_vnode: same, but backed by part of a file.
+ * vm_object_copy:    clone a vm_object, as at fork time. The lpages
+ *                    are shared copy-on-write rather than copied.
+ *                    Shared objects are just shared.
+ * vm_object_setshared: make a vm_object shared rather than copied at
+ *                    fork.
+ * vm_object_gettext: get a reference to the shared object for a
+ *                    read-only region of a program, making it if
+ *                    nobody else has it.
  * vm_object_setsize: adjust the size of a vm_object (either up or down).
  * vm_object_destroy: frees all the mapping entries and swap space.
+ * vm_object_backing: find where the file data for a page of a
+ *                    file-backed vm_object is.
+ * vm_object_sync:    write a range of pages of a shared file-backed
+ *                    vm_object back to the file.
+ * vm_object_readahead: after a major fault, read in the following
+ *                    pages if they're next to it in swap.
+ * vm_object_faultaround: map the resident pages near a faulting page,
+ *                    to save taking a fault on each of them.
+ * vm_object_bootstrap: set up the shared text list.
+ * vm_object_printstats: print shared text stats.
  *
  */
 struct vm_object 	*vm_object_create(size_t npages);
+struct vm_object    *vm_object_create_vnode(size_t npages,
+					                    struct vnode *v, off_t fileoff,
+					                    size_t filestart,
+					                    size_t filesize,
+					                    bool writeable);
 int			        vm_object_copy(struct vm_object *vmo,
 					               struct addrspace *newas,
 					               struct vm_object **newvmo_ret);
+int                 vm_object_setshared(struct vm_object *vmo);
+struct vm_object    *vm_object_gettext(size_t npages, vaddr_t base,
+					               struct vnode *v, off_t fileoff,
+					               size_t filestart,
+					               size_t filesize);
 int                 vm_object_setsize(struct addrspace *as,
 					                  struct vm_object *vmo,
 					                  unsigned newnpages);
 void 			 vm_object_destroy(struct addrspace *as, 
 					               struct vm_object *vmo);
+void                vm_object_backing(struct vm_object *vmo,
+					                  unsigned index,
+					                  struct vm_backing *vb);
+int                 vm_object_sync(struct vm_object *vmo,
+				       unsigned first, unsigned last);
+void                vm_object_readahead(struct vm_object *vmo,
+					                    unsigned index);
+void                vm_object_faultaround(struct vm_object *vmo,
+					                      struct addrspace *as,
+					                      unsigned index);
+void                vm_object_bootstrap(void);
+void                vm_object_printstats(void);
+
+/*
+ * Fault-around maps the resident pages of the aligned block of
+ * FAULTAROUND_PAGES pages containing the faulting page. Must be a
+ * power of 2; 1 turns it off.
+ */
+#define FAULTAROUND_PAGES	4
 
 ////////////////////////////////////////////////////////////
 //
@@ -187,21 +396,46 @@ void 			 vm_object_destroy(struct addrspace *as,
  *
  * swap_unreserve:   release some previously-reserved swap pages.
  *
+ * swap_reserve_ahead: reserve swap for a new vm_object's pages if
+ *                   the overcommit mode says to do it up front.
+ *
  * swap_pagein:      Reads a page from the requested swap address 
  *                   into the requested physical page.
  *
+ * swap_pagein_cluster: Reads up to SWAP_CLUSTER_MAX consecutive swap
+ *                   pages into physical pages in one I/O.
+ *
  * swap_pageout:     Writes a page to the requested swap address 
  *                   from the requested physical page.
+ *
+ * swap_alloc_run:   like swap_alloc, but finds NPAGES contiguous swap
+ *                   pages, or fails.
+ *
+ * swap_pageout_cluster: Writes up to SWAP_CLUSTER_MAX physical pages
+ *                   to consecutive swap pages in one I/O.
+ *
+ * swap_write_kbuf:  writes a page-sized kernel buffer to the
+ *                   requested swap address. For the compressed cache.
+ *
+ * swap_printstats:  prints swap usage and I/O stats.
  */
 
 off_t	 	swap_alloc(void);
+off_t		swap_alloc_run(unsigned npages);
 void 		swap_free(off_t diskpage);
 
 int		swap_reserve(unsigned long npages);
 void		swap_unreserve(unsigned long npages);
+int		swap_reserve_ahead(unsigned long npages, bool *didret);
 
 void 		swap_pagein(paddr_t paddr, off_t swapaddr);
+void		swap_pagein_cluster(const paddr_t *paddrs, unsigned npages,
+				    off_t swapaddr);
 void 		swap_pageout(paddr_t paddr, off_t swapaddr);
+void		swap_pageout_cluster(const paddr_t *paddrs, unsigned npages,
+				     off_t swapaddr);
+void		swap_write_kbuf(const void *buf, off_t swapaddr);
+void		swap_printstats(void);
 
 /*
  * Special disk address:
@@ -210,11 +444,99 @@ void 		swap_pageout(paddr_t paddr, off_t swapaddr);
 #define INVALID_SWAPADDR	(0)
 
 /*
- * Global lock for paging. Only one page can be in transit at a time
- * (at least under current circumstances) so we get this at a fairly
- * high level to try to improve paging decisions.
+ * Most pages written to (or read from) swap in one I/O.
+ */
+#define SWAP_CLUSTER_MAX	16
+
+////////////////////////////////////////////////////////////
+//
+// compressed swap cache
+
+/*
+ * Compressed swap cache operations in zcache.c, used by swap.c:
+ *
+ * zcache_bootstrap: sets up a pool of the given number of pages.
+ *
+ * zcache_store:     compresses a physical page into the pool as the
+ *                   contents of a swap page, writing older pages back
+ *                   to disk if need be. Returns false, having done
+ *                   nothing, if the page doesn't compress well.
+ *
+ * zcache_load:      decompresses a swap page from the pool into a
+ *                   physical page. Returns false if it isn't there.
+ *
+ * zcache_drop:      forgets a swap page, if it's there.
+ *
+ * zcache_printstats: prints ratio, hit rate, and I/O saved.
+ */
+
+/* Pool size, as a fraction of RAM */
+#define ZCACHE_RAM_FRACTION	16
+
+void		zcache_bootstrap(unsigned npages);
+bool		zcache_store(paddr_t paddr, off_t swapaddr);
+bool		zcache_load(paddr_t paddr, off_t swapaddr);
+void		zcache_drop(off_t swapaddr);
+void		zcache_printstats(void);
+
+////////////////////////////////////////////////////////////
+//
+// page merging
+//
+
+/*
+ * Page merging operations in pagemerge.c:
+ *
+ * pagemerge_bootstrap: starts the scanner thread. Called from
+ *                   swap_bootstrap.
+ *
+ * pagemerge_addas:  makes an address space visible to the scanner.
+ *                   Called from as_create; may fail with ENOMEM.
+ *
+ * pagemerge_removeas: hides an address space from the scanner again,
+ *                   waiting if it's being scanned. Called from
+ *                   as_destroy.
+ *
+ * pagemerge_printstats: prints scanner stats.
+ *
+ * pagemerge_setrate and pagemerge_getrate are declared in vm.h.
  */
-extern struct lock *global_paging_lock;
+
+void		pagemerge_bootstrap(void);
+int		pagemerge_addas(struct addrspace *as);
+void		pagemerge_removeas(struct addrspace *as);
+void		pagemerge_printstats(void);
+
+////////////////////////////////////////////////////////////
+//
+// load control
+//
+
+/*
+ * Load control operations in loadctl.c:
+ *
+ * loadctl_bootstrap: starts the controller thread. Called from
+ *                   swap_bootstrap.
+ *
+ * loadctl_addas:    makes an address space visible to the controller.
+ *                   Called from as_create; may fail with ENOMEM.
+ *
+ * loadctl_removeas: hides an address space from the controller again.
+ *                   Called from as_destroy.
+ *
+ * loadctl_wait:     stops the calling thread while its address space
+ *                   is suspended. Called from vm_fault.
+ *
+ * loadctl_printstats: prints controller stats.
+ *
+ * loadctl_setthreshold and loadctl_getthreshold are declared in vm.h.
+ */
+
+void		loadctl_bootstrap(void);
+int		loadctl_addas(struct addrspace *as);
+void		loadctl_removeas(struct addrspace *as);
+void		loadctl_wait(struct addrspace *as);
+void		loadctl_printstats(void);
 
 ////////////////////////////////////////////////////////////
 //
@@ -224,5 +546,14 @@ extern struct lock *global_paging_lock;
 /* Print machine-dependent VM counters */
 void vm_printmdstats(void);
 
+/* Print address-space-level VM counters (addrspace.c) */
+void as_printstats(void);
+
+/* Set up the list of address spaces for per-process stats (ditto) */
+void as_bootstrap(void);
+
+/* Find the index of the vm_object VA is in, or -1; hold as_lock (ditto) */
+int as_findobj(struct addrspace *as, vaddr_t va);
+
 #endif /* !OPT_DUMBVM */
 #endif /* _VMPRIVATE_H_ */
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+
+/*
+ * A small LZ77 compressor, in the style of LZ4: fast, with a modest
+ * ratio, which is the right tradeoff for compressing pages on their
+ * way to swap.
+ *
+ * The compressed data is a series of sequences. Each is:
+ *
+ *    token         one byte: literal count in the high 4 bits, match
+ *                  length minus LZ_MINMATCH in the low 4 bits
+ *    [litcount]    if the literal count is 15, more bytes follow,
+ *                  each added to it, until one that isn't 255
+ *    literals      that many bytes, copied as is
+ *    offset        two bytes, little-endian: how far back the match
+ *                  starts (1 to 65535)
+ *    [matchlen]    extended like the literal count
+ *
+ * The last sequence may stop after its literals, at the end of the
+ * data. Matches may overlap the bytes they produce (offset less than
+ * the length), which is how runs compress.
+ *
+ * The compressor finds matches with a hash table of positions of
+ * 4-byte strings, one candidate per slot; it's passed in by the
+ * caller so this works without a large stack or any allocation.
+ */
+
+#define LZ_MINMATCH	4
+#define LZ_MAXOFFSET	65535
+#define LZ_HASHBITS	12
+
+static
+uint32_t
+lz_read32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static
+unsigned
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+/*
+ * Write a 4-bit length's extension bytes, if N needs them. Returns
+ * false if there's no room.
+ */
+static
+bool
+lz_putlen(uint8_t **dstp, uint8_t *dend, size_t n)
+{
+	uint8_t *dst = *dstp;
+
+	if (n < 15) {
+		return true;
+	}
+	n -= 15;
+	while (n >= 255) {
+		if (dst >= dend) {
+			return false;
+		}
+		*dst++ = 255;
+		n -= 255;
+	}
+	if (dst >= dend) {
+		return false;
+	}
+	*dst++ = n;
+	*dstp = dst;
+	return true;
+}
+
+/*
+ * Write one sequence: LITLEN literals from LIT, then (if MATCHLEN is
+ * not 0) a match of MATCHLEN bytes OFFSET back.
+ */
+static
+bool
+lz_putseq(uint8_t **dstp, uint8_t *dend, const uint8_t *lit, size_t litlen,
+	  size_t offset, size_t matchlen)
+{
+	uint8_t *dst = *dstp;
+	unsigned token;
+
+	token = (litlen < 15 ? litlen : 15) << 4;
+	if (matchlen > 0) {
+		KASSERT(matchlen >= LZ_MINMATCH);
+		matchlen -= LZ_MINMATCH;
+		token |= (matchlen < 15 ? matchlen : 15);
+	}
+
+	if (dst >= dend) {
+		return false;
+	}
+	*dst++ = token;
+	if (!lz_putlen(&dst, dend, litlen)) {
+		return false;
+	}
+	if ((size_t)(dend - dst) < litlen) {
+		return false;
+	}
+	memcpy(dst, lit, litlen);
+	dst += litlen;
+
+	if (offset > 0) {
+		if (dend - dst < 2) {
+			return false;
+		}
+		*dst++ = offset & 0xff;
+		*dst++ = offset >> 8;
+		if (!lz_putlen(&dst, dend, matchlen)) {
+			return false;
+		}
+	}
+
+	*dstp = dst;
+	return true;
+}
+
+/*
+ * lz_compress: compress LEN bytes (at most 65535) at SRC into at most
+ * DSTMAX bytes at DST. WORK must point to LZ_WORKSIZE bytes of
+ * scratch space. Returns the compressed length, or 0 if it didn't fit.
+ */
+size_t
+lz_compress(const void *srcv, size_t len, void *dstv, size_t dstmax,
+	    void *work)
+{
+	const uint8_t *src = srcv;
+	uint8_t *dst = dstv;
+	uint8_t *dend = dst + dstmax;
+	uint16_t *table = work;
+	size_t ip, anchor, ref, matchlen;
+	uint32_t v;
+	unsigned h;
+
+	KASSERT(len <= LZ_MAXOFFSET);
+	bzero(table, LZ_WORKSIZE);
+
+	ip = anchor = 0;
+	while (ip + LZ_MINMATCH <= len) {
+		v = lz_read32(src + ip);
+		h = lz_hash(v);
+		ref = table[h];
+		table[h] = ip;
+
+		/* (slots start at 0, so check the match is real) */
+		if (ref >= ip || lz_read32(src + ref) != v) {
+			ip++;
+			continue;
+		}
+
+		matchlen = LZ_MINMATCH;
+		while (ip + matchlen < len &&
+		       src[ref + matchlen] == src[ip + matchlen]) {
+			matchlen++;
+		}
+
+		if (!lz_putseq(&dst, dend, src + anchor, ip - anchor,
+			       ip - ref, matchlen)) {
+			return 0;
+		}
+		ip += matchlen;
+		anchor = ip;
+	}
+
+	if (anchor < len) {
+		if (!lz_putseq(&dst, dend, src + anchor, len - anchor, 0, 0)) {
+			return 0;
+		}
+	}
+
+	return dst - (uint8_t *)dstv;
+}
+
+/*
+ * Read a 4-bit length's extension bytes, if it has them. Returns
+ * false if the data runs out.
+ */
+static
+bool
+lz_getlen(const uint8_t **srcp, const uint8_t *send, size_t *np)
+{
+	const uint8_t *src = *srcp;
+	unsigned b;
+
+	if (*np < 15) {
+		return true;
+	}
+	do {
+		if (src >= send) {
+			return false;
+		}
+		b = *src++;
+		*np += b;
+	} while (b == 255);
+
+	*srcp = src;
+	return true;
+}
+
+/*
+ * lz_decompress: decompress SRCLEN bytes at SRC into DST, which has
+ * room for DSTMAX bytes. Returns the decompressed length, or 0 if the
+ * data is corrupt or won't fit.
+ */
+size_t
+lz_decompress(const void *srcv, size_t srclen, void *dstv, size_t dstmax)
+{
+	const uint8_t *src = srcv;
+	const uint8_t *send = src + srclen;
+	uint8_t *dst = dstv;
+	uint8_t *dend = dst + dstmax;
+	const uint8_t *ref;
+	size_t litlen, matchlen, offset;
+	unsigned token;
+
+	while (src < send) {
+		token = *src++;
+
+		litlen = token >> 4;
+		if (!lz_getlen(&src, send, &litlen)) {
+			return 0;
+		}
+		if ((size_t)(send - src) < litlen ||
+		    (size_t)(dend - dst) < litlen) {
+			return 0;
+		}
+		memcpy(dst, src, litlen);
+		src += litlen;
+		dst += litlen;
+
+		if (src == send) {
+			break;
+		}
+
+		if (send - src < 2) {
+			return 0;
+		}
+		offset = src[0] | (src[1] << 8);
+		src += 2;
+		matchlen = token & 0xf;
+		if (!lz_getlen(&src, send, &matchlen)) {
+			return 0;
+		}
+		matchlen += LZ_MINMATCH;
+
+		if (offset == 0 || offset > (size_t)(dst - (uint8_t *)dstv) ||
+		    (size_t)(dend - dst) < matchlen) {
+			return 0;
+		}
+		/* byte at a time, since it may overlap */
+		ref = dst - offset;
+		while (matchlen-- > 0) {
+			*dst++ = *ref++;
+		}
+	}
+
+	return dst - (uint8_t *)dstv;
+}
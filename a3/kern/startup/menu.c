@@ -40,6 +40,7 @@
 #include <vfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 
 /* BEGIN A3 SETUP */
 /* Needed to omit coremaptests when using dumbvm */
@@ -51,6 +52,10 @@
 #include <sfs.h>
 #endif
 
+#if !OPT_DUMBVM
+#include <machine/coremap.h>
+#endif
+
 /* Hacky semaphore solution to make menu thread wait for command
  * thread, in absence of thread_join solution.
  */
@@ -533,6 +538,147 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if !OPT_DUMBVM
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for viewing or changing the page replacement policy.
+ */
+static
+int
+cmd_vmrepl(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Page replacement: %s\n", coremap_get_replacement());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmrepl [random | sequential | clock]\n");
+		return EINVAL;
+	}
+	return coremap_set_replacement(args[1]);
+}
+
+/*
+ * Command for viewing or changing the swap overcommit mode.
+ */
+static
+int
+cmd_vmcommit(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Swap overcommit: %s\n", swap_get_overcommit());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmcommit [strict | heuristic | always]\n");
+		return EINVAL;
+	}
+	return swap_set_overcommit(args[1]);
+}
+
+/*
+ * Command for viewing or changing the page merging scan rate.
+ */
+static
+int
+cmd_vmmerge(int nargs, char **args)
+{
+	int rate;
+
+	if (nargs == 1) {
+		kprintf("Page merging: %u pages/sec\n", pagemerge_getrate());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmmerge [pages-per-second]\n");
+		return EINVAL;
+	}
+	rate = atoi(args[1]);
+	if (rate < 0) {
+		return EINVAL;
+	}
+	pagemerge_setrate(rate);
+	return 0;
+}
+
+/*
+ * Command for viewing or changing the RSS limit for new processes.
+ */
+static
+int
+cmd_vmrss(int nargs, char **args)
+{
+	int npages;
+
+	if (nargs == 1) {
+		kprintf("RSS limit: %u pages\n", as_getrsslimit());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmrss [pages]\n");
+		return EINVAL;
+	}
+	npages = atoi(args[1]);
+	if (npages < 0) {
+		return EINVAL;
+	}
+	as_setrsslimit(npages);
+	return 0;
+}
+
+/*
+ * Command for viewing or changing the load control threshold.
+ */
+static
+int
+cmd_vmlc(int nargs, char **args)
+{
+	unsigned threshold;
+	bool swapout;
+	int rate;
+
+	if (nargs == 1) {
+		threshold = loadctl_getthreshold(&swapout);
+		kprintf("Load control: %u faults/sec%s\n", threshold,
+			swapout ? ", swapping out" : "");
+		return 0;
+	}
+	if (nargs > 3 || (nargs == 3 && strcmp(args[2], "swap"))) {
+		kprintf("Usage: vmlc [faults-per-second [swap]]\n");
+		return EINVAL;
+	}
+	rate = atoi(args[1]);
+	if (rate < 0) {
+		return EINVAL;
+	}
+	loadctl_setthreshold(rate, nargs == 3);
+	return 0;
+}
+
+static
+int
+cmd_vmps(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	as_printprocs();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -592,6 +738,7 @@ cmd_opsmenu(int n, char **a)
 static const char *testmenu[] = {
 	"[at]  Array test                    ",
 	"[bt]  Bitmap test                   ",
+	"[lzt] LZ compression test           ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[tt1] Thread test 1                 ",
@@ -605,6 +752,10 @@ static const char *testmenu[] = {
 	"[sy3] CV test               (1)     ",
 	"[cm] Coremap test           (3)     ",
 	"[cm2] Coremap stress test   (3)     ",
+	"[fb] Page fault benchmark   (3)     ",
+	"[rb] Region lookup benchmark (3)    ",
+	"[tb] Thrashing benchmark    (3)     ",
+	"[mb] TLB refill benchmark   (3)     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
@@ -634,6 +785,15 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+#if !OPT_DUMBVM
+	"[vm] VM stats                       ",
+	"[vmrepl] Page replacement policy    ",
+	"[vmcommit] Swap overcommit mode     ",
+	"[vmmerge] Page merging scan rate    ",
+	"[vmrss] RSS limit for new processes ",
+	"[vmps] Per-process VM stats         ",
+	"[vmlc] Load control threshold       ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -682,10 +842,20 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+#if !OPT_DUMBVM
+	{ "vm",         cmd_vmstats },
+	{ "vmrepl",     cmd_vmrepl },
+	{ "vmcommit",   cmd_vmcommit },
+	{ "vmmerge",    cmd_vmmerge },
+	{ "vmrss",      cmd_vmrss },
+	{ "vmps",       cmd_vmps },
+	{ "vmlc",       cmd_vmlc },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
+	{ "lzt",	lztest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
 #if OPT_NET
@@ -710,6 +880,10 @@ static struct {
 	/* ASST2 tests */
 	{ "cm",		coremaptest },
 	{ "cm2",	coremapstress },
+	{ "fb",		faultbench },
+	{ "rb",		regionbench },
+	{ "tb",		thrashbench },
+	{ "mb",		minorbench },
 #endif
 /* END A3 SETUP */
 
@@ -54,7 +54,7 @@ file_open(char *filename, int flags, int mode, int *retfd)
 	struct fd_entry *new = kmalloc(sizeof(struct fd_entry));
 
 	new->fname = filename;
-	new->flags = 0;
+	new->flags = flags;
 	new->fd_lock = lock_create("file lock");
 	new->vn = vn;
 	new->num_connected = 1;
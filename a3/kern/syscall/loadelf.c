@@ -42,8 +42,9 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * With the real VM (!OPT_DUMBVM) executables are memory-mapped
+ * instead: each segment is defined with as_define_fileregion and
+ * paged in from the file on demand, so there is no loading step.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -64,6 +65,7 @@
 #include "opt-dumbvm.h"
 /* END A3 SETUP */
 
+#if OPT_DUMBVM
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -147,6 +149,7 @@ load_segment(struct vnode *v, off_t offset, vaddr_t vaddr,
 	
 	return result;
 }
+#endif /* OPT_DUMBVM */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -254,12 +257,12 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
                                           ph.p_flags & PF_W,
                                           ph.p_flags & PF_X);
 #else
-                result = as_define_region(curthread->t_addrspace,
-                                          ph.p_vaddr, ph.p_memsz,
-                                          0,
-                                          ph.p_flags & PF_R,
-                                          ph.p_flags & PF_W,
-                                          ph.p_flags & PF_X);
+                result = as_define_fileregion(curthread->t_addrspace,
+                                              ph.p_vaddr, ph.p_memsz,
+                                              v, ph.p_offset, ph.p_filesz,
+                                              ph.p_flags & PF_R,
+                                              ph.p_flags & PF_W,
+                                              ph.p_flags & PF_X);
 #endif
                 /* END A3 SETUP */
 
@@ -273,6 +276,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if OPT_DUMBVM
 	/*
 	 * Now actually load each segment.
 	 */
@@ -310,6 +314,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif /* OPT_DUMBVM */
 
 	result = as_complete_load(curthread->t_addrspace);
 	if (result) {
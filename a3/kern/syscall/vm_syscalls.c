@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Heap and memory-mapping system calls. These need the real VM system; with
+ * dumbvm this file isn't compiled and the calls fail with ENOSYS.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/limits.h>
+#include <kern/mman.h>
+#include <stat.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <file.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return the old
+ * end.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+	vaddr_t oldbreak;
+	int result;
+
+	result = as_sbrk(curthread->t_addrspace, amount, &oldbreak);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)oldbreak;
+	return 0;
+}
+
+/*
+ * mmap: map LEN bytes of anonymous memory (MAP_ANON) or of the file
+ * open on FD, starting at OFFSET, and return the address used. ADDR is
+ * only used with MAP_FIXED.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int *retval)
+{
+	struct fd_entry *file;
+	struct vnode *v;
+	struct stat st;
+	size_t filesize;
+	vaddr_t va;
+	int shareflags, accmode;
+	int result;
+
+	shareflags = flags & (MAP_SHARED | MAP_PRIVATE);
+	if (shareflags != MAP_SHARED && shareflags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((flags & MAP_FIXED) && (vaddr_t)addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+
+	v = NULL;
+	filesize = 0;
+	if ((flags & MAP_ANON) == 0) {
+		if (fd < 0 || fd >= __OPEN_MAX) {
+			return EBADF;
+		}
+		file = curthread->t_filetable->entries[fd];
+		if (file == NULL) {
+			return EBADF;
+		}
+
+		accmode = file->flags & O_ACCMODE;
+		if (accmode == O_WRONLY) {
+			return EACCES;
+		}
+		if ((flags & MAP_SHARED) && (prot & PROT_WRITE) &&
+		    accmode != O_RDWR) {
+			return EACCES;
+		}
+
+		v = file->vn;
+		result = VOP_MMAP(v);
+		if (result) {
+			return result;
+		}
+
+		result = VOP_STAT(v, &st);
+		if (result) {
+			return result;
+		}
+		if (st.st_size > offset) {
+			if (st.st_size - offset < (off_t)len) {
+				filesize = st.st_size - offset;
+			}
+			else {
+				filesize = len;
+			}
+		}
+	}
+
+	result = as_mmap(curthread->t_addrspace, (vaddr_t)addr, len, prot,
+			 flags, v, offset, filesize, &va);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int)va;
+	return 0;
+}
+
+/*
+ * munmap: remove the mappings from ADDR to ADDR+LEN.
+ */
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	if ((vaddr_t)addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	return as_munmap(curthread->t_addrspace, (vaddr_t)addr, len);
+}
+
+/*
+ * msync: write shared file mappings from ADDR to ADDR+LEN back to
+ * their files.
+ *
+ * Every page of the range that has been touched is written, whether
+ * or not it was changed, since we don't keep track of which pages
+ * differ from the file. MS_ASYNC is accepted but does the same as
+ * MS_SYNC: the call returns once the pages are written. MS_INVALIDATE
+ * is accepted and ignored.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+	if ((vaddr_t)addr % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((flags & MS_ASYNC) && (flags & MS_SYNC)) {
+		return EINVAL;
+	}
+	if (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) {
+		return EINVAL;
+	}
+	return as_msync(curthread->t_addrspace, (vaddr_t)addr, len);
+}
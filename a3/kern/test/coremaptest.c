@@ -32,10 +32,13 @@
  */
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <synch.h>
 #include <thread.h>
 #include <test.h>
+#include <mainbus.h>
 #include <vm.h>
+#include <vmprivate.h>
 #include <machine/coremap.h>
 
 /*
@@ -53,6 +56,153 @@
 #define NPAGES    3
 #define NTHREADS  8
 
+/*
+ * Single-page allocation benchmark: with half of RAM held (so free
+ * pages aren't trivially found), allocate and free one page BENCHTRIES
+ * times, keeping the last BENCHHOLD pages. Run under different RAM
+ * sizes to see how allocation cost scales with memory.
+ */
+#define BENCHTRIES 20000
+#define BENCHHOLD  16
+
+/*
+ * User page benchmark: the same, but with coremap_allocuser and
+ * coremap_free, which go through the per-CPU page caches. cm2 runs it
+ * with 1, 2, 4, ... NTHREADS threads to show how it scales with CPUs.
+ * The pages belong to a dummy lpage and stay pinned, so nobody else
+ * looks at it.
+ */
+
+static
+void
+coremapbench_run(void)
+{
+	vaddr_t held[BENCHHOLD];
+	vaddr_t page;
+	unsigned i;
+
+	for (i=0; i<BENCHHOLD; i++) {
+		held[i] = 0;
+	}
+	for (i=0; i<BENCHTRIES; i++) {
+		page = alloc_kpages(1);
+		if (page == 0) {
+			kprintf("coremapbench: alloc_kpages failed\n");
+			break;
+		}
+		if (held[i % BENCHHOLD]) {
+			free_kpages(held[i % BENCHHOLD]);
+		}
+		held[i % BENCHHOLD] = page;
+	}
+	for (i=0; i<BENCHHOLD; i++) {
+		if (held[i]) {
+			free_kpages(held[i]);
+		}
+	}
+}
+
+static
+void
+coremapbench_userrun(void)
+{
+	paddr_t held[BENCHHOLD];
+	struct lpage *lp;
+	paddr_t pa;
+	unsigned i;
+
+	lp = lpage_create();
+	if (lp == NULL) {
+		kprintf("coremapbench: out of memory\n");
+		return;
+	}
+	for (i=0; i<BENCHHOLD; i++) {
+		held[i] = INVALID_PADDR;
+	}
+	for (i=0; i<BENCHTRIES; i++) {
+		pa = coremap_allocuser(lp);
+		if (pa == INVALID_PADDR) {
+			kprintf("coremapbench: coremap_allocuser failed\n");
+			break;
+		}
+		if (held[i % BENCHHOLD] != INVALID_PADDR) {
+			coremap_free(held[i % BENCHHOLD], false /* iskern */);
+			coremap_unpin(held[i % BENCHHOLD]);
+		}
+		held[i % BENCHHOLD] = pa;
+	}
+	for (i=0; i<BENCHHOLD; i++) {
+		if (held[i] != INVALID_PADDR) {
+			coremap_free(held[i], false /* iskern */);
+			coremap_unpin(held[i]);
+		}
+	}
+	lpage_destroy(lp);
+}
+
+/*
+ * Allocate roughly half of RAM, returning an array of the pages (to
+ * be handed to coremapbench_release), or NULL.
+ */
+static
+vaddr_t *
+coremapbench_fill(unsigned *ret)
+{
+	vaddr_t *fill;
+	unsigned n, i;
+
+	n = mainbus_ramsize() / PAGE_SIZE / 2;
+	fill = kmalloc(n * sizeof(vaddr_t));
+	if (fill == NULL) {
+		return NULL;
+	}
+	for (i=0; i<n; i++) {
+		fill[i] = alloc_kpages(1);
+		if (fill[i] == 0) {
+			break;
+		}
+	}
+	*ret = i;
+	return fill;
+}
+
+static
+void
+coremapbench_release(vaddr_t *fill, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		free_kpages(fill[i]);
+	}
+	kfree(fill);
+}
+
+static
+void
+coremapbench_report(const char *what, unsigned nthreads, unsigned nfill,
+		    time_t secs1, uint32_t nsecs1,
+		    time_t secs2, uint32_t nsecs2)
+{
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t usecs;
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kprintf("coremapbench: %s: %uk RAM, %u pages held, %u thread(s): "
+		"%lu allocs in %lu.%06lu sec (%lu allocs/sec)\n", what,
+		(unsigned)(mainbus_ramsize() / 1024), nfill, nthreads,
+		(unsigned long) (nthreads * BENCHTRIES),
+		(unsigned long) (usecs / 1000000),
+		(unsigned long) (usecs % 1000000),
+		(unsigned long) ((uint64_t)nthreads * BENCHTRIES * 1000000
+				 / usecs));
+}
+
 static
 void
 coremapthread(void *sm, unsigned long num)
@@ -98,18 +248,66 @@ coremaptest(int nargs, char **args)
 	(void)nargs;
 	(void)args;
 
+	vaddr_t *fill;
+	unsigned nfill;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+
 	kprintf("Starting kcoremap test...\n");
 	coremapthread(NULL, 0);
 	kprintf("kcoremap test done\n");
 
+	fill = coremapbench_fill(&nfill);
+	if (fill == NULL) {
+		kprintf("coremapbench: out of memory\n");
+		return 0;
+	}
+	gettime(&secs1, &nsecs1);
+	coremapbench_run();
+	gettime(&secs2, &nsecs2);
+	coremapbench_release(fill, nfill);
+	coremapbench_report("kernel", 1, nfill, secs1, nsecs1,
+			    secs2, nsecs2);
+
+	gettime(&secs1, &nsecs1);
+	coremapbench_userrun();
+	gettime(&secs2, &nsecs2);
+	coremapbench_report("user", 1, 0, secs1, nsecs1, secs2, nsecs2);
+
 	return 0;
 }
 
+static
+void
+coremapbenchthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+
+	(void)num;
+	coremapbench_run();
+	V(sem);
+}
+
+static
+void
+coremapbenchuserthread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+
+	(void)num;
+	coremapbench_userrun();
+	V(sem);
+}
+
 int
 coremapstress(int nargs, char **args)
 {
 	struct semaphore *sem;
-	int i, err;
+	int i, n, err;
+	vaddr_t *fill;
+	unsigned nfill;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
 
 	(void)nargs;
 	(void)args;
@@ -133,8 +331,50 @@ coremapstress(int nargs, char **args)
 		P(sem);
 	}
 
-	sem_destroy(sem);
 	kprintf("kcoremap stress test done\n");
 
+	fill = coremapbench_fill(&nfill);
+	if (fill == NULL) {
+		kprintf("coremapbench: out of memory\n");
+		sem_destroy(sem);
+		return 0;
+	}
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NTHREADS; i++) {
+		err = thread_fork("coremapbench", coremapbenchthread, sem, i,
+				  NULL);
+		if (err) {
+			panic("coremapstress: thread_fork failed (%d)\n", err);
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(sem);
+	}
+	gettime(&secs2, &nsecs2);
+	coremapbench_release(fill, nfill);
+	coremapbench_report("kernel", NTHREADS, nfill, secs1, nsecs1,
+			    secs2, nsecs2);
+
+	for (n=1; n<=NTHREADS; n*=2) {
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<n; i++) {
+			err = thread_fork("coremapbench",
+					  coremapbenchuserthread, sem, i,
+					  NULL);
+			if (err) {
+				panic("coremapstress: thread_fork failed "
+				      "(%d)\n", err);
+			}
+		}
+		for (i=0; i<n; i++) {
+			P(sem);
+		}
+		gettime(&secs2, &nsecs2);
+		coremapbench_report("user", n, 0, secs1, nsecs1,
+				    secs2, nsecs2);
+	}
+
+	sem_destroy(sem);
+
 	return 0;
 }
@@ -0,0 +1,550 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Page fault benchmark.
+ *
+ * Each of N threads gets its own address space with one anonymous
+ * region, and the regions add up to FB_RAMMULT times the size of RAM,
+ * so sweeping through them keeps paging. After a first sweep that
+ * writes every page (so they all end up in swap), the threads sweep
+ * reading one word per page FB_SWEEPS times, all starting together,
+ * and we count the major faults they took per second.
+ *
+ * Runs with 1, 2, ... FB_MAXTHREADS threads; run it under different
+ * CPU counts to see how well concurrent page-ins scale. It needs swap
+ * of at least FB_RAMMULT times RAM.
+ *
+ * regionbench times the fault path's search for the region a fault
+ * is in: it sets up address spaces with 4, 64, and 1024 one-page
+ * regions and faults on them in turn, RB_FAULTS times, so every fault
+ * is in a different region from the last. The pages are never
+ * touched, so each fault just maps the zero page.
+ *
+ * thrashbench runs TB_NPROCS processes (threads with their own address
+ * spaces, like parallelvm's children) that each update every page of
+ * their region TB_PASSES times, with the regions adding up to 2, 4,
+ * and 8 times the size of RAM. It times how long they take to all
+ * finish, first with load control off and then with it on (at the
+ * threshold set with vmlc, or TB_THRESHOLD if it's off). It stops
+ * when it runs out of swap.
+ *
+ * minorbench times TLB misses on pages that are resident: one thread
+ * writes every page of a region of MB_NPAGES pages, several times the
+ * number of TLB entries, then sweeps it reading one word per page
+ * MB_SWEEPS times, so each read misses in the TLB. It does the sweeps
+ * once with TLB refills from the page table turned off, so every miss
+ * goes through the whole fault path, and once with them on, and
+ * prints the time per access and how many took the full fault path.
+ * (System/161 time is simulated, so the times are in proportion to
+ * cycles.)
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <test.h>
+#include <mainbus.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vmprivate.h>
+
+#define FB_MAXTHREADS	4
+#define FB_RAMMULT	2
+#define FB_SWEEPS	3
+#define FB_BASE		0x10000000
+
+#define RB_FAULTS	20000
+
+#define TB_NPROCS	8
+#define TB_PASSES	4
+#define TB_THRESHOLD	20	/* major faults/sec */
+
+#define MB_NPAGES	256
+#define MB_SWEEPS	20
+
+static struct semaphore *fb_ready;
+static struct semaphore *fb_go;
+static struct semaphore *fb_done;
+static unsigned fb_npages;
+
+static
+void
+faultbenchthread(void *junk, unsigned long num)
+{
+	struct addrspace *as;
+	volatile uint32_t *p;
+	uint32_t sum;
+	unsigned i, j;
+	int result;
+
+	(void)junk;
+
+	as = as_create();
+	if (as == NULL) {
+		panic("faultbench: as_create failed\n");
+	}
+	result = as_define_region(as, FB_BASE, fb_npages * PAGE_SIZE, 0,
+				  1, 1, 0);
+	if (result) {
+		panic("faultbench: as_define_region: %s\n", strerror(result));
+	}
+	curthread->t_addrspace = as;
+	as_activate(as);
+
+	for (i=0; i<fb_npages; i++) {
+		p = (volatile uint32_t *)(FB_BASE + i * PAGE_SIZE);
+		*p = num + i;
+	}
+
+	V(fb_ready);
+	P(fb_go);
+
+	sum = 0;
+	for (j=0; j<FB_SWEEPS; j++) {
+		for (i=0; i<fb_npages; i++) {
+			p = (volatile uint32_t *)(FB_BASE + i * PAGE_SIZE);
+			sum += *p;
+		}
+	}
+	(void)sum;
+
+	/*
+	 * Get rid of the address space before saying we're done, so
+	 * the next run doesn't start while its pages and swap are
+	 * still being freed.
+	 */
+	curthread->t_addrspace = NULL;
+	as_activate(NULL);
+	as_destroy(as);
+
+	V(fb_done);
+}
+
+int
+faultbench(int nargs, char **args)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint32_t faults1, faults2;
+	uint64_t usecs;
+	unsigned n, i;
+	int err;
+
+	(void)nargs;
+	(void)args;
+
+	fb_ready = sem_create("faultbench", 0);
+	fb_go = sem_create("faultbench", 0);
+	fb_done = sem_create("faultbench", 0);
+	if (fb_ready == NULL || fb_go == NULL || fb_done == NULL) {
+		panic("faultbench: sem_create failed\n");
+	}
+
+	for (n=1; n<=FB_MAXTHREADS; n*=2) {
+		fb_npages = FB_RAMMULT * (mainbus_ramsize() / PAGE_SIZE) / n;
+
+		for (i=0; i<n; i++) {
+			err = thread_fork("faultbench", faultbenchthread,
+					  NULL, i, NULL);
+			if (err) {
+				panic("faultbench: thread_fork failed (%d)\n",
+				      err);
+			}
+		}
+		for (i=0; i<n; i++) {
+			P(fb_ready);
+		}
+
+		faults1 = lpage_majfaults();
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<n; i++) {
+			V(fb_go);
+		}
+		for (i=0; i<n; i++) {
+			P(fb_done);
+		}
+		gettime(&secs2, &nsecs2);
+		faults2 = lpage_majfaults();
+
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+		if (usecs == 0) {
+			usecs = 1;
+		}
+		kprintf("faultbench: %uk RAM, %u thread(s), %u pages each: "
+			"%lu major faults in %lu.%06lu sec "
+			"(%lu faults/sec)\n",
+			(unsigned)(mainbus_ramsize() / 1024), n, fb_npages,
+			(unsigned long) (faults2 - faults1),
+			(unsigned long) (usecs / 1000000),
+			(unsigned long) (usecs % 1000000),
+			(unsigned long) ((uint64_t)(faults2 - faults1)
+					 * 1000000 / usecs));
+	}
+
+	sem_destroy(fb_ready);
+	sem_destroy(fb_go);
+	sem_destroy(fb_done);
+
+	return 0;
+}
+
+static
+void
+regionbenchthread(void *sm, unsigned long nregions)
+{
+	struct semaphore *sem = sm;
+	struct addrspace *as;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t nsecstotal;
+	unsigned i;
+	int result;
+
+	as = as_create();
+	if (as == NULL) {
+		panic("regionbench: as_create failed\n");
+	}
+	/* (backwards, so each one goes in at the front) */
+	for (i=nregions; i-- > 0; ) {
+		result = as_define_region(as, FB_BASE + i * 2 * PAGE_SIZE,
+					  PAGE_SIZE, 0, 1, 1, 0);
+		if (result) {
+			panic("regionbench: as_define_region: %s\n",
+			      strerror(result));
+		}
+	}
+	curthread->t_addrspace = as;
+	as_activate(as);
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<RB_FAULTS; i++) {
+		result = as_fault(as, VM_FAULT_READ,
+				  FB_BASE + (i % nregions) * 2 * PAGE_SIZE);
+		if (result) {
+			panic("regionbench: as_fault: %s\n",
+			      strerror(result));
+		}
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	nsecstotal = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("regionbench: %lu regions: %u faults, %lu nsec per fault\n",
+		nregions, RB_FAULTS,
+		(unsigned long) (nsecstotal / RB_FAULTS));
+
+	/*
+	 * Get rid of the address space before saying we're done, so
+	 * the next run doesn't start while its pages and swap are
+	 * still being freed.
+	 */
+	curthread->t_addrspace = NULL;
+	as_activate(NULL);
+	as_destroy(as);
+
+	V(sem);
+}
+
+int
+regionbench(int nargs, char **args)
+{
+	static const unsigned counts[] = { 4, 64, 1024 };
+	struct semaphore *sem;
+	unsigned i;
+	int err;
+
+	(void)nargs;
+	(void)args;
+
+	sem = sem_create("regionbench", 0);
+	if (sem == NULL) {
+		panic("regionbench: sem_create failed\n");
+	}
+
+	for (i=0; i<sizeof(counts)/sizeof(counts[0]); i++) {
+		err = thread_fork("regionbench", regionbenchthread, sem,
+				  counts[i], NULL);
+		if (err) {
+			panic("regionbench: thread_fork failed (%d)\n", err);
+		}
+		P(sem);
+	}
+
+	sem_destroy(sem);
+	return 0;
+}
+
+static struct semaphore *tb_done;
+static unsigned tb_npages;
+static volatile bool tb_nomem;
+
+static
+void
+thrashbenchthread(void *junk, unsigned long num)
+{
+	struct addrspace *as;
+	volatile uint32_t *p;
+	unsigned i, j;
+	int result;
+
+	(void)junk;
+
+	as = as_create();
+	if (as == NULL) {
+		panic("thrashbench: as_create failed\n");
+	}
+	result = as_define_region(as, FB_BASE, tb_npages * PAGE_SIZE, 0,
+				  1, 1, 0);
+	if (result) {
+		/* not enough swap */
+		as_destroy(as);
+		tb_nomem = true;
+		V(tb_done);
+		return;
+	}
+	curthread->t_addrspace = as;
+	as_activate(as);
+
+	for (j=0; j<TB_PASSES; j++) {
+		for (i=0; i<tb_npages; i++) {
+			p = (volatile uint32_t *)(FB_BASE + i * PAGE_SIZE);
+			*p += num + j;
+		}
+	}
+
+	/*
+	 * As in faultbench: free it before saying we're done, so its
+	 * swap reservation is back before the next run asks for some.
+	 */
+	curthread->t_addrspace = NULL;
+	as_activate(NULL);
+	as_destroy(as);
+
+	V(tb_done);
+}
+
+/*
+ * Run TB_NPROCS processes of TB_NPAGES pages each to completion and
+ * print how long it took.
+ */
+static
+void
+thrashbench_run(unsigned mult, unsigned threshold)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint32_t faults1, faults2;
+	unsigned i;
+	int err;
+
+	tb_nomem = false;
+	faults1 = lpage_majfaults();
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<TB_NPROCS; i++) {
+		err = thread_fork("thrashbench", thrashbenchthread,
+				  NULL, i, NULL);
+		if (err) {
+			panic("thrashbench: thread_fork failed (%d)\n", err);
+		}
+	}
+	for (i=0; i<TB_NPROCS; i++) {
+		P(tb_done);
+	}
+	gettime(&secs2, &nsecs2);
+	faults2 = lpage_majfaults();
+
+	if (tb_nomem) {
+		return;
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	kprintf("thrashbench: %ux RAM, %u procs of %u pages, "
+		"load control %u: %lu.%03lu sec, %lu major faults\n",
+		mult, TB_NPROCS, tb_npages, threshold,
+		(unsigned long) secs, (unsigned long) (nsecs / 1000000),
+		(unsigned long) (faults2 - faults1));
+}
+
+int
+thrashbench(int nargs, char **args)
+{
+	unsigned mult, threshold, oldthreshold;
+	bool swapout;
+
+	(void)nargs;
+	(void)args;
+
+	tb_done = sem_create("thrashbench", 0);
+	if (tb_done == NULL) {
+		panic("thrashbench: sem_create failed\n");
+	}
+
+	oldthreshold = loadctl_getthreshold(&swapout);
+	threshold = oldthreshold > 0 ? oldthreshold : TB_THRESHOLD;
+
+	tb_nomem = false;
+	for (mult=2; mult<=8 && !tb_nomem; mult*=2) {
+		tb_npages = mult * (mainbus_ramsize() / PAGE_SIZE) / TB_NPROCS;
+
+		loadctl_setthreshold(0, swapout);
+		thrashbench_run(mult, 0);
+		if (tb_nomem) {
+			break;
+		}
+		loadctl_setthreshold(threshold, swapout);
+		thrashbench_run(mult, threshold);
+	}
+	if (tb_nomem) {
+		kprintf("thrashbench: not enough swap for %ux RAM\n", mult);
+	}
+
+	loadctl_setthreshold(oldthreshold, swapout);
+	sem_destroy(tb_done);
+	return 0;
+}
+
+static unsigned mb_npages;
+
+/*
+ * Do MB_SWEEPS read sweeps over the region and print how long they
+ * took.
+ */
+static
+void
+minorbench_sweep(struct addrspace *as, bool fast)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t nsecstotal;
+	unsigned faults1, faults2;
+	volatile uint32_t *p;
+	uint32_t sum;
+	unsigned i, j, n;
+
+	mmu_set_fastrefill(fast);
+
+	faults1 = as->as_faults;
+	gettime(&secs1, &nsecs1);
+	sum = 0;
+	for (j=0; j<MB_SWEEPS; j++) {
+		for (i=0; i<mb_npages; i++) {
+			p = (volatile uint32_t *)(FB_BASE + i * PAGE_SIZE);
+			sum += *p;
+		}
+	}
+	gettime(&secs2, &nsecs2);
+	faults2 = as->as_faults;
+	(void)sum;
+
+	n = MB_SWEEPS * mb_npages;
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	nsecstotal = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("minorbench: refill from page table %s: %u accesses, "
+		"%u full faults, %lu nsec per access\n",
+		fast ? "on" : "off", n, faults2 - faults1,
+		(unsigned long) (nsecstotal / n));
+}
+
+static
+void
+minorbenchthread(void *sm, unsigned long junk)
+{
+	struct semaphore *sem = sm;
+	struct addrspace *as;
+	volatile uint32_t *p;
+	bool oldfast;
+	unsigned i;
+	int result;
+
+	(void)junk;
+
+	as = as_create();
+	if (as == NULL) {
+		panic("minorbench: as_create failed\n");
+	}
+	result = as_define_region(as, FB_BASE, mb_npages * PAGE_SIZE, 0,
+				  1, 1, 0);
+	if (result) {
+		panic("minorbench: as_define_region: %s\n",
+		      strerror(result));
+	}
+	curthread->t_addrspace = as;
+	as_activate(as);
+
+	for (i=0; i<mb_npages; i++) {
+		p = (volatile uint32_t *)(FB_BASE + i * PAGE_SIZE);
+		*p = i;
+	}
+
+	oldfast = mmu_get_fastrefill();
+	minorbench_sweep(as, false);
+	minorbench_sweep(as, true);
+	mmu_set_fastrefill(oldfast);
+
+	/* As above, free the address space before saying we're done. */
+	curthread->t_addrspace = NULL;
+	as_activate(NULL);
+	as_destroy(as);
+
+	V(sem);
+}
+
+int
+minorbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	int err;
+
+	(void)nargs;
+	(void)args;
+
+	/* stay well inside RAM, so nothing gets paged out */
+	mb_npages = MB_NPAGES;
+	if (mb_npages > mainbus_ramsize() / PAGE_SIZE / 4) {
+		mb_npages = mainbus_ramsize() / PAGE_SIZE / 4;
+	}
+
+	sem = sem_create("minorbench", 0);
+	if (sem == NULL) {
+		panic("minorbench: sem_create failed\n");
+	}
+
+	err = thread_fork("minorbench", minorbenchthread, sem, 0, NULL);
+	if (err) {
+		panic("minorbench: thread_fork failed (%d)\n", err);
+	}
+	P(sem);
+
+	sem_destroy(sem);
+	return 0;
+}
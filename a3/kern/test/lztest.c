@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <test.h>
+
+#define TESTSIZE 4096
+#define TESTROUNDS 20
+
+/*
+ * Fill the buffer with data of varying compressibility: zeros,
+ * noise, a few symbols, and runs.
+ */
+static
+void
+lztest_fill(unsigned char *buf, unsigned kind)
+{
+	unsigned i;
+
+	for (i=0; i<TESTSIZE; i++) {
+		switch (kind % 4) {
+		    case 0: buf[i] = 0; break;
+		    case 1: buf[i] = random(); break;
+		    case 2: buf[i] = random() % 3; break;
+		    default:
+			buf[i] = (i == 0 || random() % 16 == 0) ?
+				random() : buf[i-1];
+			break;
+		}
+	}
+}
+
+int
+lztest(int nargs, char **args)
+{
+	unsigned char *src, *comp, *dst;
+	void *work;
+	size_t clen, dlen;
+	unsigned i, j;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting lz test...\n");
+
+	src = kmalloc(TESTSIZE);
+	comp = kmalloc(TESTSIZE * 2);
+	dst = kmalloc(TESTSIZE);
+	work = kmalloc(LZ_WORKSIZE);
+	KASSERT(src != NULL && comp != NULL && dst != NULL && work != NULL);
+
+	for (i=0; i<TESTROUNDS; i++) {
+		lztest_fill(src, i);
+
+		clen = lz_compress(src, TESTSIZE, comp, TESTSIZE * 2, work);
+		KASSERT(clen > 0);
+		dlen = lz_decompress(comp, clen, dst, TESTSIZE);
+		KASSERT(dlen == TESTSIZE);
+		for (j=0; j<TESTSIZE; j++) {
+			KASSERT(src[j] == dst[j]);
+		}
+
+		/* truncated input must be rejected, not overrun */
+		if (clen > 1) {
+			dlen = lz_decompress(comp, clen - 1, dst, TESTSIZE);
+			KASSERT(dlen != TESTSIZE);
+		}
+
+		/* and output that doesn't fit must be refused */
+		if (clen > 16) {
+			KASSERT(lz_compress(src, TESTSIZE, comp, 16, work)
+				== 0);
+		}
+	}
+
+	kfree(work);
+	kfree(dst);
+	kfree(comp);
+	kfree(src);
+
+	kprintf("LZ test complete\n");
+	return 0;
+}
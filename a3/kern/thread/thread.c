@@ -1250,9 +1250,45 @@ ipi_tlbshootdown(unsigned targetcpu, const struct tlbshootdown *mapping)
         spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Queue N shootdowns for TARGETCPU and poke it once for all of them.
+ */
+void
+ipi_tlbshootdown_batch(unsigned targetcpu,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	struct cpu *target;
+	unsigned i;
+	int k;
+
+	target = cpuarray_get(&allcpus, targetcpu);
+
+	spinlock_acquire(&target->c_ipi_lock);
+
+	for (i=0; i<n; i++) {
+		k = target->c_numshootdown;
+		if (k == TLBSHOOTDOWN_ALL) {
+			break;
+		}
+		if (k == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[k] = mappings[i];
+		target->c_numshootdown = k+1;
+	}
+
+	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+	mainbus_send_ipi(target);
+
+	spinlock_release(&target->c_ipi_lock);
+}
+
 void
 interprocessor_interrupt(void)
 {
+	struct tlbshootdown shootdown[TLBSHOOTDOWN_MAX];
+	int numshootdown = 0;
 	uint32_t bits;
 
 	spinlock_acquire(&curcpu->c_ipi_lock);
@@ -1282,23 +1318,35 @@ interprocessor_interrupt(void)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
-		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
+		/*
+		 * Take the shootdowns and let go of the IPI lock before
+		 * calling the VM system, which has its own locks; the
+		 * VM system may be sending us more while holding them.
+		 */
+		numshootdown = curcpu->c_numshootdown;
+		if (numshootdown != TLBSHOOTDOWN_ALL) {
+			memcpy(shootdown, curcpu->c_shootdown,
+			       numshootdown * sizeof(shootdown[0]));
+		}
+		curcpu->c_numshootdown = 0;
+	}
+
+	curcpu->c_ipi_pending = 0;
+	spinlock_release(&curcpu->c_ipi_lock);
+
+	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
+		if (numshootdown == TLBSHOOTDOWN_ALL) {
 			vm_tlbshootdown_all();
 		}
 		else {
                         /* BEGIN A3 SETUP */
                         /* To switch between dumbvm and real vm. */
 #if OPT_DUMBVM
-                        vm_tlbshootdown(curcpu->c_shootdown);
+                        vm_tlbshootdown(shootdown);
 #else
-                        vm_tlbshootdown(curcpu->c_shootdown,
-                                        curcpu->c_numshootdown);
+                        vm_tlbshootdown(shootdown, numshootdown);
 #endif
                         /* END A3 SETUP */
 		}
-		curcpu->c_numshootdown = 0;
 	}
-
-	curcpu->c_ipi_pending = 0;
-	spinlock_release(&curcpu->c_ipi_lock);
 }
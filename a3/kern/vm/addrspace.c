@@ -30,10 +30,14 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/unistd.h>
+#include <kern/mman.h>
 #include <limits.h>
 #include <lib.h>
 #include <array.h>
 #include <uio.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <synch.h>
 #include <thread.h>
 #include <current.h>
 #include <addrspace.h>
@@ -55,14 +59,179 @@
 
 DEFARRAY_BYTYPE(vm_object_array, struct vm_object, /*noinline*/);
 
+/* Stats counters */
+static volatile uint32_t ct_forks;
+static volatile uint64_t ct_fork_nsecs;		/* total time in as_copy */
+static volatile uint64_t ct_fork_maxnsecs;
+static struct spinlock as_stats_spinlock = SPINLOCK_INITIALIZER;
+
+/*
+ * Per-process stats. All live address spaces are on as_all, and the
+ * stats of the last AS_NEXITED to be destroyed are kept in as_exited
+ * (a ring; as_nexited counts them all) so they can be looked at from
+ * the menu after the program's done. as_default_rsslimit is the RSS
+ * limit given to new address spaces (not forked ones, which inherit
+ * their parent's).
+ */
+#define AS_NEXITED	8
+
+struct as_exitstats {
+	char ae_name[AS_NAMELEN];
+	unsigned ae_rsspeak;
+	unsigned ae_rsslimit;
+	unsigned ae_rsshits;
+	unsigned ae_faults;
+	unsigned ae_majfaults;
+};
+
+static struct lock *as_all_lock;
+static struct array as_all;
+static struct as_exitstats as_exited[AS_NEXITED];
+static unsigned as_nexited;
+static unsigned as_default_rsslimit;
+
+/*
+ * as_bootstrap: set up the address space list.
+ */
+void
+as_bootstrap(void)
+{
+	as_all_lock = lock_create("as_all");
+	if (as_all_lock == NULL) {
+		panic("as_bootstrap: Out of memory\n");
+	}
+	array_init(&as_all);
+}
+
+/*
+ * Set or get the RSS limit for new address spaces, in pages. 0 means
+ * no limit.
+ */
+void
+as_setrsslimit(unsigned npages)
+{
+	as_default_rsslimit = npages;
+}
+
+unsigned
+as_getrsslimit(void)
+{
+	return as_default_rsslimit;
+}
+
+/*
+ * Print one line of per-process stats. The counters are read without
+ * locking; they're only approximate anyway.
+ */
+static
+void
+as_printproc(const char *name, char state, unsigned rss, unsigned peak,
+	     unsigned limit, unsigned hits, unsigned faults,
+	     unsigned majfaults)
+{
+	kprintf("%-16s %c %6u %6u %6u %7u %8u %8u\n", name[0] ? name : "-",
+		state, rss, peak, limit, hits, faults, majfaults);
+}
+
+/*
+ * as_printprocs: print resident set size, RSS limit, and fault counts
+ * for each live address space and the last few to exit. (A limit of 0
+ * is no limit.) The state is R for running, S for suspended by load
+ * control, or X for exited.
+ */
+void
+as_printprocs(void)
+{
+	struct addrspace *as;
+	struct as_exitstats *ae;
+	unsigned i, n;
+
+	kprintf("RSS limit for new processes: %u pages\n",
+		as_default_rsslimit);
+	kprintf("%-16s %c %6s %6s %6s %7s %8s %8s\n", "name", 'S', "rss",
+		"peak", "limit", "lhits", "faults", "major");
+
+	lock_acquire(as_all_lock);
+	for (i=0; i<array_num(&as_all); i++) {
+		as = array_get(&as_all, i);
+		as_printproc(as->as_name, as->as_suspended ? 'S' : 'R',
+			     as->as_rss, as->as_rsspeak,
+			     as->as_rsslimit, as->as_rsshits,
+			     as->as_faults, as->as_majfaults);
+	}
+
+	n = as_nexited < AS_NEXITED ? as_nexited : AS_NEXITED;
+	if (n > 0) {
+		kprintf("Exited (most recent last):\n");
+	}
+	for (i = as_nexited - n; i < as_nexited; i++) {
+		ae = &as_exited[i % AS_NEXITED];
+		as_printproc(ae->ae_name, 'X', 0, ae->ae_rsspeak,
+			     ae->ae_rsslimit, ae->ae_rsshits,
+			     ae->ae_faults, ae->ae_majfaults);
+	}
+	lock_release(as_all_lock);
+}
+
+/*
+ * Take AS off the list and remember its stats.
+ */
+static
+void
+as_unlist(struct addrspace *as)
+{
+	struct as_exitstats *ae;
+	unsigned i, num;
+
+	lock_acquire(as_all_lock);
+	num = array_num(&as_all);
+	for (i=0; i<num; i++) {
+		if (array_get(&as_all, i) == as) {
+			array_remove(&as_all, i);
+			break;
+		}
+	}
+	KASSERT(i < num);
+
+	ae = &as_exited[as_nexited % AS_NEXITED];
+	strcpy(ae->ae_name, as->as_name);
+	ae->ae_rsspeak = as->as_rsspeak;
+	ae->ae_rsslimit = as->as_rsslimit;
+	ae->ae_rsshits = as->as_rsshits;
+	ae->ae_faults = as->as_faults;
+	ae->ae_majfaults = as->as_majfaults;
+	as_nexited++;
+	lock_release(as_all_lock);
+}
+
+void
+as_printstats(void)
+{
+	uint32_t nf;
+	uint64_t totns, maxns;
+
+	spinlock_acquire(&as_stats_spinlock);
+	nf = ct_forks;
+	totns = ct_fork_nsecs;
+	maxns = ct_fork_maxnsecs;
+	spinlock_release(&as_stats_spinlock);
+
+	kprintf("vm: %lu forks, as_copy avg %lu usec, max %lu usec\n",
+		(unsigned long) nf,
+		(unsigned long) (nf > 0 ? totns / nf / 1000 : 0),
+		(unsigned long) (maxns / 1000));
+}
+
 /*
  * as_create - create an address space structure.
- * Synchronization: none.
+ * Synchronization: none. The page merger can see the new address
+ * space as soon as it exists, but it's empty.
  */
 struct addrspace *
 as_create(void)
 {
 	struct addrspace *as;
+	int result;
 
 	as = kmalloc(sizeof(struct addrspace));
 	if (as == NULL) {
@@ -75,24 +244,84 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
+
+	as->as_lastobj = NULL;
+	as->as_heap = NULL;
+	as->as_heapend = 0;
+
+	as->as_rss = 0;
+	as->as_rsspeak = 0;
+	as->as_rsslimit = as_default_rsslimit;
+	as->as_rsshits = 0;
+	as->as_rsshand = 0;
+	as->as_name[0] = '\0';
+	as->as_faults = 0;
+	as->as_majfaults = 0;
+	as->as_suspended = false;
+	as->as_lcmajfaults = 0;
+
+	addrspace_machdep_init(&as->as_machdep);
+
+	lock_acquire(as_all_lock);
+	result = array_add(&as_all, as, NULL);
+	lock_release(as_all_lock);
+	if (result) {
+		lock_destroy(as->as_lock);
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
+
+	if (pagemerge_addas(as)) {
+		as_unlist(as);
+		lock_destroy(as->as_lock);
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
+
+	if (loadctl_addas(as)) {
+		pagemerge_removeas(as);
+		as_unlist(as);
+		lock_destroy(as->as_lock);
+		vm_object_array_destroy(as->as_objects);
+		kfree(as);
+		return NULL;
+	}
+
 	return as;
 }
 
 /*
  * as_copy: duplicate an address space. Creates a new address space and
  * copies each vm_object in the source address space into the new one.
- * Implements the VM system part of fork().
+ * Implements the VM system part of fork(). The vm_objects share their
+ * pages copy-on-write, so no page contents are copied here; sharing
+ * them only counts references, and then the parent's mappings are
+ * write-protected all at once.
  *
- * Synchronization: none.
+ * Synchronization: holds both address spaces locked, to keep the page
+ * merger out.
  */
 int
 as_copy(struct addrspace *as, struct addrspace **ret)
 {
 	struct addrspace *newas;
 	struct vm_object *vmo, *newvmo;
+	time_t beforesecs, aftersecs, secs;
+	uint32_t beforensecs, afternsecs, nsecs;
+	uint64_t elapsed;
 	unsigned i;
 	int result;
 
+	gettime(&beforesecs, &beforensecs);
+
 	newas = as_create();
 	if (newas==NULL) {
 		return ENOMEM;
@@ -109,6 +338,8 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 
 	KASSERT(as == curthread->t_addrspace);
 
+	lock_acquire(as->as_lock);
+	lock_acquire(newas->as_lock);
 
 	/* copy the vmos */
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
@@ -124,70 +355,386 @@ as_copy(struct addrspace *as, struct addrspace **ret)
 			vm_object_destroy(newas, newvmo);
 			goto fail;
 		}
+
+		if (vmo == as->as_heap) {
+			newas->as_heap = newvmo;
+		}
+	}
+	newas->as_heapend = as->as_heapend;
+	newas->as_rsslimit = as->as_rsslimit;
+
+	mmu_writeprotect(as);
+
+	lock_release(newas->as_lock);
+	lock_release(as->as_lock);
+
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+	elapsed = (uint64_t)secs * 1000000000 + nsecs;
+
+	spinlock_acquire(&as_stats_spinlock);
+	ct_forks++;
+	ct_fork_nsecs += elapsed;
+	if (elapsed > ct_fork_maxnsecs) {
+		ct_fork_maxnsecs = elapsed;
 	}
+	spinlock_release(&as_stats_spinlock);
 	
 	*ret = newas;
 	return 0;
 
 fail:
+	lock_release(newas->as_lock);
+	lock_release(as->as_lock);
 	as_destroy(newas);
 	return result;
 }
 
 /*
- * as_fault: fault handling. Handle a fault on an address space, of
- * specified type, at specified address.
+ * as_fault_object: handle a fault at VA on page INDEX of FAULTOBJ.
+ * Once the page is mapped, read ahead from swap if it was a major
+ * fault and, unless the object is shared, map any resident
+ * neighbours (see vmobj.c).
+ */
+static
+int
+as_fault_object(struct addrspace *as, struct vm_object *faultobj,
+		unsigned index, int faulttype, vaddr_t va)
+{
+	struct lpage *lp;
+	struct vm_backing vb, *vbp;
+	bool major;
+	int result;
+
+	lp = lpage_table_get(faultobj->vmo_lpages, index);
+
+	vbp = NULL;
+	if (faultobj->vmo_vnode != NULL) {
+		vm_object_backing(faultobj, index, &vb);
+		vbp = &vb;
+	}
+
+	if (lp == NULL && vbp != NULL &&
+	    (vb.vb_len > 0 || !faultobj->vmo_writeable)) {
+		/* first touch of a file page */
+		result = lpage_table_prepare(faultobj->vmo_lpages, index);
+		if (result) {
+			return result;
+		}
+		result = lpage_filein(&lp, vbp, faultobj->vmo_writeable,
+				      faultobj->vmo_reserved);
+		if (result) {
+			kprintf("vm: file fault at 0x%x failed\n", va);
+			return result;
+		}
+		lpage_table_set(faultobj->vmo_lpages, index, lp);
+	}
+	else if (lp == NULL && faulttype == VM_FAULT_READ &&
+		 !faultobj->vmo_shared) {
+		/*
+		 * Reading an untouched zerofill page: map the zero page
+		 * until it's written. (Not for shared objects, since
+		 * someone else's write wouldn't show up here.)
+		 */
+		lpage_zeromap(as, va);
+		return 0;
+	}
+	else if (lp == NULL) {
+		/* zerofill page; it may have been mapped to zeros */
+		result = lpage_table_prepare(faultobj->vmo_lpages, index);
+		if (result) {
+			return result;
+		}
+		mmu_unmap_zero(as);
+		result = lpage_zerofill(&lp, faultobj->vmo_reserved);
+		if (result) {
+			kprintf("vm: zerofill fault at 0x%x failed\n", va);
+			return result;
+		}
+		lpage_table_set(faultobj->vmo_lpages, index, lp);
+	}
+
+	result = lpage_fault(&lp, as, faulttype, va, vbp, &major);
+
+	/* A write to a shared page gets a private copy; keep that one. */
+	lpage_table_set(faultobj->vmo_lpages, index, lp);
+
+	if (result) {
+		return result;
+	}
+
+	if (major) {
+		as->as_majfaults++;
+		vm_object_readahead(faultobj, index);
+	}
+	if (faulttype != VM_FAULT_READONLY && !faultobj->vmo_shared) {
+		/*
+		 * (On a READONLY fault the neighbours are likely mapped.
+		 * A shared object's resident pages are as likely to be
+		 * some other process's working set as ours, and mapping
+		 * them here would fill our TLB with them.)
+		 */
+		vm_object_faultaround(faultobj, as, index);
+	}
+
+	return 0;
+}
+
+/*
+ * as_fault_readonly: handle a fault at VA on page INDEX of FAULTOBJ, a
+ * shared read-only file object such as program text. Its pages have
+ * no swap and are never written, so the only change anyone makes to
+ * the object is installing an lpage on the first touch of a page;
+ * vmo_lock is held just for that. The lpage starts out not resident,
+ * and lpage_fault reads it from the file like any page that was
+ * evicted, marking it LPF_BUSY meanwhile: everyone else faulting on
+ * that page waits for the one read, and faults on other pages of the
+ * object don't wait at all.
  *
- * Synchronization: none. We assume the address space is not shared,
- * so we don't lock it.
+ * There is no readahead (it only works from swap) and no fault-around
+ * (see as_fault_object).
  */
+static
 int
-as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+as_fault_readonly(struct addrspace *as, struct vm_object *faultobj,
+		  unsigned index, int faulttype, vaddr_t va)
 {
-	struct vm_object *faultobj = NULL;
 	struct lpage *lp;
-	vaddr_t bot=0, top;
-	unsigned i, index;
+	struct vm_backing vb;
+	bool major;
 	int result;
 
-	/* Find the vm_object concerned */
-	for (i=0; i<vm_object_array_num(as->as_objects); i++) {
-		struct vm_object *vmo;
+	KASSERT(faulttype == VM_FAULT_READ);
+
+	vm_object_backing(faultobj, index, &vb);
+
+	result = 0;
+	lock_acquire(faultobj->vmo_lock);
+	lp = lpage_table_get(faultobj->vmo_lpages, index);
+	if (lp == NULL) {
+		result = lpage_table_prepare(faultobj->vmo_lpages, index);
+		if (result == 0) {
+			lp = lpage_create();
+			if (lp == NULL) {
+				result = ENOMEM;
+			}
+			else {
+				lpage_table_set(faultobj->vmo_lpages,
+						index, lp);
+			}
+		}
+	}
+	lock_release(faultobj->vmo_lock);
+	if (result) {
+		return result;
+	}
+
+	/* The object, and so LP, stays put while AS refers to it. */
+	result = lpage_fault(&lp, as, faulttype, va, &vb, &major);
+	if (result) {
+		kprintf("vm: file fault at 0x%x failed\n", va);
+		return result;
+	}
+
+	if (major) {
+		as->as_majfaults++;
+	}
+	return 0;
+}
+
+/*
+ * vmo_top: the address just past the pages of VMO.
+ */
+static
+vaddr_t
+vmo_top(struct vm_object *vmo)
+{
+	return vmo->vmo_base + PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+}
+
+/*
+ * as_upperbound: return the number of vm_objects in AS whose base
+ * address is at most VA, which is the index VA's object would be
+ * inserted at. The objects are sorted by base address.
+ */
+static
+unsigned
+as_upperbound(struct addrspace *as, vaddr_t va)
+{
+	struct vm_object *vmo;
+	unsigned lo, hi, mid;
+
+	lo = 0;
+	hi = vm_object_array_num(as->as_objects);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		vmo = vm_object_array_get(as->as_objects, mid);
+		if (vmo->vmo_base <= va) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * as_findobj: return the index of the vm_object VA is in, or -1.
+ *
+ * Only the last object at or below VA can hold it, except that empty
+ * ones (such as a heap nobody has grown yet) may sit at the same base
+ * as the object we want; skip those.
+ */
+int
+as_findobj(struct addrspace *as, vaddr_t va)
+{
+	struct vm_object *vmo;
+	unsigned i;
+	vaddr_t top;
 
+	i = as_upperbound(as, va);
+	while (i-- > 0) {
 		vmo = vm_object_array_get(as->as_objects, i);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
-		if (va >= bot && va < top) {
-			faultobj = vmo;
+		top = vmo_top(vmo);
+		if (va < top) {
+			return i;
+		}
+		if (top > vmo->vmo_base) {
 			break;
 		}
 	}
+	return -1;
+}
+
+/*
+ * as_insertobj: add VMO to AS's vm_objects, keeping them sorted. If
+ * there's already an (empty) object at the same base, VMO goes after
+ * it, as as_findobj expects.
+ */
+static
+int
+as_insertobj(struct addrspace *as, struct vm_object *vmo)
+{
+	unsigned i, pos;
+	int result;
+
+	pos = as_upperbound(as, vmo->vmo_base);
+	result = vm_object_array_add(as->as_objects, vmo, &i);
+	if (result) {
+		return result;
+	}
+	for (; i > pos; i--) {
+		vm_object_array_set(as->as_objects, i,
+			vm_object_array_get(as->as_objects, i - 1));
+	}
+	vm_object_array_set(as->as_objects, pos, vmo);
+	return 0;
+}
+
+/*
+ * as_removeobj: take the vm_object at index I out of AS. The caller
+ * destroys it.
+ */
+static
+void
+as_removeobj(struct addrspace *as, unsigned i)
+{
+	if (vm_object_array_get(as->as_objects, i) == as->as_lastobj) {
+		as->as_lastobj = NULL;
+	}
+	vm_object_array_remove(as->as_objects, i);
+}
+
+/*
+ * as_fault_locked: find the vm_object VA is in and fault on it. The
+ * caller holds AS locked.
+ *
+ * Faults tend to come in runs in the same object, so try the one the
+ * last fault was in before searching.
+ *
+ * Faults on a shared object hold its vmo_lock, except for a read-only
+ * file one (such as text), which as_fault_readonly handles.
+ */
+static
+int
+as_fault_locked(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	struct vm_object *faultobj;
+	vaddr_t bot;
+	unsigned index;
+	int result, i;
+
+	/* Find the vm_object concerned */
+	faultobj = as->as_lastobj;
+	if (faultobj == NULL || va < faultobj->vmo_base ||
+	    va >= vmo_top(faultobj)) {
+		i = as_findobj(as, va);
+		faultobj = (i < 0) ? NULL :
+			vm_object_array_get(as->as_objects, i);
+	}
 
 	if (faultobj == NULL) {
 		DEBUG(DB_VM, "vm_fault: EFAULT: va=0x%x\n", va);
 		return EFAULT;
 	}
 
+	if (faulttype != VM_FAULT_READ && !faultobj->vmo_writeable) {
+		DEBUG(DB_VM, "vm_fault: EFAULT: write to read-only "
+		      "va=0x%x\n", va);
+		return EFAULT;
+	}
+	as->as_lastobj = faultobj;
+
 	/* Now get the logical page */
+	bot = faultobj->vmo_base;
 	index = (va - bot) / PAGE_SIZE;
-	lp = lpage_array_get(faultobj->vmo_lpages, index);
 
-	if (lp == NULL) {
-		/* zerofill page */
-		result = lpage_zerofill(&lp);
-		if (result) {
-			kprintf("vm: zerofill fault at 0x%x failed\n", va);
-			return result;
-		}
-		lpage_array_set(faultobj->vmo_lpages, index, lp);
+	if (faultobj->vmo_shared && !faultobj->vmo_writeable &&
+	    faultobj->vmo_vnode != NULL) {
+		result = as_fault_readonly(as, faultobj, index, faulttype,
+					   va);
 	}
-	
-	return lpage_fault(lp, as, faulttype, va);
+	else if (faultobj->vmo_shared) {
+		lock_acquire(faultobj->vmo_lock);
+		result = as_fault_object(as, faultobj, index, faulttype, va);
+		lock_release(faultobj->vmo_lock);
+	}
+	else {
+		result = as_fault_object(as, faultobj, index, faulttype, va);
+	}
+
+	return result;
+}
+
+/*
+ * as_fault: fault handling. Handle a fault on an address space, of
+ * specified type, at specified address.
+ *
+ * Synchronization: we assume the address space is not shared, but
+ * lock it against the page merger. Shared vm_objects (from mmap) are
+ * locked too.
+ */
+int
+as_fault(struct addrspace *as, int faulttype, vaddr_t va)
+{
+	int result;
+
+	lock_acquire(as->as_lock);
+	as->as_faults++;
+	result = as_fault_locked(as, faulttype, va);
+	lock_release(as->as_lock);
+
+	return result;
 }
 
 /*
  * as_destroy: wipe out an address space by destroying its components.
- * Synchronization: none.
+ * Pages it faulted in that outlive it (shared with other address
+ * spaces) stop being charged to it.
+ *
+ * Synchronization: none, once the page merger has let go of it.
  */
 void
 as_destroy(struct addrspace *as)
@@ -195,6 +742,10 @@ as_destroy(struct addrspace *as)
 	struct vm_object *vmo;
 	unsigned i;
 
+	loadctl_removeas(as);
+	pagemerge_removeas(as);
+	as_unlist(as);
+
 	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
 		vm_object_destroy(as, vmo);
@@ -202,13 +753,17 @@ as_destroy(struct addrspace *as)
 
 	vm_object_array_setsize(as->as_objects, 0);
 	vm_object_array_destroy(as->as_objects);
+	addrspace_machdep_cleanup(&as->as_machdep);
+	coremap_disown(as);
+	lock_destroy(as->as_lock);
 	kfree(as);
 }
 
 /*
  * as_activate: load specified address space into the MMU as the
  * current address space. Called from context switch and also during
- * execv().
+ * execv(). The first time an address space runs, it takes the name of
+ * the thread running it, for the per-process stats.
  *
  * Synchronization: none.
  */
@@ -216,35 +771,44 @@ void
 as_activate(struct addrspace *as)
 {
 	KASSERT(as==NULL || as==curthread->t_addrspace);
+	if (as != NULL && as->as_name[0] == '\0') {
+		snprintf(as->as_name, sizeof(as->as_name), "%s",
+			 curthread->t_name);
+	}
 	mmu_setas(as);
 }
 
 /*
- * Set up a segment at virtual address VADDR of size MEMSIZE. The
- * segment in memory extends from VADDR up to (but not including)
- * VADDR+MEMSIZE.
+ * as_add_object: create the vm_object for a new region of SZ bytes at
+ * VADDR and add it to the address space. If V is not NULL the region
+ * is backed by FILESIZE bytes of V starting at FILEOFF. Otherwise it
+ * is zero-fill. Hands back the new object in RET, if not NULL.
  *
- * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored.
+ * If TEXT is set (a read-only file region of a program), the object
+ * is shared with any other address space that has the same region;
+ * see vm_object_gettext.
  *
- * Does not allow overlapping regions.
+ * Does not allow overlapping regions. The caller holds AS locked.
  */
+static
 int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 size_t lower_redzone,
-		 int readable, int writeable, int executable)
+as_add_object(struct addrspace *as, vaddr_t vaddr, size_t sz,
+	      size_t lower_redzone, struct vnode *v, off_t fileoff,
+	      size_t filesize, bool writeable, bool text,
+	      struct vm_object **ret)
 {
 	struct vm_object *vmo;
-	unsigned i;
+	unsigned i, pos;
 	int result;
 	vaddr_t check_vaddr;	/* vaddr to use for overlap check */
+	vaddr_t bot, top;
+	size_t filestart;
 
-	(void)readable;
-	(void)writeable;	// XXX
-	(void)executable;
+	KASSERT(lock_do_i_hold(as->as_lock));
 
-	/* align base address */
+	/* align base address; the file data starts where it was */
+	filestart = vaddr & ~PAGE_FRAME;
+	sz += filestart;
 	vaddr &= PAGE_FRAME;
 
 	/* redzone must be aligned */
@@ -258,46 +822,140 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	sz = ROUNDUP(sz, PAGE_SIZE);
 
 	/*
-	 * Check for overlaps.
+	 * Check for overlaps. Since the objects don't overlap each
+	 * other, only the ones next to where this one would go can
+	 * overlap it: going down, until one that ends below it (empty
+	 * ones end nowhere), and going up, until one that starts
+	 * (guard band and all) above it.
 	 */
-	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
-		vaddr_t bot, top;
-		
+	pos = as_upperbound(as, vaddr);
+	for (i = pos; i-- > 0; ) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+		top = vmo_top(vmo);
+		if (check_vaddr+sz > bot && check_vaddr < top) {
+			/* overlap */
+			return EINVAL;
+		}
+		if (top > vmo->vmo_base && top <= check_vaddr) {
+			break;
+		}
+	}
+	for (i = pos; i < vm_object_array_num(as->as_objects); i++) {
 		vmo = vm_object_array_get(as->as_objects, i);
-		KASSERT(vmo != NULL);
-		bot = vmo->vmo_base;
-		top = bot + PAGE_SIZE * lpage_array_num(vmo->vmo_lpages);
-
 		/* Check guard band, if any */
-		KASSERT(bot >= vmo->vmo_lower_redzone);
-		bot = bot - vmo->vmo_lower_redzone;
-
+		KASSERT(vmo->vmo_base >= vmo->vmo_lower_redzone);
+		bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+		top = vmo_top(vmo);
 		if (check_vaddr+sz > bot && check_vaddr < top) {
 			/* overlap */
 			return EINVAL;
 		}
+		if (bot >= check_vaddr+sz) {
+			break;
+		}
 	}
 
 
-	/* Create a new vmo. All pages are marked zerofilled. */
-	vmo = vm_object_create(sz/PAGE_SIZE);
+	/* Create a new vmo. All pages are marked zerofilled (or unread). */
+	if (text) {
+		KASSERT(v != NULL && !writeable && lower_redzone == 0);
+		vmo = vm_object_gettext(sz/PAGE_SIZE, vaddr, v, fileoff,
+					filestart, filesize);
+	}
+	else if (v != NULL) {
+		vmo = vm_object_create_vnode(sz/PAGE_SIZE, v, fileoff,
+					     filestart, filesize, writeable);
+	}
+	else {
+		vmo = vm_object_create(sz/PAGE_SIZE);
+	}
 	if (vmo == NULL) {
 		return ENOMEM;
 	}
-	vmo->vmo_base = vaddr;
-	vmo->vmo_lower_redzone = lower_redzone;
+	if (!text) {
+		vmo->vmo_base = vaddr;
+		vmo->vmo_lower_redzone = lower_redzone;
+		vmo->vmo_writeable = writeable;
+	}
 
 	/* Add it to the parent address space. */
-	result = vm_object_array_add(as->as_objects, vmo, NULL);
+	result = as_insertobj(as, vmo);
 	if (result) {
 		vm_object_destroy(as, vmo);
 		return result;
 	}
 
 	/* Done */
+	if (ret != NULL) {
+		*ret = vmo;
+	}
 	return 0;
 }
 
+/*
+ * Set up a segment at virtual address VADDR of size MEMSIZE. The
+ * segment in memory extends from VADDR up to (but not including)
+ * VADDR+MEMSIZE.
+ *
+ * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
+ * write, or execute permission should be set on the segment. Only
+ * WRITEABLE can be enforced (pages are mapped without the TLB dirty
+ * bit, and writes to them fault); the MIPS has no way to keep pages
+ * from being read or executed.
+ *
+ * Does not allow overlapping regions.
+ */
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 size_t lower_redzone,
+		 int readable, int writeable, int executable)
+{
+	int result;
+
+	(void)readable;
+	(void)executable;
+
+	lock_acquire(as->as_lock);
+	result = as_add_object(as, vaddr, sz, lower_redzone,
+			       NULL, 0, 0, writeable != 0, false, NULL);
+	lock_release(as->as_lock);
+
+	return result;
+}
+
+/*
+ * as_define_fileregion: like as_define_region, but the segment is
+ * initialized from FILESIZE bytes of the file V at offset OFFSET
+ * (the rest is zero). Pages are read from the file when first
+ * touched. If WRITEABLE is not set, writes to the segment fault, and
+ * its pages need no swap; and since they can't change, the segment is
+ * shared with every other process running the same program, so
+ * their text takes only one copy of memory.
+ */
+int
+as_define_fileregion(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		     struct vnode *v, off_t offset, size_t filesize,
+		     int readable, int writeable, int executable)
+{
+	int result;
+
+	(void)readable;
+	(void)executable;
+
+	if (filesize > sz) {
+		kprintf("vm: warning: file region filesize > memsize\n");
+		filesize = sz;
+	}
+
+	lock_acquire(as->as_lock);
+	result = as_add_object(as, vaddr, sz, 0, v, offset, filesize,
+			       writeable != 0, writeable == 0, NULL);
+	lock_release(as->as_lock);
+
+	return result;
+}
+
 /*
  * as_prepare_load: called before loading executable segments.
  */
@@ -313,17 +971,40 @@ as_prepare_load(struct addrspace *as)
 }
 
 /*
- * as_complete_load: called after loading executable segments.
+ * as_complete_load: called after loading executable segments. Puts an
+ * empty heap vm_object at the first page boundary above them, for
+ * sbrk to grow.
  */
 int
 as_complete_load(struct addrspace *as)
 {
-	/*
-	 * Do nothing.
-	 */
+	struct vm_object *vmo;
+	vaddr_t top, heapbase;
+	unsigned i;
+	int result;
 
-	(void)as;
-	return 0;
+	KASSERT(as->as_heap == NULL);
+
+	lock_acquire(as->as_lock);
+
+	heapbase = 0;
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		top = vmo->vmo_base +
+			PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+		if (top > heapbase) {
+			heapbase = top;
+		}
+	}
+
+	result = as_add_object(as, heapbase, 0, 0, NULL, 0, 0, true, false,
+			       &as->as_heap);
+	if (result == 0) {
+		as->as_heapend = heapbase;
+	}
+
+	lock_release(as->as_lock);
+	return result;
 }
 
 /*
@@ -354,3 +1035,306 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	
 	return 0;
 }
+
+/*
+ * as_findgap: find a free range of SZ bytes (a multiple of the page
+ * size) for mmap. Mappings are placed top-down from below the stack,
+ * leaving the space above the heap for the heap to grow into.
+ * Returns 0 if there's no room.
+ */
+static
+vaddr_t
+as_findgap(struct addrspace *as, size_t sz)
+{
+	struct vm_object *vmo;
+	vaddr_t top, bot, vbot, vtop;
+	unsigned i;
+	bool moved;
+
+	top = USERSPACETOP;
+	do {
+		if (top < sz + PAGE_SIZE) {
+			return 0;
+		}
+		bot = top - sz;
+		moved = false;
+		for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			vbot = vmo->vmo_base - vmo->vmo_lower_redzone;
+			vtop = vmo->vmo_base +
+				PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+			if (bot < vtop && vbot < top) {
+				top = vbot;
+				moved = true;
+				break;
+			}
+		}
+	} while (moved);
+
+	return bot;
+}
+
+/*
+ * as_mmap: make a new mapping of LEN bytes, as for mmap(). PROT and
+ * FLAGS are the mmap flags (<kern/mman.h>). If V is not NULL, the
+ * mapping is of V starting at OFFSET, of which FILESIZE bytes (not
+ * more than LEN) exist; the rest of the mapping is zero. Hands back
+ * the address chosen (or ADDR, for MAP_FIXED) in RETADDR.
+ *
+ * The caller has checked the arguments. MAP_FIXED mappings may not
+ * overlap existing ones.
+ */
+int
+as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int prot,
+	int flags, struct vnode *v, off_t offset, size_t filesize,
+	vaddr_t *retaddr)
+{
+	struct vm_object *vmo;
+	int result, i;
+
+	KASSERT(len > 0);
+	KASSERT(offset % PAGE_SIZE == 0);
+	KASSERT(filesize <= len);
+
+	len = ROUNDUP(len, PAGE_SIZE);
+	if (flags & MAP_FIXED) {
+		KASSERT(addr % PAGE_SIZE == 0);
+		if (addr == 0 || addr + len > USERSPACETOP || addr + len < addr) {
+			return EINVAL;
+		}
+	}
+
+	lock_acquire(as->as_lock);
+
+	if ((flags & MAP_FIXED) == 0) {
+		addr = as_findgap(as, len);
+		if (addr == 0) {
+			result = ENOMEM;
+			goto done;
+		}
+	}
+
+	result = as_add_object(as, addr, len, 0, v, offset, filesize,
+			       (prot & PROT_WRITE) != 0, false, &vmo);
+	if (result) {
+		goto done;
+	}
+
+	if (flags & MAP_SHARED) {
+		result = vm_object_setshared(vmo);
+		if (result) {
+			i = as_findobj(as, addr);
+			KASSERT(i >= 0);
+			KASSERT(vm_object_array_get(as->as_objects, i) == vmo);
+			as_removeobj(as, i);
+			vm_object_destroy(as, vmo);
+			goto done;
+		}
+	}
+
+	*retaddr = addr;
+done:
+	lock_release(as->as_lock);
+	return result;
+}
+
+/*
+ * as_munmap: remove the mappings in the range ADDR to ADDR+LEN, as for
+ * munmap(). Objects entirely inside the range go away; an unshared
+ * object the range cuts off the end of is shrunk. We don't split
+ * objects, so a range that would leave a hole in one, or cut the
+ * front off one, is EINVAL. Nothing is changed unless the whole
+ * request can be done.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_object *vmo;
+	vaddr_t end, bot, top;
+	unsigned i, pass;
+	int result, err;
+
+	KASSERT(addr % PAGE_SIZE == 0);
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+	if (len == 0 || end < addr || end > USERSPACETOP) {
+		return EINVAL;
+	}
+
+	lock_acquire(as->as_lock);
+
+	/* Pass 0 checks, pass 1 does it. */
+	result = 0;
+	for (pass = 0; pass < 2 && result == 0; pass++) {
+		i = vm_object_array_num(as->as_objects);
+		while (i-- > 0) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			bot = vmo->vmo_base;
+			top = bot + PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+
+			if (top <= addr || bot >= end) {
+				continue;
+			}
+			if (vmo == as->as_heap) {
+				/* use sbrk for that */
+				result = EINVAL;
+				break;
+			}
+			if (addr <= bot && top <= end) {
+				if (pass == 1) {
+					as_removeobj(as, i);
+					vm_object_destroy(as, vmo);
+				}
+				continue;
+			}
+			if (bot < addr && top <= end && !vmo->vmo_shared) {
+				if (pass == 1) {
+					err = vm_object_setsize(as, vmo,
+						     (addr - bot) / PAGE_SIZE);
+					/* shrinking can't fail */
+					KASSERT(err == 0);
+				}
+				continue;
+			}
+			result = EINVAL;
+			break;
+		}
+	}
+
+	lock_release(as->as_lock);
+	return result;
+}
+
+/*
+ * as_msync: write back the shared file mappings in the range ADDR to
+ * ADDR+LEN, as for msync(). Other mappings in the range are left
+ * alone. The write is always synchronous, even for MS_ASYNC, and
+ * covers every touched page, changed or not (see vm_object_sync).
+ * Returns ENOMEM if part of the range isn't mapped.
+ *
+ * Synchronization: holds the address space locked, and each vm_object
+ * inside that while syncing it, as for faults.
+ */
+int
+as_msync(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct vm_object *vmo;
+	vaddr_t end, bot, top;
+	size_t covered;
+	unsigned i, first, last;
+	int result;
+
+	KASSERT(addr % PAGE_SIZE == 0);
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+	if (end < addr) {
+		return ENOMEM;
+	}
+
+	lock_acquire(as->as_lock);
+
+	covered = 0;
+	result = 0;
+	for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+		vmo = vm_object_array_get(as->as_objects, i);
+		bot = vmo->vmo_base;
+		top = bot + PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+		if (top <= addr || bot >= end) {
+			continue;
+		}
+		first = bot < addr ? (addr - bot) / PAGE_SIZE : 0;
+		last = top > end ? (end - bot) / PAGE_SIZE :
+			lpage_table_num(vmo->vmo_lpages);
+		covered += (last - first) * PAGE_SIZE;
+
+		if (!vmo->vmo_shared || vmo->vmo_vnode == NULL ||
+		    !vmo->vmo_writeable) {
+			continue;
+		}
+
+		lock_acquire(vmo->vmo_lock);
+		result = vm_object_sync(vmo, first, last);
+		lock_release(vmo->vmo_lock);
+		if (result) {
+			break;
+		}
+	}
+
+	lock_release(as->as_lock);
+
+	if (result) {
+		return result;
+	}
+	if (covered < end - addr) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+/*
+ * as_sbrk: move the end of the heap by CHANGE bytes, as for sbrk(),
+ * and hand back the old end in OLDBREAK.
+ *
+ * The heap is one vm_object and this just resizes it: new pages are
+ * zero-fill and take nothing but their swap reservation until they're
+ * touched, and pages given back are unmapped and freed by
+ * vm_object_setsize. So the cost doesn't depend on the size of the
+ * change, except for extending the lpage array.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t change, vaddr_t *oldbreak)
+{
+	struct vm_object *heap, *vmo;
+	vaddr_t oldend, newend, heaptop, bot, top;
+	unsigned i, npages;
+	int result;
+
+	lock_acquire(as->as_lock);
+
+	heap = as->as_heap;
+	if (heap == NULL) {
+		/* no program loaded */
+		result = ENOMEM;
+		goto done;
+	}
+
+	oldend = as->as_heapend;
+	if (change < 0 && (vaddr_t)-change > oldend - heap->vmo_base) {
+		result = EINVAL;
+		goto done;
+	}
+	newend = oldend + change;
+	if (change > 0 && (newend < oldend || newend > USERSPACETOP)) {
+		result = ENOMEM;
+		goto done;
+	}
+
+	npages = ROUNDUP(newend - heap->vmo_base, PAGE_SIZE) / PAGE_SIZE;
+
+	if (npages > lpage_table_num(heap->vmo_lpages)) {
+		/* Don't run into anything (including its redzone). */
+		heaptop = heap->vmo_base + npages * PAGE_SIZE;
+		for (i = 0; i < vm_object_array_num(as->as_objects); i++) {
+			vmo = vm_object_array_get(as->as_objects, i);
+			bot = vmo->vmo_base - vmo->vmo_lower_redzone;
+			top = vmo->vmo_base +
+				PAGE_SIZE * lpage_table_num(vmo->vmo_lpages);
+			if (vmo != heap && bot < heaptop &&
+			    top > heap->vmo_base) {
+				result = ENOMEM;
+				goto done;
+			}
+		}
+	}
+	if (npages != lpage_table_num(heap->vmo_lpages)) {
+		result = vm_object_setsize(as, heap, npages);
+		if (result) {
+			goto done;
+		}
+	}
+
+	as->as_heapend = newend;
+	*oldbreak = oldend;
+	result = 0;
+done:
+	lock_release(as->as_lock);
+	return result;
+}
@@ -0,0 +1,358 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vmprivate.h>
+#include <machine/coremap.h>
+
+/*
+ * loadctl.c - load control.
+ *
+ * When more processes are paging than there's RAM for, each one's
+ * pages get evicted before it gets back to using them, and the system
+ * spends its time in swap I/O instead of getting anything done
+ * (thrashing). The cure is to run fewer of them at once.
+ *
+ * A controller thread counts major faults (lpage_fault page-ins from
+ * swap) every LC_INTERVAL seconds. If there were more than the
+ * threshold per second, and at least two address spaces took major
+ * faults, it suspends the youngest of those. (There's no notion of
+ * priority here; the youngest has done the least work and is the
+ * cheapest to put off, as in classic load control.) When the rate is
+ * below half the threshold, it resumes the oldest suspended address
+ * space. So at most one changes each interval.
+ *
+ * Suspending an address space just marks it; its thread stops at its
+ * next page fault (loadctl_wait, from vm_fault), which a thrashing
+ * process won't be long in taking. If swap-out is on, it then evicts
+ * all its pages itself before going to sleep, so the others get its
+ * RAM straight away instead of waiting for the clock to get to it.
+ */
+
+/* Seconds between looks at the fault rate. */
+#define LC_INTERVAL	1
+
+/*
+ * Data. lc_asarray is in creation order, so oldest first.
+ */
+static struct lock *lc_lock;	/* for lc_asarray and as_suspended */
+static struct cv *lc_cv;	/* suspended threads wait here */
+static struct array lc_asarray;	/* all address spaces */
+static unsigned lc_nsuspended;
+
+/*
+ * Settings, the last rate seen, and ct_lc_swapped are protected by
+ * lc_spinlock; the other counters by lc_lock.
+ */
+static struct spinlock lc_spinlock = SPINLOCK_INITIALIZER;
+static unsigned lc_threshold = 0;	/* major faults/sec; 0 is off */
+static bool lc_swapout = false;
+static unsigned lc_lastrate;
+static volatile uint32_t ct_lc_suspends;
+static volatile uint32_t ct_lc_resumes;
+static volatile uint32_t ct_lc_swapped;		/* pages evicted */
+
+
+/*
+ * loadctl_addas/removeas: add and remove address spaces from the
+ * list the controller looks at.
+ *
+ * Synchronization: lc_lock.
+ */
+int
+loadctl_addas(struct addrspace *as)
+{
+	int result;
+
+	KASSERT(lc_lock != NULL);
+
+	lock_acquire(lc_lock);
+	result = array_add(&lc_asarray, as, NULL);
+	lock_release(lc_lock);
+
+	return result;
+}
+
+void
+loadctl_removeas(struct addrspace *as)
+{
+	unsigned i, num;
+
+	lock_acquire(lc_lock);
+	num = array_num(&lc_asarray);
+	for (i=0; i<num; i++) {
+		if (array_get(&lc_asarray, i) == as) {
+			array_remove(&lc_asarray, i);
+			break;
+		}
+	}
+	KASSERT(i < num);
+	if (as->as_suspended) {
+		as->as_suspended = false;
+		lc_nsuspended--;
+	}
+	lock_release(lc_lock);
+}
+
+/*
+ * loadctl_wait: called on each page fault in AS by its own thread. If
+ * AS is suspended, swap it out if that's turned on, and wait until
+ * it's resumed.
+ *
+ * Synchronization: lc_lock. The caller must not hold any locks other
+ * threads might need in the meantime (that is, it must not be in
+ * copyin/copyout, which can be called with e.g. vnodes locked).
+ */
+void
+loadctl_wait(struct addrspace *as)
+{
+	unsigned n;
+	bool swapout;
+
+	if (!as->as_suspended) {
+		/* (unlocked peek; if we miss it we'll stop next time) */
+		return;
+	}
+
+	spinlock_acquire(&lc_spinlock);
+	swapout = lc_swapout;
+	spinlock_release(&lc_spinlock);
+
+	if (swapout) {
+		n = coremap_evictas(as);
+		spinlock_acquire(&lc_spinlock);
+		ct_lc_swapped += n;
+		spinlock_release(&lc_spinlock);
+	}
+
+	lock_acquire(lc_lock);
+	while (as->as_suspended) {
+		cv_wait(lc_cv, lc_lock);
+	}
+	lock_release(lc_lock);
+}
+
+/*
+ * lc_suspend: if at least two running address spaces have taken
+ * major faults since last time, suspend the youngest of them. Also
+ * notes down everyone's fault count for next time.
+ *
+ * Synchronization: the caller holds lc_lock. as_majfaults is read
+ * without locking; it's only used to see whether it moved.
+ */
+static
+void
+lc_suspend(bool suspend)
+{
+	struct addrspace *as, *victim;
+	unsigned i, nactive, majfaults;
+
+	KASSERT(lock_do_i_hold(lc_lock));
+
+	victim = NULL;
+	nactive = 0;
+	for (i = array_num(&lc_asarray); i-- > 0; ) {
+		as = array_get(&lc_asarray, i);
+		majfaults = as->as_majfaults;
+		if (majfaults != as->as_lcmajfaults && !as->as_suspended) {
+			nactive++;
+			if (victim == NULL) {
+				victim = as;
+			}
+		}
+		as->as_lcmajfaults = majfaults;
+	}
+
+	if (suspend && nactive >= 2) {
+		victim->as_suspended = true;
+		lc_nsuspended++;
+		ct_lc_suspends++;
+	}
+}
+
+/*
+ * lc_resume: resume the oldest suspended address space. Returns false
+ * if there wasn't one.
+ *
+ * Synchronization: the caller holds lc_lock.
+ */
+static
+bool
+lc_resume(void)
+{
+	struct addrspace *as;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(lc_lock));
+
+	for (i=0; i<array_num(&lc_asarray); i++) {
+		as = array_get(&lc_asarray, i);
+		if (as->as_suspended) {
+			as->as_suspended = false;
+			lc_nsuspended--;
+			ct_lc_resumes++;
+			cv_broadcast(lc_cv, lc_lock);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * The controller thread. Every LC_INTERVAL seconds, suspend or resume
+ * one address space according to the fault rate. If load control is
+ * turned off, resume everyone.
+ */
+static
+void
+loadctl_thread(void *data1, unsigned long data2)
+{
+	uint32_t faults, lastfaults;
+	unsigned threshold, rate;
+
+	(void)data1;
+	(void)data2;
+
+	lastfaults = lpage_majfaults();
+	while (1) {
+		clocksleep(LC_INTERVAL);
+
+		faults = lpage_majfaults();
+		rate = (faults - lastfaults) / LC_INTERVAL;
+		lastfaults = faults;
+
+		spinlock_acquire(&lc_spinlock);
+		threshold = lc_threshold;
+		lc_lastrate = rate;
+		spinlock_release(&lc_spinlock);
+
+		lock_acquire(lc_lock);
+		lc_suspend(threshold > 0 && rate > threshold);
+		if (threshold == 0) {
+			while (lc_resume()) {
+				/* nothing */
+			}
+		}
+		else if (rate < threshold / 2) {
+			lc_resume();
+		}
+		lock_release(lc_lock);
+	}
+}
+
+/*
+ * loadctl_setthreshold/getthreshold: set or get the major fault rate
+ * (per second) above which processes get suspended, and whether
+ * they're swapped out too. A threshold of 0 (the default) turns load
+ * control off; anything suspended is resumed within LC_INTERVAL.
+ */
+void
+loadctl_setthreshold(unsigned faultspersec, bool swapout)
+{
+	spinlock_acquire(&lc_spinlock);
+	lc_threshold = faultspersec;
+	lc_swapout = swapout;
+	spinlock_release(&lc_spinlock);
+}
+
+unsigned
+loadctl_getthreshold(bool *swapout)
+{
+	unsigned ret;
+
+	spinlock_acquire(&lc_spinlock);
+	ret = lc_threshold;
+	*swapout = lc_swapout;
+	spinlock_release(&lc_spinlock);
+	return ret;
+}
+
+/*
+ * loadctl_printstats: print controller stats.
+ */
+void
+loadctl_printstats(void)
+{
+	uint32_t suspends, resumes, swapped;
+	unsigned threshold, rate, nsuspended;
+	bool swapout;
+
+	spinlock_acquire(&lc_spinlock);
+	threshold = lc_threshold;
+	swapout = lc_swapout;
+	rate = lc_lastrate;
+	suspends = ct_lc_suspends;
+	resumes = ct_lc_resumes;
+	swapped = ct_lc_swapped;
+	spinlock_release(&lc_spinlock);
+
+	/* (just a peek) */
+	nsuspended = lc_nsuspended;
+
+	kprintf("vm: load control: threshold %u faults/sec%s, "
+		"now %u faults/sec, %u suspended\n", threshold,
+		swapout ? " (swapping out)" : "", rate, nsuspended);
+	kprintf("vm: load control: %lu suspends, %lu resumes, "
+		"%lu pages swapped out\n", (unsigned long) suspends,
+		(unsigned long) resumes, (unsigned long) swapped);
+}
+
+/*
+ * loadctl_bootstrap: set up, and start the controller thread.
+ */
+void
+loadctl_bootstrap(void)
+{
+	int result;
+
+	lc_lock = lock_create("loadctl");
+	if (lc_lock == NULL) {
+		panic("loadctl: Could not create lock\n");
+	}
+	lc_cv = cv_create("loadctl");
+	if (lc_cv == NULL) {
+		panic("loadctl: Could not create cv\n");
+	}
+	array_init(&lc_asarray);
+
+	result = thread_fork("loadctl", loadctl_thread, NULL, 0, NULL);
+	if (result) {
+		panic("loadctl: Could not start controller: %s\n",
+		      strerror(result));
+	}
+}
@@ -32,7 +32,10 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
 #include <thread.h>
+#include <uio.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
@@ -44,34 +47,214 @@
 
 /* Stats counters */
 static volatile uint32_t ct_zerofills;
+static volatile uint32_t ct_zeromaps;
+static volatile uint32_t ct_filefills;
+static volatile uint32_t ct_filewrites;
 static volatile uint32_t ct_minfaults;
 static volatile uint32_t ct_majfaults;
 static volatile uint32_t ct_discard_evictions;
 static volatile uint32_t ct_write_evictions;
+static volatile uint32_t ct_cowfaults;
+static volatile uint32_t ct_readahead_ios;
+static volatile uint32_t ct_readahead_pages;
+static volatile uint32_t ct_readahead_hits;
+static volatile uint32_t ct_readahead_misses;
+static volatile uint32_t ct_faultaround_maps;
+static volatile uint32_t ct_busywaits;
 static struct spinlock stats_spinlock = SPINLOCK_INITIALIZER;
 
+/*
+ * Swap readahead window, in pages. It grows by one for each page read
+ * ahead that then gets faulted on, and shrinks by one for each that
+ * gets evicted or thrown away unused. It's global rather than per
+ * vm_object because by the time a page turns out to be wasted we no
+ * longer know which object it was read for. Protected by
+ * stats_spinlock.
+ */
+#define READAHEAD_MIN		1
+#define READAHEAD_INIT		4
+#define READAHEAD_MAX		SWAP_CLUSTER_MAX
+static unsigned readahead_window = READAHEAD_INIT;
+
 void
 vm_printstats(void)
 {
-	uint32_t zf, mn, mj, de, we, te;
+	uint32_t zf, zm, ff, fw, mn, mj, de, we, te, cw;
+	uint32_t rio, rpg, rhit, rmiss, fa, bw;
+	unsigned rwin;
 
 	spinlock_acquire(&stats_spinlock);
 	zf = ct_zerofills;
+	zm = ct_zeromaps;
+	ff = ct_filefills;
+	fw = ct_filewrites;
 	mn = ct_minfaults;
 	mj = ct_majfaults;
 	de = ct_discard_evictions;
 	we = ct_write_evictions;
+	cw = ct_cowfaults;
+	rio = ct_readahead_ios;
+	rpg = ct_readahead_pages;
+	rhit = ct_readahead_hits;
+	rmiss = ct_readahead_misses;
+	fa = ct_faultaround_maps;
+	bw = ct_busywaits;
+	rwin = readahead_window;
 	spinlock_release(&stats_spinlock);
 
 	te = de+we;
 
 	kprintf("vm: %lu zerofills %lu minorfaults %lu majorfaults\n",
 		(unsigned long) zf, (unsigned long) mn, (unsigned long) mj);
+	kprintf("vm: %lu faults waited for a page being read in\n",
+		(unsigned long) bw);
+	kprintf("vm: %lu reads mapped to the zero page\n",
+		(unsigned long) zm);
+	kprintf("vm: %lu pages read from files, %lu written back\n",
+		(unsigned long) ff, (unsigned long) fw);
 	kprintf("vm: %lu evictions (%lu discarding, %lu writes)\n",
 		(unsigned long) te, (unsigned long) de, (unsigned long) we);
+	kprintf("vm: %lu copy-on-write faults\n", (unsigned long) cw);
+	kprintf("vm: readahead: %lu pages in %lu I/Os, %lu hits, "
+		"%lu wasted, window %u\n",
+		(unsigned long) rpg, (unsigned long) rio,
+		(unsigned long) rhit, (unsigned long) rmiss, rwin);
+	kprintf("vm: %lu pages mapped by fault-around\n",
+		(unsigned long) fa);
+	as_printstats();
+	vm_object_printstats();
+	pagemerge_printstats();
+	loadctl_printstats();
+	swap_printstats();
 	vm_printmdstats();
 }
 
+/*
+ * Count a page read ahead that turned out to be used (HIT) or not,
+ * and adjust the readahead window accordingly.
+ */
+static
+void
+readahead_account(bool hit)
+{
+	spinlock_acquire(&stats_spinlock);
+	if (hit) {
+		ct_readahead_hits++;
+		if (readahead_window < READAHEAD_MAX) {
+			readahead_window++;
+		}
+	}
+	else {
+		ct_readahead_misses++;
+		if (readahead_window > READAHEAD_MIN) {
+			readahead_window--;
+		}
+	}
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_readahead_window: return the number of pages to read ahead.
+ */
+unsigned
+lpage_readahead_window(void)
+{
+	unsigned ret;
+
+	spinlock_acquire(&stats_spinlock);
+	ret = readahead_window;
+	spinlock_release(&stats_spinlock);
+	return ret;
+}
+
+/*
+ * lpage_majfaults: return the number of major faults so far.
+ */
+uint32_t
+lpage_majfaults(void)
+{
+	uint32_t ret;
+
+	spinlock_acquire(&stats_spinlock);
+	ret = ct_majfaults;
+	spinlock_release(&stats_spinlock);
+	return ret;
+}
+
+/*
+ * Wait channels for lpages that are being read in (LPF_BUSY). There
+ * are too many lpages to give each its own, so they share a few,
+ * hashed by address; a wakeup may also wake someone waiting for a
+ * different page, who just checks and goes back to sleep.
+ */
+#define LPAGE_WAITCHANS		32
+static struct wchan *lpage_waitchans[LPAGE_WAITCHANS];
+
+static
+struct wchan *
+lpage_waitchan(struct lpage *lp)
+{
+	return lpage_waitchans[((uintptr_t)lp / sizeof(*lp)) %
+			       LPAGE_WAITCHANS];
+}
+
+/*
+ * lpage_bootstrap: create the wait channels. Called from
+ * vm_bootstrap.
+ */
+void
+lpage_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<LPAGE_WAITCHANS; i++) {
+		lpage_waitchans[i] = wchan_create("lpbusy");
+		if (lpage_waitchans[i] == NULL) {
+			panic("lpage_bootstrap: Out of memory\n");
+		}
+	}
+}
+
+/*
+ * Wait for someone to finish reading in LP. Called with LP locked and
+ * LPF_BUSY set; returns with it unlocked, after which the caller
+ * should look again.
+ */
+static
+void
+lpage_busywait(struct lpage *lp)
+{
+	struct wchan *wc;
+
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(lp->lp_paddr & LPF_BUSY);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_busywaits++;
+	spinlock_release(&stats_spinlock);
+
+	wc = lpage_waitchan(lp);
+	wchan_lock(wc);
+	lpage_unlock(lp);
+	wchan_sleep(wc);
+}
+
+/*
+ * Finish reading in LP: store PA (or INVALID_PADDR, if it failed) in
+ * it, clearing LPF_BUSY, and wake up anyone waiting. Called with LP
+ * locked.
+ */
+static
+void
+lpage_unbusy(struct lpage *lp, paddr_t pa)
+{
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(lp->lp_paddr == (INVALID_PADDR | LPF_BUSY));
+
+	lp->lp_paddr = pa;
+	wchan_wakeall(lpage_waitchan(lp));
+}
+
 /*
  * Create a logical page object.
  * Synchronization: none.
@@ -88,36 +271,67 @@ lpage_create(void)
 
 	lp->lp_swapaddr = INVALID_SWAPADDR;
 	lp->lp_paddr = INVALID_PADDR;
+	lp->lp_refcount = 1;
 	spinlock_init(&lp->lp_spinlock);
 
 	return lp;
 }
 
 /*
- * lpage_destroy: deallocates a logical page. Releases any RAM or swap
- * pages involved.
+ * lpage_drop: drops one reference to a logical page. If that was the
+ * last one, deallocates the page and releases any RAM or swap pages
+ * involved, and returns true. If the page is still shared, gives back
+ * the swap reservation the departing reference was holding.
  *
  * Synchronization: Someone might be in the process of evicting the
  * page if it's resident, so it might be pinned. So lock and pin
  * together.
  *
- * We assume that lpages are not shared between address spaces and
- * address spaces are not shared between threads.
+ * We assume that address spaces are not shared between threads, so
+ * only other sharers of the lpage (and the page merger) can touch it
+ * concurrently.
  */
-void 					
-lpage_destroy(struct lpage *lp)
+static
+bool
+lpage_drop(struct lpage *lp)
 {
 	paddr_t pa;
+	bool wasted, hasswap;
 
 	KASSERT(lp != NULL);
 
 	lpage_lock_and_pin(lp);
 
+	KASSERT(lp->lp_refcount > 0);
+	lp->lp_refcount--;
 	pa = lp->lp_paddr & PAGE_FRAME;
+
+	if (lp->lp_refcount > 0) {
+		/* Pages with no swap have no reservations either. */
+		hasswap = (lp->lp_swapaddr != INVALID_SWAPADDR);
+		lpage_unlock(lp);
+		if (pa != INVALID_PADDR) {
+			/*
+			 * The TLB entry may belong to us, and with ASIDs
+			 * it can outlive this call; drop it.
+			 */
+			mmu_invalidate_page(pa);
+			coremap_unpin(pa);
+		}
+		if (hasswap) {
+			swap_unreserve(1);
+		}
+		return false;
+	}
+
 	if (pa != INVALID_PADDR) {
 		DEBUG(DB_VM, "lpage_destroy: freeing paddr 0x%x\n", pa);
+		wasted = (lp->lp_paddr & LPF_READAHEAD) != 0;
 		lp->lp_paddr = INVALID_PADDR;
 		lpage_unlock(lp);
+		if (wasted) {
+			readahead_account(false);
+		}
 		coremap_free(pa, false /* iskern */);
 		coremap_unpin(pa);
 	}
@@ -133,8 +347,85 @@ lpage_destroy(struct lpage *lp)
 
 	spinlock_cleanup(&lp->lp_spinlock);
 	kfree(lp);
+	return true;
+}
+
+/*
+ * lpage_destroy: drop a vm_object slot's reference to a logical page.
+ */
+void
+lpage_destroy(struct lpage *lp)
+{
+	(void)lpage_drop(lp);
+}
+
+/*
+ * lpage_share: add a reference to an lpage, as at fork time. The
+ * page becomes copy-on-write, so any writable mapping of it has to
+ * go; that's up to the caller, since fork does a whole address space
+ * at once (mmu_writeprotect).
+ *
+ * Synchronization: takes the lpage lock.
+ */
+void
+lpage_share(struct lpage *lp)
+{
+	lpage_lock(lp);
+	KASSERT(lp->lp_refcount > 0);
+	lp->lp_refcount++;
+	lpage_unlock(lp);
+}
+
+/*
+ * lpage_hold/lpage_unhold: take and drop a reference to LP that isn't
+ * in any vm_object, so the page merger can keep a page around while it
+ * looks for duplicates of it. The page is copy-on-write while held,
+ * and the reference has a swap reservation like any other shared one.
+ * If the hold turns out to be the last reference, dropping it frees
+ * the page's swap page instead; the reservation has to go too.
+ */
+int
+lpage_hold(struct lpage *lp)
+{
+	paddr_t pa;
+	bool wasprivate;
+	int result;
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Unlike at fork, the owner may have it mapped writable
+	 * anywhere, so take that away here. Lock and pin to get a
+	 * stable physical address, then drop the lpage lock before
+	 * going into the MMU code, which may need to wait for a TLB
+	 * shootdown.
+	 */
+	lpage_lock_and_pin(lp);
+	wasprivate = (lp->lp_refcount == 1);
+	lp->lp_refcount++;
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+
+	if (pa != INVALID_PADDR) {
+		if (wasprivate) {
+			/* already read-only if it was shared before */
+			mmu_invalidate_page(pa);
+		}
+		coremap_unpin(pa);
+	}
+	return 0;
 }
 
+void
+lpage_unhold(struct lpage *lp)
+{
+	if (lpage_drop(lp)) {
+		swap_unreserve(1);
+	}
+}
 
 /*
  * lpage_lock & lpage_unlock
@@ -212,14 +503,13 @@ lpage_lock_and_pin(struct lpage *lp)
 		/*
 		 * If what we just got out of the lpage is *now*
 		 * invalid, because the page was paged out on us,
-		 * we're done. The page can't be paged in again behind
-		 * our back, so assert it hasn't after regrabbing the
-		 * lpage lock.
+		 * regrab the lock and look again: a sharer, or
+		 * readahead, may have paged it back in meanwhile.
 		 */
 		if (pa == INVALID_PADDR) {
+			pinned = INVALID_PADDR;
 			lpage_lock(lp);
-			KASSERT((lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-			break;
+			continue;
 		}
 		/* Pin what we got and try again. */
 		coremap_pin(pa);
@@ -228,16 +518,46 @@ lpage_lock_and_pin(struct lpage *lp)
 	}
 }
 
+/*
+ * lpage_swapalloc: allocate a swap page for a new lpage. If RESERVED
+ * is false the caller holds no reservation for it (its vm_object
+ * didn't reserve up front), so reserve one here, when the page is
+ * first needed. Returns INVALID_SWAPADDR if swap is overcommitted and
+ * has run out; the caller's reservation, if any, is left alone.
+ */
+static
+off_t
+lpage_swapalloc(bool reserved)
+{
+	off_t swa;
+
+	if (!reserved && swap_reserve(1)) {
+		return INVALID_SWAPADDR;
+	}
+	swa = swap_alloc();
+	if (swa == INVALID_SWAPADDR && !reserved) {
+		swap_unreserve(1);
+	}
+	return swa;
+}
+
 /*
  * lpage_materialize: create a new lpage and allocate swap and RAM for it.
  * Do not do anything with the page contents though.
  *
+ * RAM is allocated first, since that may evict pages and free up
+ * swap. RESERVED says whether the caller holds a swap reservation for
+ * the page (see lpage_swapalloc). Allocating the swap page can only
+ * fail if swap is overcommitted; either way an error leaves the
+ * caller's swap reservation untouched, and a full swap comes back as
+ * ENOMEM.
+ *
  * Returns the lpage locked and the physical page pinned.
  */
 
 static
 int
-lpage_materialize(struct lpage **lpret, paddr_t *paret)
+lpage_materialize(struct lpage **lpret, paddr_t *paret, bool reserved)
 {
 	struct lpage *lp;
 	paddr_t pa;
@@ -248,19 +568,20 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 		return ENOMEM;
 	}
 
-	swa = swap_alloc();
-	if (swa == INVALID_SWAPADDR) {
+	pa = coremap_allocuser(lp);
+	if (pa == INVALID_PADDR) {
 		lpage_destroy(lp);
 		return ENOSPC;
 	}
-	lp->lp_swapaddr = swa;
 
-	pa = coremap_allocuser(lp);
-	if (pa == INVALID_PADDR) {
-		/* lpage_destroy will clean up the swap */
+	swa = lpage_swapalloc(reserved);
+	if (swa == INVALID_SWAPADDR) {
+		coremap_free(pa, false /* iskern */);
+		coremap_unpin(pa);
 		lpage_destroy(lp);
-		return ENOSPC;
+		return ENOMEM;
 	}
+	lp->lp_swapaddr = swa;
 
 	lpage_lock(lp);
 
@@ -274,168 +595,909 @@ lpage_materialize(struct lpage **lpret, paddr_t *paret)
 }
 
 /*
- * lpage_copy: create a new lpage and copy data from another lpage.
+ * lpage_readfile: read a page's worth of file data, as described by
+ * VB, into the physical page PA, which must be pinned. Whatever the
+ * file doesn't supply is zero. A short read (the file shrank under
+ * us) is not an error; the rest of the page just stays zero.
  *
- * The synchronization for this is kind of unpleasant. We do it like
- * this:
- *
- *      1. Create newlp.
- *      2. Materialize a page for newlp, so it's locked and pinned.
- *      3. Lock and pin oldlp.
- *      4. Extract the physical address and swap address.
- *      5. If oldlp wasn't present,
- *      5a.    Unlock oldlp.
- *      5b.    Page in.
- *      5c.    This pins the page in the coremap.
- *      5d.    Leave the page pinned and relock oldlp.
- *      5e.    Assert nobody else paged the page in.
- *      6. Copy.
- *      7. Unlock the lpages first, so we can enter the coremap.
- *      8. Unpin the physical pages.
- *      
+ * Synchronization: none; no lpage locks may be held, since this
+ * sleeps.
  */
+static
 int
-lpage_copy(struct lpage *oldlp, struct lpage **lpret)
+lpage_readfile(paddr_t pa, const struct vm_backing *vb)
 {
-	struct lpage *newlp;
-	paddr_t newpa, oldpa;
-	off_t swa;
+	struct iovec iov;
+	struct uio u;
+	vaddr_t va;
 	int result;
 
-	result = lpage_materialize(&newlp, &newpa);
+	KASSERT(coremap_pageispinned(pa));
+	KASSERT(vb->vb_skip + vb->vb_len <= PAGE_SIZE);
+
+	coremap_zero_page(pa);
+	if (vb->vb_len == 0) {
+		return 0;
+	}
+
+	va = coremap_map_swap_page(pa);
+	uio_kinit(&iov, &u, (char *)va + vb->vb_skip, vb->vb_len,
+		  vb->vb_offset, UIO_READ);
+	result = VOP_READ(vb->vb_vnode, &u);
+	coremap_unmap_swap_page(va, pa);
+
 	if (result) {
 		return result;
 	}
-	KASSERT(coremap_pageispinned(newpa));
 
-	/* Pin the physical page and lock the lpage. */
-	lpage_lock_and_pin(oldlp);
-	oldpa = oldlp->lp_paddr & PAGE_FRAME;
+	spinlock_acquire(&stats_spinlock);
+	ct_filefills++;
+	spinlock_release(&stats_spinlock);
 
-	/*
-	 * If there is no physical page, we allocate one, which pins
-	 * it, and then (re)lock the lpage. Since we are single-
-	 * threaded (if we weren't, we'd hold the address space lock
-	 * to exclude sibling threads) nobody else should have paged
-	 * the page in behind our back.
-	 */
-	if (oldpa == INVALID_PADDR) {
-		/*
-		 * XXX this is mostly copied from lpage_fault
-		 */
-		swa = oldlp->lp_swapaddr;
-		lpage_unlock(oldlp);
-		oldpa = coremap_allocuser(oldlp);
-		if (oldpa == INVALID_PADDR) {
-			coremap_unpin(newlp->lp_paddr & PAGE_FRAME);
-			lpage_destroy(newlp);
-			return ENOMEM;
+	return 0;
+}
+
+/*
+ * lpage_pagein: lock an lpage and make sure it is resident, reading it
+ * in from swap if necessary, or from VB if it has no swap page. Sets
+ * *majorret if the page had to come from disk. Finding a page that
+ * lpage_readahead brought in counts as a readahead hit.
+ *
+ * Returns the lpage locked and the physical page pinned.
+ *
+ * While we read the page in it's marked LPF_BUSY, so that another
+ * sharer faulting on it (or readahead) waits for us instead of
+ * reading it too. Nothing else is held during the I/O, so faults on
+ * other pages go ahead meanwhile.
+ */
+static
+int
+lpage_pagein(struct lpage *lp, const struct vm_backing *vb,
+	     paddr_t *paret, bool *majorret)
+{
+	paddr_t pa, newpa;
+	off_t swa;
+	int result;
+
+	*majorret = false;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+
+	while (pa == INVALID_PADDR) {
+		if (lp->lp_paddr & LPF_BUSY) {
+			/* Someone else is reading it in; use theirs. */
+			lpage_busywait(lp);
+			lpage_lock_and_pin(lp);
+			pa = lp->lp_paddr & PAGE_FRAME;
+			continue;
 		}
-		KASSERT(coremap_pageispinned(oldpa));
-		lock_acquire(global_paging_lock);
-		swap_pagein(oldpa, swa);
-		lpage_lock(oldlp);
-		lock_release(global_paging_lock);
-		/* Assert nobody else did the pagein. */
-		KASSERT((oldlp->lp_paddr & PAGE_FRAME) == INVALID_PADDR);
-		oldlp->lp_paddr = oldpa;
-	}
 
-	KASSERT(coremap_pageispinned(oldpa));
+		swa = lp->lp_swapaddr;
+		KASSERT(swa != INVALID_SWAPADDR || vb != NULL);
+		LP_SET(lp, LPF_BUSY);
+		lpage_unlock(lp);
 
-	coremap_copy_page(oldpa, newpa);
+		newpa = coremap_allocuser(lp);
+		if (newpa == INVALID_PADDR) {
+			lpage_lock(lp);
+			lpage_unbusy(lp, INVALID_PADDR);
+			lpage_unlock(lp);
+			return ENOMEM;
+		}
+		KASSERT(coremap_pageispinned(newpa));
 
-	KASSERT(LP_ISDIRTY(newlp));
+		if (swa == INVALID_SWAPADDR) {
+			result = lpage_readfile(newpa, vb);
+			if (result) {
+				coremap_free(newpa, false /* iskern */);
+				coremap_unpin(newpa);
+				lpage_lock(lp);
+				lpage_unbusy(lp, INVALID_PADDR);
+				lpage_unlock(lp);
+				return result;
+			}
+		}
+		else {
+			swap_pagein(newpa, swa);
+		}
 
-	lpage_unlock(oldlp);
-	lpage_unlock(newlp);
+		lpage_lock(lp);
+		/* nobody moves a busy page's swap */
+		KASSERT(lp->lp_swapaddr == swa);
+		/* Page matches its swap (or file) copy, so it's clean. */
+		lpage_unbusy(lp, newpa);
+		pa = newpa;
+		*majorret = true;
+	}
 
-	coremap_unpin(newpa);
-	coremap_unpin(oldpa);
+	if (lp->lp_paddr & LPF_READAHEAD) {
+		/* Read ahead, and now wanted: a readahead hit. */
+		LP_CLEAR(lp, LPF_READAHEAD);
+		readahead_account(true);
+	}
 
-	*lpret = newlp;
+	KASSERT(coremap_pageispinned(pa));
+	*paret = pa;
 	return 0;
 }
 
 /*
- * lpage_zerofill: create a new lpage and arrange for it to be cleared
- * to all zeros. The current implementation causes the lpage to be
- * resident upon return, but this is not a guaranteed property, and
- * nothing prevents the page from being evicted before it is used by
- * the caller.
+ * lpage_writefile: write the file part of LP, as described by VB, back
+ * to the file. Used for shared file mappings; the page is paged in
+ * first if need be.
  *
- * Synchronization: coremap_allocuser returns the new physical page
- * "pinned" (locked) - we hold that lock while we update the page
- * contents and the necessary lpage fields. Unlock the lpage before
- * unpinning, so it's safe to take the coremap spinlock.
+ * The page stays pinned during the write so it can't move; we don't
+ * otherwise stop other sharers of the mapping from writing it
+ * meanwhile, which is fine for msync.
+ *
+ * Synchronization: none needed beyond lpage_pagein's. Sleeps.
  */
 int
-lpage_zerofill(struct lpage **lpret)
+lpage_writefile(struct lpage *lp, const struct vm_backing *vb)
 {
-	struct lpage *lp;
+	struct iovec iov;
+	struct uio u;
 	paddr_t pa;
+	vaddr_t va;
+	bool major;
 	int result;
 
-	result = lpage_materialize(&lp, &pa);
+	KASSERT(vb->vb_skip + vb->vb_len <= PAGE_SIZE);
+	if (vb->vb_len == 0) {
+		return 0;
+	}
+
+	/* Writeable file pages always have swap, so no VB needed here. */
+	result = lpage_pagein(lp, NULL, &pa, &major);
 	if (result) {
 		return result;
 	}
-	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
-	KASSERT(coremap_pageispinned(pa));
-
-	/* Don't actually need the lpage locked. */
 	lpage_unlock(lp);
 
-	coremap_zero_page(pa);
+	va = coremap_map_swap_page(pa);
+	uio_kinit(&iov, &u, (char *)va + vb->vb_skip, vb->vb_len,
+		  vb->vb_offset, UIO_WRITE);
+	result = VOP_WRITE(vb->vb_vnode, &u);
+	coremap_unmap_swap_page(va, pa);
 
 	KASSERT(coremap_pageispinned(pa));
 	coremap_unpin(pa);
 
+	if (result) {
+		return result;
+	}
+
 	spinlock_acquire(&stats_spinlock);
-	ct_zerofills++;
+	ct_filewrites++;
 	spinlock_release(&stats_spinlock);
 
-	*lpret = lp;
 	return 0;
 }
 
 /*
- * lpage_fault - handle a fault on a specific lpage. If the page is
- * not resident, get a physical page from coremap and swap it in.
- * 
- * You do not yet need to distinguish a readonly fault from a write
- * fault. When we implement sharing, there will be a difference.
+ * lpage_copy: create a new lpage and copy data from another lpage.
+ * This is how a copy-on-write page is split.
  *
- * Synchronization: Lock the lpage while checking if it's in memory. 
- * If it's not, unlock the page while allocting space and loading the
- * page in. This only works because lpages are not currently sharable.
- * The page should be locked again as soon as it is loaded, but be 
- * careful of interactions with other locks while modifying the coremap.
+ * The synchronization for this is kind of unpleasant. We do it like
+ * this:
  *
- * After it has been loaded, the page must be pinned so that it is not
- * evicted while changes are made to the TLB. It can be unpinned as soon
- * as the TLB is updated. 
+ *      1. Lock oldlp and pin its physical page, paging it in first
+ *         if it isn't resident (lpage_pagein).
+ *      2. Unlock oldlp but leave the page pinned. The contents
+ *         can't change: the page is shared, so nobody has it
+ *         mapped writable, and being pinned it can't be evicted.
+ *      3. Create newlp and materialize a page for it, so it's
+ *         locked and pinned. This may evict other pages, which is
+ *         why we can't hold oldlp locked here.
+ *      4. Copy.
+ *      5. Unlock newlp first, so we can enter the coremap.
+ *      6. Unpin the physical pages.
  */
 int
-lpage_fault(struct lpage *lp, struct addrspace *as, int faulttype, vaddr_t va)
+lpage_copy(struct lpage *oldlp, struct lpage **lpret)
 {
-	(void)lp;	// suppress compiler warning until code gets written
-	(void)as;	// suppress compiler warning until code gets written
-	(void)faulttype;// suppress compiler warning until code gets written
-	(void)va;	// suppress compiler warning until code gets written
-	return EUNIMP;	// suppress compiler warning until code gets written
-}
+	struct lpage *newlp;
+	paddr_t newpa, oldpa;
+	bool major;
+	int result;
 
-/*
- * lpage_evict: Evict an lpage from physical memory.
- *
- * Synchronization: lock the lpage while evicting it. We come here
- * from the coremap and should have the coremap spinlock and should 
- * have pinned the physical page. This is why we must not hold lpage
- * locks while entering the coremap code.
- */
-void
-lpage_evict(struct lpage *lp)
-{
-	(void)lp;	// suppress compiler warning until code gets written
+	/* Shared pages are never file pages without swap. */
+	result = lpage_pagein(oldlp, NULL, &oldpa, &major);
+	if (result) {
+		return result;
+	}
+	lpage_unlock(oldlp);
+
+	result = lpage_materialize(&newlp, &newpa, true);
+	if (result) {
+		coremap_unpin(oldpa);
+		return result;
+	}
+
+	KASSERT(coremap_pageispinned(oldpa));
+	KASSERT(coremap_pageispinned(newpa));
+
+	coremap_copy_page(oldpa, newpa);
+
+	KASSERT(LP_ISDIRTY(newlp));
+
+	lpage_unlock(newlp);
+
+	coremap_unpin(newpa);
+	coremap_unpin(oldpa);
+
+	spinlock_acquire(&stats_spinlock);
+	if (major) {
+		ct_majfaults++;
+	}
+	spinlock_release(&stats_spinlock);
+
+	*lpret = newlp;
+	return 0;
+}
+
+/*
+ * lpage_zerofill: create a new lpage and arrange for it to be cleared
+ * to all zeros. The current implementation causes the lpage to be
+ * resident upon return, but this is not a guaranteed property, and
+ * nothing prevents the page from being evicted before it is used by
+ * the caller.
+ *
+ * Synchronization: coremap_allocuser returns the new physical page
+ * "pinned" (locked) - we hold that lock while we update the page
+ * contents and the necessary lpage fields. Unlock the lpage before
+ * unpinning, so it's safe to take the coremap spinlock.
+ */
+int
+lpage_zerofill(struct lpage **lpret, bool reserved)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	int result;
+
+	result = lpage_materialize(&lp, &pa, reserved);
+	if (result) {
+		return result;
+	}
+	KASSERT(spinlock_do_i_hold(&lp->lp_spinlock));
+	KASSERT(coremap_pageispinned(pa));
+
+	/* Don't actually need the lpage locked. */
+	lpage_unlock(lp);
+
+	coremap_zero_page(pa);
+
+	KASSERT(coremap_pageispinned(pa));
+	coremap_unpin(pa);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_zerofills++;
+	spinlock_release(&stats_spinlock);
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * lpage_zeromap: handle a read fault on a zerofill page that hasn't
+ * been touched, by mapping the shared zero page read-only at VA. No
+ * lpage, RAM, or swap is allocated; the first write faults again and
+ * gets a real page from lpage_zerofill.
+ */
+void
+lpage_zeromap(struct addrspace *as, vaddr_t va)
+{
+	mmu_map_zero(as, va);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_zeromaps++;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_filein: create a new lpage and read its contents from a file,
+ * as described by VB. This is the first touch of a page of a
+ * file-backed vm_object.
+ *
+ * If NEEDSWAP is set (the object is writeable) the page gets a swap
+ * page, from the caller's reservation if RESERVED is set, and starts
+ * out dirty, like a zero-filled page; if swap is overcommitted and
+ * full, that's ENOMEM.
+ * Otherwise it gets no swap and starts out clean, so eviction throws
+ * it away and lpage_pagein reads it from VB again.
+ *
+ * Synchronization: as for lpage_zerofill. The file is read before the
+ * page is entered in the lpage, so a failed read leaves nothing to
+ * undo but the allocation.
+ */
+int
+lpage_filein(struct lpage **lpret, const struct vm_backing *vb,
+	     bool needswap, bool reserved)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	off_t swa;
+	int result;
+
+	lp = lpage_create();
+	if (lp == NULL) {
+		return ENOMEM;
+	}
+
+	pa = coremap_allocuser(lp);
+	if (pa == INVALID_PADDR) {
+		lpage_destroy(lp);
+		return ENOSPC;
+	}
+
+	result = lpage_readfile(pa, vb);
+	if (result) {
+		coremap_free(pa, false /* iskern */);
+		coremap_unpin(pa);
+		lpage_destroy(lp);
+		return result;
+	}
+
+	swa = INVALID_SWAPADDR;
+	if (needswap) {
+		swa = lpage_swapalloc(reserved);
+		if (swa == INVALID_SWAPADDR) {
+			coremap_free(pa, false /* iskern */);
+			coremap_unpin(pa);
+			lpage_destroy(lp);
+			return ENOMEM;
+		}
+	}
+
+	lpage_lock(lp);
+	lp->lp_swapaddr = swa;
+	lp->lp_paddr = pa;
+	if (needswap) {
+		LP_SET(lp, LPF_DIRTY);
+	}
+	lpage_unlock(lp);
+
+	KASSERT(coremap_pageispinned(pa));
+	coremap_unpin(pa);
+
+	*lpret = lp;
+	return 0;
+}
+
+/*
+ * lpage_unshare: give the caller a private copy of a shared lpage.
+ *
+ * The copy's swap page needs a reservation of its own; lpage_destroy
+ * gives back the one the caller's slot held against the shared page.
+ * (If everyone else let go of the page in the meantime, lpage_destroy
+ * frees it instead, and we've made one copy too many. Oh well.)
+ */
+static
+int
+lpage_unshare(struct lpage **lpp)
+{
+	struct lpage *lp, *newlp;
+	bool shared;
+	int result;
+
+	lp = *lpp;
+
+	lpage_lock(lp);
+	shared = (lp->lp_refcount > 1);
+	lpage_unlock(lp);
+
+	if (!shared) {
+		return 0;
+	}
+
+	result = swap_reserve(1);
+	if (result) {
+		return result;
+	}
+
+	result = lpage_copy(lp, &newlp);
+	if (result) {
+		swap_unreserve(1);
+		return result;
+	}
+
+	lpage_destroy(lp);
+	*lpp = newlp;
+
+	spinlock_acquire(&stats_spinlock);
+	ct_cowfaults++;
+	spinlock_release(&stats_spinlock);
+
+	return 0;
+}
+
+/*
+ * lpage_fault - handle a fault on a specific lpage. If the page is
+ * not resident, get a physical page from coremap and swap it in.
+ *
+ * Read faults map the page read-only unless it is already dirty (and
+ * not shared), so the first write to a clean page comes back as a
+ * VM_FAULT_READONLY fault; that is where we mark the page dirty.
+ * A write to a copy-on-write page first replaces *LPP with a private
+ * copy. The caller must store the new lpage back in its vm_object.
+ * *MAJORRET is set if the page had to be read from disk, so the caller
+ * can read ahead. VB says where to read the page from if it has no
+ * swap page; it may be NULL if the page isn't file-backed.
+ *
+ * Materializing a page (first touch, or a copy-on-write copy) needs a
+ * swap page. If swap is overcommitted and has run out, that fails
+ * with ENOMEM, *LPP is left alone, and the process gets killed.
+ *
+ * Synchronization: Lock the lpage while checking if it's in memory. 
+ * If it's not, unlock the page while allocating space and loading the
+ * page in (see lpage_pagein).
+ *
+ * After it has been loaded, the page must be pinned so that it is not
+ * evicted while changes are made to the TLB. mmu_map unpins it once
+ * the TLB is updated. The lpage is unlocked first, because mmu_map
+ * takes the coremap spinlock.
+ */
+int
+lpage_fault(struct lpage **lpp, struct addrspace *as, int faulttype,
+	    vaddr_t va, const struct vm_backing *vb, bool *majorret)
+{
+	struct lpage *lp;
+	paddr_t pa;
+	bool major;
+	int writable;
+	int result;
+
+	*majorret = false;
+
+	if (faulttype != VM_FAULT_READ) {
+		result = lpage_unshare(lpp);
+		if (result) {
+			return result;
+		}
+	}
+	lp = *lpp;
+
+	result = lpage_pagein(lp, vb, &pa, &major);
+	if (result) {
+		return result;
+	}
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_WRITE:
+		/* only our own thread could have shared it again */
+		KASSERT(lp->lp_refcount == 1);
+		LP_SET(lp, LPF_DIRTY);
+		writable = 1;
+		break;
+	    case VM_FAULT_READ:
+		writable = LP_ISDIRTY(lp) && lp->lp_refcount == 1;
+		break;
+	    default:
+		panic("lpage_fault: invalid fault type %d\n", faulttype);
+	}
+
+	lpage_unlock(lp);
+
+	spinlock_acquire(&stats_spinlock);
+	if (major) {
+		ct_majfaults++;
+	}
+	else {
+		ct_minfaults++;
+	}
+	spinlock_release(&stats_spinlock);
+
+	mmu_map(as, va, pa, writable);
+	*majorret = major;
+	return 0;
+}
+
+/*
+ * lpage_evict: Evict an lpage from physical memory. Clean pages are
+ * just dropped; this includes file pages with no swap, which are
+ * never dirty.
+ *
+ * Synchronization: lock the lpage while evicting it. We come here
+ * from the coremap with the physical page pinned and already removed
+ * from the TLB; do_evict drops the coremap spinlock before calling us.
+ * This is why we must not hold lpage locks while entering the coremap
+ * code.
+ */
+void
+lpage_evict(struct lpage *lp)
+{
+	paddr_t pa;
+	off_t swa;
+	bool wasted;
+
+	KASSERT(lp != NULL);
+	lpage_lock(lp);
+
+	pa = lp->lp_paddr & PAGE_FRAME;
+	swa = lp->lp_swapaddr;
+
+	KASSERT(pa != INVALID_PADDR);
+	KASSERT(swa != INVALID_SWAPADDR || !LP_ISDIRTY(lp));
+	KASSERT(coremap_pageispinned(pa));
+
+	if (LP_ISDIRTY(lp)) {
+		lpage_unlock(lp);
+		swap_pageout(pa, swa);
+		lpage_lock(lp);
+		KASSERT((lp->lp_paddr & PAGE_FRAME) == pa);
+		LP_CLEAR(lp, LPF_DIRTY);
+
+		spinlock_acquire(&stats_spinlock);
+		ct_write_evictions++;
+		spinlock_release(&stats_spinlock);
+	}
+	else {
+		spinlock_acquire(&stats_spinlock);
+		ct_discard_evictions++;
+		spinlock_release(&stats_spinlock);
+	}
+
+	wasted = (lp->lp_paddr & LPF_READAHEAD) != 0;
+	lp->lp_paddr = INVALID_PADDR;
+	lpage_unlock(lp);
+
+	if (wasted) {
+		readahead_account(false);
+	}
+}
+
+/*
+ * lpage_migrate: move the contents of LP from physical page OLDPA to
+ * NEWPA, for compaction. Called from the coremap with both pages
+ * pinned and OLDPA in no TLB, so nobody can be writing it or mapping
+ * it meanwhile. Anyone waiting in lpage_lock_and_pin for OLDPA finds
+ * NEWPA in the lpage once they get it, and goes after that instead.
+ * The dirty and readahead bits stay as they were; the swap copy, if
+ * any, is still good.
+ *
+ * Synchronization: takes the lpage lock. Does not block.
+ */
+void
+lpage_migrate(struct lpage *lp, paddr_t oldpa, paddr_t newpa)
+{
+	KASSERT(lp != NULL);
+
+	coremap_copy_page(oldpa, newpa);
+
+	lpage_lock(lp);
+	KASSERT((lp->lp_paddr & PAGE_FRAME) == oldpa);
+	KASSERT((lp->lp_paddr & LPF_BUSY) == 0);
+	lp->lp_paddr = newpa | (lp->lp_paddr & LPF_MASK);
+	lpage_unlock(lp);
+}
+
+/*
+ * lpage_clean: Write a batch of dirty lpages out to swap without
+ * evicting them, so they can be evicted later without I/O. Used by
+ * the pageout daemon. Clean ones in the batch are skipped.
+ *
+ * If the dirty pages' swap pages aren't already consecutive, we try
+ * to move them to a fresh contiguous run of swap so they can all be
+ * written in one I/O, freeing the old swap pages afterwards. (This
+ * needs to reserve the new run up front; if swap is too full for that,
+ * or fragmented, we write each page in place.)
+ *
+ * Synchronization: as for lpage_evict. Because the physical pages are
+ * pinned and not in the TLB, nobody can write to them or page them in
+ * or out until they're unpinned, so it's safe to clear the dirty bits
+ * before the write, and to change lp_swapaddr after it.
+ */
+void
+lpage_clean(struct lpage **lps, unsigned n)
+{
+	struct lpage *dirty[SWAP_CLUSTER_MAX];
+	paddr_t pas[SWAP_CLUSTER_MAX];
+	off_t swas[SWAP_CLUSTER_MAX];
+	struct lpage *lp;
+	unsigned i, ndirty;
+	bool inorder;
+	off_t base;
+	paddr_t pa;
+
+	KASSERT(n <= SWAP_CLUSTER_MAX);
+
+	ndirty = 0;
+	for (i=0; i<n; i++) {
+		lp = lps[i];
+		lpage_lock(lp);
+
+		KASSERT((lp->lp_paddr & PAGE_FRAME) != INVALID_PADDR);
+		KASSERT(lp->lp_swapaddr != INVALID_SWAPADDR);
+		KASSERT(coremap_pageispinned(lp->lp_paddr & PAGE_FRAME));
+
+		if (LP_ISDIRTY(lp)) {
+			LP_CLEAR(lp, LPF_DIRTY);
+			dirty[ndirty] = lp;
+			pas[ndirty] = lp->lp_paddr & PAGE_FRAME;
+			swas[ndirty] = lp->lp_swapaddr;
+			ndirty++;
+		}
+		lpage_unlock(lp);
+	}
+
+	if (ndirty == 0) {
+		return;
+	}
+
+	/* Sort by swap address (insertion sort; there are few). */
+	for (i=1; i<ndirty; i++) {
+		unsigned j;
+		for (j=i; j>0 && swas[j-1] > swas[j]; j--) {
+			lp = dirty[j];
+			dirty[j] = dirty[j-1];
+			dirty[j-1] = lp;
+			base = swas[j];
+			swas[j] = swas[j-1];
+			swas[j-1] = base;
+			pa = pas[j];
+			pas[j] = pas[j-1];
+			pas[j-1] = pa;
+		}
+	}
+
+	inorder = true;
+	for (i=1; i<ndirty; i++) {
+		if (swas[i] != swas[0] + i * PAGE_SIZE) {
+			inorder = false;
+			break;
+		}
+	}
+	if (inorder) {
+		swap_pageout_cluster(pas, ndirty, swas[0]);
+		return;
+	}
+
+	if (swap_reserve(ndirty) == 0) {
+		base = swap_alloc_run(ndirty);
+		if (base != INVALID_SWAPADDR) {
+			swap_pageout_cluster(pas, ndirty, base);
+			for (i=0; i<ndirty; i++) {
+				lpage_lock(dirty[i]);
+				dirty[i]->lp_swapaddr = base + i * PAGE_SIZE;
+				lpage_unlock(dirty[i]);
+				swap_free(swas[i]);
+			}
+			return;
+		}
+		swap_unreserve(ndirty);
+	}
+
+	for (i=0; i<ndirty; i++) {
+		swap_pageout(pas[i], swas[i]);
+	}
+}
+
+/*
+ * lpage_readahead: page in N lpages whose swap pages are consecutive,
+ * starting at SWAPADDR, in one I/O. Called after a major fault on the
+ * page before them, on the guess that they'll be wanted soon. The
+ * pages come in clean and marked LPF_READAHEAD, so we can tell later
+ * whether the guess was any good.
+ *
+ * This is only a hint: if we run out of memory we read fewer pages.
+ * Each lpage we read is claimed first by marking it LPF_BUSY, as
+ * lpage_pagein does, so a fault on it meanwhile waits for us; any
+ * lpage that was paged in (or moved in swap, or is being read by
+ * someone else) behind our back is skipped and keeps what it has.
+ *
+ * Synchronization: as for lpage_pagein. The caller must hold
+ * references to the lpages so they can't go away.
+ */
+void
+lpage_readahead(struct lpage **lps, unsigned n, off_t swapaddr)
+{
+	paddr_t pas[SWAP_CLUSTER_MAX];
+	bool claimed[SWAP_CLUSTER_MAX];
+	struct lpage *lp;
+	unsigned i, j, got;
+
+	KASSERT(n <= SWAP_CLUSTER_MAX);
+
+	for (i=0; i<n; i++) {
+		pas[i] = coremap_allocuser(lps[i]);
+		if (pas[i] == INVALID_PADDR) {
+			break;
+		}
+		KASSERT(coremap_pageispinned(pas[i]));
+	}
+	n = i;
+	if (n == 0) {
+		return;
+	}
+
+	got = 0;
+	for (i=0; i<n; i++) {
+		lp = lps[i];
+		lpage_lock(lp);
+		claimed[i] = lp->lp_paddr == INVALID_PADDR &&
+			lp->lp_swapaddr == swapaddr + i * PAGE_SIZE;
+		if (claimed[i]) {
+			LP_SET(lp, LPF_BUSY);
+			got++;
+		}
+		lpage_unlock(lp);
+	}
+
+	/* Read each run of claimed pages in one go. */
+	for (i=0; i<n; i=j) {
+		if (!claimed[i]) {
+			j = i+1;
+			continue;
+		}
+		for (j=i+1; j<n && claimed[j]; j++);
+		swap_pagein_cluster(pas+i, j-i, swapaddr + i * PAGE_SIZE);
+	}
+
+	for (i=0; i<n; i++) {
+		if (claimed[i]) {
+			lp = lps[i];
+			lpage_lock(lp);
+			lpage_unbusy(lp, pas[i] | LPF_READAHEAD);
+			lpage_unlock(lp);
+		}
+		else {
+			coremap_free(pas[i], false /* iskern */);
+		}
+		coremap_unpin(pas[i]);
+	}
+
+	spinlock_acquire(&stats_spinlock);
+	ct_readahead_ios++;
+	ct_readahead_pages += got;
+	spinlock_release(&stats_spinlock);
+}
+
+/*
+ * lpage_hash: if LP is resident, hash its contents into *HASHRET and
+ * return true. Pages that aren't resident aren't paged in for this.
+ * The hash is only a hint, since the owner may be writing the page as
+ * we read it; lpage_merge compares the real contents.
+ */
+bool
+lpage_hash(struct lpage *lp, uint32_t *hashret)
+{
+	const uint32_t *words;
+	paddr_t pa;
+	uint32_t hash;
+	unsigned i;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	lpage_unlock(lp);
+	if (pa == INVALID_PADDR) {
+		return false;
+	}
+
+	/* FNV-1a, a word at a time */
+	words = (const uint32_t *)coremap_map_swap_page(pa);
+	hash = 2166136261U;
+	for (i=0; i<PAGE_SIZE/sizeof(uint32_t); i++) {
+		hash ^= words[i];
+		hash *= 16777619U;
+	}
+	coremap_unmap_swap_page((vaddr_t)words, pa);
+
+	coremap_unpin(pa);
+	*hashret = hash;
+	return true;
+}
+
+/*
+ * lpage_merge: if *LPP holds the same data as KEEP, replace it with a
+ * reference to KEEP and return true. *FREEDRET is set if that freed
+ * the old page, rather than just dropping a share of it.
+ *
+ * KEEP must be held (lpage_hold), which makes it copy-on-write, so it
+ * can't change under us. The caller holds the address space *LPP
+ * belongs to locked, so its owner can't fault on it; but the owner may
+ * have it mapped writable on another CPU, so take that mapping away
+ * before comparing. Neither page is paged in; if either isn't
+ * resident, they don't match.
+ *
+ * Like lpage_unshare, this needs a swap reservation for the new
+ * reference; dropping the old page gives one back.
+ */
+bool
+lpage_merge(struct lpage *keep, struct lpage **lpp, bool *freedret)
+{
+	struct lpage *dup;
+	paddr_t kpa, dpa;
+	const uint32_t *kwords, *dwords;
+	unsigned i;
+	bool same;
+
+	dup = *lpp;
+	*freedret = false;
+	if (dup == keep) {
+		return false;
+	}
+
+	lpage_lock_and_pin(keep);
+	kpa = keep->lp_paddr & PAGE_FRAME;
+	lpage_unlock(keep);
+	if (kpa == INVALID_PADDR) {
+		return false;
+	}
+
+	/* (holding KEEP pinned but not locked, as in lpage_copy) */
+	lpage_lock_and_pin(dup);
+	dpa = dup->lp_paddr & PAGE_FRAME;
+	lpage_unlock(dup);
+	if (dpa == INVALID_PADDR) {
+		coremap_unpin(kpa);
+		return false;
+	}
+
+	mmu_invalidate_page(dpa);
+
+	kwords = (const uint32_t *)coremap_map_swap_page(kpa);
+	dwords = (const uint32_t *)coremap_map_swap_page(dpa);
+	same = true;
+	for (i=0; i<PAGE_SIZE/sizeof(uint32_t); i++) {
+		if (kwords[i] != dwords[i]) {
+			same = false;
+			break;
+		}
+	}
+	coremap_unmap_swap_page((vaddr_t)dwords, dpa);
+	coremap_unmap_swap_page((vaddr_t)kwords, kpa);
+
+	coremap_unpin(dpa);
+	coremap_unpin(kpa);
+
+	if (!same) {
+		return false;
+	}
+	if (swap_reserve(1)) {
+		return false;
+	}
+
+	lpage_share(keep);
+	*freedret = lpage_drop(dup);
+	*lpp = keep;
+	return true;
+}
+
+/*
+ * lpage_premap: if LP is resident, map it at VA in the TLB now rather
+ * than waiting for it to fault (fault-around). Same permissions as a
+ * read fault would give.
+ *
+ * Pages that were read ahead and haven't been used yet are skipped,
+ * so their first use still counts as a readahead hit.
+ *
+ * Synchronization: as for lpage_fault.
+ */
+void
+lpage_premap(struct lpage *lp, struct addrspace *as, vaddr_t va)
+{
+	paddr_t pa;
+	int writable;
+
+	lpage_lock_and_pin(lp);
+	pa = lp->lp_paddr & PAGE_FRAME;
+	if (pa == INVALID_PADDR) {
+		lpage_unlock(lp);
+		return;
+	}
+	if (lp->lp_paddr & LPF_READAHEAD) {
+		lpage_unlock(lp);
+		coremap_unpin(pa);
+		return;
+	}
+	writable = LP_ISDIRTY(lp) && lp->lp_refcount == 1;
+	lpage_unlock(lp);
+
+	spinlock_acquire(&stats_spinlock);
+	ct_faultaround_maps++;
+	spinlock_release(&stats_spinlock);
+
+	mmu_map(as, va, pa, writable);
 }
@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <array.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <machine/coremap.h>
+#include <vmprivate.h>
+
+/*
+ * pagemerge.c - merging identical pages.
+ *
+ * Several copies of the same program often end up with pages that
+ * have the same contents. A scanner thread looks for these and makes
+ * them share one lpage copy-on-write, as if they'd been forked from
+ * each other, which frees the duplicates' RAM and swap.
+ *
+ * Every so often the scanner makes a pass:
+ *
+ *    1. Hash up to pm_rate resident pages of private, swap-backed
+ *       vm_objects, picking up where the last pass left off. Pages
+ *       with the same hash are chained together. We only remember
+ *       where the pages were (address space and virtual address),
+ *       since the owners may change things once we let go of them.
+ *
+ *    2. For each chain with more than one page, hold the first
+ *       (lpage_hold), then go to each of the others and, if it
+ *       really is the same, replace it with the held page
+ *       (lpage_merge).
+ *
+ * The scanner only ever holds one address space locked at a time
+ * (as_lock), so it can't deadlock with as_copy, which holds two. It
+ * holds pm_lock for a whole pass; as_destroy waits on that, so the
+ * address spaces it noted down in step 1 are still there in step 2.
+ *
+ * Pages that are already shared are fair game. Pages of shared
+ * objects (mmap MAP_SHARED) and read-only file pages, which have no
+ * swap, aren't.
+ */
+
+/* Seconds between passes. */
+#define PM_INTERVAL	1
+
+/* Pages hashed and merged at a time; a pass may take several batches. */
+#define PM_BATCH	256
+
+/* One page noted down in step 1. */
+struct pm_cand {
+	struct addrspace *pc_as;
+	vaddr_t pc_va;
+	uint32_t pc_hash;
+	int pc_next;		/* next chain in hash bucket, or -1 */
+	int pc_nextdup;		/* next page with the same hash, or -1 */
+};
+
+/*
+ * Data.
+ */
+static struct lock *pm_lock;		/* for pm_asarray and the cursor */
+static struct array pm_asarray;		/* all address spaces */
+
+/* Where the next pass starts: address space, vm_object, page. */
+static unsigned pm_cursor_as;
+static unsigned pm_cursor_obj;
+static unsigned pm_cursor_page;
+
+/* Candidates and hash table for one batch. Protected by pm_lock. */
+static struct pm_cand pm_cands[PM_BATCH];
+static int pm_buckets[PM_BATCH];
+
+/*
+ * Scan rate, and stats. Protected by pm_spinlock.
+ */
+static struct spinlock pm_spinlock = SPINLOCK_INITIALIZER;
+static unsigned pm_rate = 0;
+static volatile uint32_t ct_pm_passes;
+static volatile uint32_t ct_pm_scanned;
+static volatile uint32_t ct_pm_merged;		/* slots redirected */
+static volatile uint32_t ct_pm_saved;		/* pages freed */
+
+
+/*
+ * pagemerge_addas/removeas: add and remove address spaces from the
+ * list the scanner looks at.
+ *
+ * Synchronization: pm_lock.
+ */
+int
+pagemerge_addas(struct addrspace *as)
+{
+	int result;
+
+	KASSERT(pm_lock != NULL);
+
+	lock_acquire(pm_lock);
+	result = array_add(&pm_asarray, as, NULL);
+	lock_release(pm_lock);
+
+	return result;
+}
+
+void
+pagemerge_removeas(struct addrspace *as)
+{
+	unsigned i, num;
+
+	lock_acquire(pm_lock);
+	num = array_num(&pm_asarray);
+	for (i=0; i<num; i++) {
+		if (array_get(&pm_asarray, i) == as) {
+			array_remove(&pm_asarray, i);
+			break;
+		}
+	}
+	KASSERT(i < num);
+	lock_release(pm_lock);
+}
+
+/*
+ * pm_mergeable: can VMO's pages be merged?
+ */
+static
+bool
+pm_mergeable(struct vm_object *vmo)
+{
+	return !vmo->vmo_shared &&
+		(vmo->vmo_vnode == NULL || vmo->vmo_writeable);
+}
+
+/*
+ * pm_findslot: find the lpage slot for VA in AS, if it's in a
+ * mergeable vm_object. Returns the vm_object and sets *INDEXRET, or
+ * returns NULL.
+ *
+ * Synchronization: the caller holds AS locked.
+ */
+static
+struct vm_object *
+pm_findslot(struct addrspace *as, vaddr_t va, unsigned *indexret)
+{
+	struct vm_object *vmo;
+	int i;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	i = as_findobj(as, va);
+	if (i < 0) {
+		return NULL;
+	}
+	vmo = vm_object_array_get(as->as_objects, i);
+	if (!pm_mergeable(vmo)) {
+		return NULL;
+	}
+	*indexret = (va - vmo->vmo_base) / PAGE_SIZE;
+	return vmo;
+}
+
+/*
+ * pm_note: enter candidate N in the hash table, chaining it to an
+ * earlier one with the same hash if there is one.
+ */
+static
+void
+pm_note(struct pm_cand *cands, int *buckets, unsigned nbuckets, int n)
+{
+	unsigned b;
+	int k;
+
+	b = cands[n].pc_hash % nbuckets;
+	for (k = buckets[b]; k >= 0; k = cands[k].pc_next) {
+		if (cands[k].pc_hash == cands[n].pc_hash) {
+			cands[n].pc_next = -1;
+			cands[n].pc_nextdup = cands[k].pc_nextdup;
+			cands[k].pc_nextdup = n;
+			return;
+		}
+	}
+	cands[n].pc_next = buckets[b];
+	cands[n].pc_nextdup = -1;
+	buckets[b] = n;
+}
+
+/*
+ * pm_scan: step 1. Hash up to MAX pages, starting at the cursor, and
+ * return how many were noted down.
+ *
+ * Synchronization: the caller holds pm_lock. We lock each address
+ * space while looking at it.
+ */
+static
+unsigned
+pm_scan(struct pm_cand *cands, int *buckets, unsigned nbuckets,
+	unsigned max)
+{
+	struct addrspace *as;
+	struct vm_object *vmo;
+	struct lpage *lp;
+	unsigned nas, asleft, scanned, n;
+	uint32_t hash;
+
+	KASSERT(lock_do_i_hold(pm_lock));
+
+	n = 0;
+	scanned = 0;
+	nas = array_num(&pm_asarray);
+	for (asleft = nas; asleft > 0 && scanned < max; asleft--) {
+		if (pm_cursor_as >= nas) {
+			pm_cursor_as = 0;
+			pm_cursor_obj = 0;
+			pm_cursor_page = 0;
+		}
+		as = array_get(&pm_asarray, pm_cursor_as);
+
+		lock_acquire(as->as_lock);
+		while (scanned < max &&
+		       pm_cursor_obj < vm_object_array_num(as->as_objects)) {
+			vmo = vm_object_array_get(as->as_objects,
+						  pm_cursor_obj);
+			if (!pm_mergeable(vmo) || pm_cursor_page >=
+			    lpage_table_num(vmo->vmo_lpages)) {
+				pm_cursor_obj++;
+				pm_cursor_page = 0;
+				continue;
+			}
+			/* (untouched pages are skipped for free) */
+			pm_cursor_page = lpage_table_next(vmo->vmo_lpages,
+							  pm_cursor_page);
+			if (pm_cursor_page >= lpage_table_num(vmo->vmo_lpages)) {
+				continue;
+			}
+			lp = lpage_table_get(vmo->vmo_lpages, pm_cursor_page);
+			if (lpage_hash(lp, &hash)) {
+				cands[n].pc_as = as;
+				cands[n].pc_va = vmo->vmo_base +
+					pm_cursor_page * PAGE_SIZE;
+				cands[n].pc_hash = hash;
+				pm_note(cands, buckets, nbuckets, n);
+				n++;
+			}
+			scanned++;
+			pm_cursor_page++;
+		}
+		if (scanned < max) {
+			/* finished this one */
+			pm_cursor_as++;
+			pm_cursor_obj = 0;
+			pm_cursor_page = 0;
+		}
+		lock_release(as->as_lock);
+	}
+
+	spinlock_acquire(&pm_spinlock);
+	ct_pm_scanned += scanned;
+	spinlock_release(&pm_spinlock);
+
+	return n;
+}
+
+/*
+ * pm_merge: step 2, for one chain of pages with the same hash,
+ * starting at candidate K.
+ *
+ * Synchronization: the caller holds pm_lock. We lock one address
+ * space at a time.
+ */
+static
+void
+pm_merge(struct pm_cand *cands, int k)
+{
+	struct addrspace *as;
+	struct vm_object *vmo;
+	struct lpage *keep, *lp;
+	unsigned index;
+	unsigned merged, saved;
+	bool freed;
+	int d;
+
+	as = cands[k].pc_as;
+	lock_acquire(as->as_lock);
+	keep = NULL;
+	vmo = pm_findslot(as, cands[k].pc_va, &index);
+	if (vmo != NULL) {
+		keep = lpage_table_get(vmo->vmo_lpages, index);
+		if (keep != NULL && lpage_hold(keep)) {
+			keep = NULL;
+		}
+	}
+	lock_release(as->as_lock);
+
+	if (keep == NULL) {
+		/* gone, or no swap to hold it with */
+		return;
+	}
+
+	merged = saved = 0;
+	for (d = cands[k].pc_nextdup; d >= 0; d = cands[d].pc_nextdup) {
+		as = cands[d].pc_as;
+		lock_acquire(as->as_lock);
+		vmo = pm_findslot(as, cands[d].pc_va, &index);
+		if (vmo != NULL) {
+			lp = lpage_table_get(vmo->vmo_lpages, index);
+			if (lp != NULL && lpage_merge(keep, &lp, &freed)) {
+				lpage_table_set(vmo->vmo_lpages, index, lp);
+				merged++;
+				if (freed) {
+					saved++;
+				}
+			}
+		}
+		lock_release(as->as_lock);
+	}
+
+	lpage_unhold(keep);
+
+	spinlock_acquire(&pm_spinlock);
+	ct_pm_merged += merged;
+	ct_pm_saved += saved;
+	spinlock_release(&pm_spinlock);
+}
+
+/*
+ * pm_pass: one pass over up to MAX pages, PM_BATCH at a time. Only
+ * duplicates that land in the same batch are found; ones that don't
+ * will likely meet in a later pass.
+ */
+static
+void
+pm_pass(unsigned max)
+{
+	unsigned batch, n, i;
+	int k;
+
+	lock_acquire(pm_lock);
+	while (max > 0) {
+		batch = max < PM_BATCH ? max : PM_BATCH;
+		max -= batch;
+
+		for (i=0; i<PM_BATCH; i++) {
+			pm_buckets[i] = -1;
+		}
+		n = pm_scan(pm_cands, pm_buckets, PM_BATCH, batch);
+		for (i=0; i<PM_BATCH; i++) {
+			for (k = pm_buckets[i]; k >= 0;
+			     k = pm_cands[k].pc_next) {
+				if (pm_cands[k].pc_nextdup >= 0) {
+					pm_merge(pm_cands, k);
+				}
+			}
+		}
+		DEBUG(DB_VM, "pagemerge: noted %u pages\n", n);
+	}
+	lock_release(pm_lock);
+
+	spinlock_acquire(&pm_spinlock);
+	ct_pm_passes++;
+	spinlock_release(&pm_spinlock);
+}
+
+/*
+ * The scanner thread. Makes a pass every PM_INTERVAL seconds, unless
+ * the rate is 0.
+ */
+static
+void
+pagemerge_thread(void *data1, unsigned long data2)
+{
+	unsigned rate;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(PM_INTERVAL);
+
+		spinlock_acquire(&pm_spinlock);
+		rate = pm_rate;
+		spinlock_release(&pm_spinlock);
+
+		if (rate > 0) {
+			pm_pass(rate * PM_INTERVAL);
+		}
+	}
+}
+
+/*
+ * pagemerge_setrate/getrate: set or get the number of pages scanned
+ * per second. 0 (the default) turns merging off. There's no point
+ * scanning more pages than there are, so the rate is capped at that.
+ */
+void
+pagemerge_setrate(unsigned pagespersec)
+{
+	if (pagespersec > coremap_npages()) {
+		pagespersec = coremap_npages();
+	}
+
+	spinlock_acquire(&pm_spinlock);
+	pm_rate = pagespersec;
+	spinlock_release(&pm_spinlock);
+}
+
+unsigned
+pagemerge_getrate(void)
+{
+	return pm_rate;
+}
+
+/*
+ * pagemerge_printstats: print scanner stats.
+ */
+void
+pagemerge_printstats(void)
+{
+	uint32_t passes, scanned, merged, saved;
+	unsigned rate;
+
+	spinlock_acquire(&pm_spinlock);
+	rate = pm_rate;
+	passes = ct_pm_passes;
+	scanned = ct_pm_scanned;
+	merged = ct_pm_merged;
+	saved = ct_pm_saved;
+	spinlock_release(&pm_spinlock);
+
+	kprintf("vm: page merging: %u pages/sec, %lu passes, "
+		"%lu pages scanned\n", rate,
+		(unsigned long) passes, (unsigned long) scanned);
+	kprintf("vm: page merging: %lu pages merged, %lu pages saved\n",
+		(unsigned long) merged, (unsigned long) saved);
+}
+
+/*
+ * pagemerge_bootstrap: set up, and start the scanner thread.
+ */
+void
+pagemerge_bootstrap(void)
+{
+	int result;
+
+	pm_lock = lock_create("pagemerge");
+	if (pm_lock == NULL) {
+		panic("pagemerge: Could not create lock\n");
+	}
+	array_init(&pm_asarray);
+
+	result = thread_fork("pagemerge", pagemerge_thread, NULL, 0, NULL);
+	if (result) {
+		panic("pagemerge: Could not start scanner: %s\n",
+		      strerror(result));
+	}
+}
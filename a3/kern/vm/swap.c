@@ -33,7 +33,9 @@
 #include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <clock.h>
 #include <bitmap.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <thread.h>
 #include <current.h>
@@ -66,21 +68,68 @@ static unsigned long swap_total_pages;
 static unsigned long swap_free_pages;
 static unsigned long swap_reserved_pages;
 
-static struct vnode *swapstore;	// swap file
-
 /*
- * Only one page can be in transit to/from disk at once (at least under
- * present circumstances.) While the disk device will queue up multiple
- * concurrent requests correctly, there's no benefit to doing so. So we
- * enforce mutual exclusion at a higher level. This reduces the number
- * of pages marked in transit at any one time and thus (hopefully) makes
- * paging more intelligent and multipage allocation less likely to starve.
+ * Overcommit policy: how far swap_reserve will promise swap it may
+ * not have.
+ *
+ *   strict     never reserve more than is free. Allocation can't
+ *              fail. This is the original behavior.
+ *   heuristic  refuse a reservation that would take the total
+ *              reserved past free swap and RAM together. Pages that
+ *              are reserved but have no swap page yet (mostly
+ *              copy-on-write sharers) may never need one, or may
+ *              stay in RAM.
+ *   always     never refuse.
  *
- * This lock signals "intent to page" and should be construed as
- * advisory.
+ * Only strict mode reserves swap for a vm_object's untouched pages
+ * up front (swap_reserve_ahead). Otherwise each one is reserved when
+ * it first gets dirty and needs a swap page (lpage_materialize), so
+ * a large sparse heap or stack costs nothing until it is used.
+ * Objects keep whichever
+ * way they started in if the mode changes. Reservations for shared
+ * pages (copy-on-write) are taken the same way in every mode.
+ *
+ * When not strict, swap_alloc can come up empty, and the fault that
+ * wanted the page fails with ENOMEM. The strict invariant
+ * (reserved <= free) holds whenever the mode is strict; we refuse to
+ * switch back to strict while it doesn't.
+ */
+#define OC_STRICT	0
+#define OC_HEURISTIC	1
+#define OC_ALWAYS	2
+
+static const char *const overcommit_names[] = {
+	"strict",
+	"heuristic",
+	"always",
+};
+
+static unsigned overcommit_mode = OC_STRICT;
+static unsigned long swap_ram_pages;	// for the heuristic
+static unsigned long swap_alloc_failures;
+
+#define SWAP_COUNTS_OK() \
+	(swap_free_pages <= swap_total_pages && \
+	 (overcommit_mode != OC_STRICT || \
+	  swap_reserved_pages <= swap_free_pages))
+
+/*
+ * Swap pages are allocated next-fit: the search for a free page (or
+ * run of pages) starts where the last one left off. Pages allocated
+ * around the same time thus tend to be adjacent, which lets pageout
+ * write them in one go and pagein read them ahead.
  */
+static uint32_t swap_hint;
 
-struct lock *global_paging_lock;
+static struct vnode *swapstore;	// swap file
+
+/*
+ * Stats. ct_write_clusters[n] counts writes of n pages.
+ */
+static struct spinlock swap_stats_spinlock = SPINLOCK_INITIALIZER;
+static volatile uint32_t ct_write_clusters[SWAP_CLUSTER_MAX+1];
+static volatile uint64_t ct_write_bytes;
+static volatile uint64_t ct_write_nsecs;
 
 
 /*
@@ -117,14 +166,13 @@ swap_bootstrap(void)
 			(unsigned long) st.st_size);
 		kprintf("swap: with %lu bytes of physical memory it should "
 			"be at least\n", (unsigned long) pmemsize);
-		kprintf("      %lu bytes (%lu blocks), perhaps larger.\n", 
+		kprintf("      %lu bytes (%lu blocks) to reserve swap "
+			"conservatively.\n", 
 			(unsigned long) minsize, 
 			(unsigned long) minsize / 512);
-		kprintf("swap: Because we conservatively reserve swap, a "
-			"large amount may be\n");
-		kprintf("      needed to run large workloads.\n");
-		kprintf("swap: Please extend it.\n");
-		panic("swap: Unable to continue.\n");
+		kprintf("swap: Overcommitting swap instead; processes may "
+			"be killed if it runs out.\n");
+		overcommit_mode = OC_HEURISTIC;
 	}
 
 	kprintf("swap: swapping to %s (%lu bytes; %lu pages)\n", swapfilename,
@@ -134,7 +182,9 @@ swap_bootstrap(void)
 	swap_total_pages = st.st_size / PAGE_SIZE;
 	swap_free_pages = swap_total_pages;
 	swap_reserved_pages = 0;
+	swap_ram_pages = pmemsize / PAGE_SIZE;
 
+	swap_hint = 1;
 	swapmap = bitmap_create(st.st_size/PAGE_SIZE);
 	DEBUG(DB_VM, "creating swap map with %lld entries\n",
 			st.st_size/PAGE_SIZE);
@@ -150,6 +200,14 @@ swap_bootstrap(void)
 	/* mark the first page of swap used so we can check for errors */
 	bitmap_mark(swapmap, 0);
 	swap_free_pages--;
+
+	/* Keep up to a sixteenth of RAM in compressed form. */
+	zcache_bootstrap(swap_ram_pages / ZCACHE_RAM_FRACTION);
+
+	/* Now there's somewhere to page out to. */
+	coremap_pageout_bootstrap();
+	pagemerge_bootstrap();
+	loadctl_bootstrap();
 }
 
 /*
@@ -165,28 +223,72 @@ swap_shutdown(void)
 	vfs_close(swapstore);
 }
 
+/*
+ * swap_findrun: find NPAGES free swap pages in a row, next-fit.
+ * Returns the index of the first, or 0 if there's no such run. (Swap
+ * page 0 is never free.)
+ *
+ * Synchronization: assumes we hold swaplock.
+ */
+static
+uint32_t
+swap_findrun(unsigned npages)
+{
+	uint32_t i, n, run;
+
+	KASSERT(lock_do_i_hold(swaplock));
+	KASSERT(npages > 0);
+
+	i = swap_hint;
+	run = 0;
+	for (n = 0; n < swap_total_pages + npages; n++, i++) {
+		if (i >= swap_total_pages) {
+			/* runs don't wrap around */
+			i = 1;
+			run = 0;
+		}
+		if (bitmap_isset(swapmap, i)) {
+			run = 0;
+			continue;
+		}
+		run++;
+		if (run == npages) {
+			i -= npages - 1;
+			swap_hint = i + npages;
+			return i;
+		}
+	}
+	return 0;
+}
+
 /*
  * swap_alloc: allocates a page in the swapfile.
  * The page should have already been reserved with swap_reserve.
+ * Returns INVALID_SWAPADDR if swap is full, which can only happen if
+ * we're overcommitting; the reservation then stays put.
  *
  * Synchronization: uses swaplock.
  */
 off_t
 swap_alloc(void)
 {
-	uint32_t rv, index;
+	uint32_t index;
 	
 	lock_acquire(swaplock);
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
-
+	KASSERT(SWAP_COUNTS_OK());
 	KASSERT(swap_reserved_pages>0);
-	KASSERT(swap_free_pages>0);
 
-	rv = bitmap_alloc(swapmap, &index);
-	/* If this blows up, our counters are wrong */
-	KASSERT(rv == 0);
+	index = swap_findrun(1);
+	if (index == 0) {
+		/* If this blows up, our counters are wrong */
+		KASSERT(overcommit_mode != OC_STRICT);
+		KASSERT(swap_free_pages == 0);
+		swap_alloc_failures++;
+		lock_release(swaplock);
+		return INVALID_SWAPADDR;
+	}
+	bitmap_mark(swapmap, index);
 
 	swap_reserved_pages--;
 	swap_free_pages--;
@@ -196,6 +298,41 @@ swap_alloc(void)
 	return index*PAGE_SIZE;
 }
 
+/*
+ * swap_alloc_run: allocates NPAGES contiguous pages in the swapfile
+ * and returns the address of the first, or INVALID_SWAPADDR if there
+ * is no free run that long. The pages should have already been
+ * reserved with swap_reserve; on failure they stay reserved.
+ *
+ * Synchronization: uses swaplock.
+ */
+off_t
+swap_alloc_run(unsigned npages)
+{
+	uint32_t index, i;
+
+	lock_acquire(swaplock);
+
+	KASSERT(SWAP_COUNTS_OK());
+	KASSERT(swap_reserved_pages >= npages);
+
+	index = swap_findrun(npages);
+	if (index == 0) {
+		lock_release(swaplock);
+		return INVALID_SWAPADDR;
+	}
+	for (i=0; i<npages; i++) {
+		bitmap_mark(swapmap, index + i);
+	}
+
+	swap_reserved_pages -= npages;
+	swap_free_pages -= npages;
+
+	lock_release(swaplock);
+
+	return index*PAGE_SIZE;
+}
+
 /*
  * swap_free: marks a page in the swapfile as unused.
  *
@@ -211,10 +348,12 @@ swap_free(off_t swapaddr)
 
 	index = swapaddr / PAGE_SIZE;
 
+	zcache_drop(swapaddr);
+
 	lock_acquire(swaplock);
 
 	KASSERT(swap_free_pages < swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(SWAP_COUNTS_OK());
 
 	KASSERT(bitmap_isset(swapmap, index));
 	bitmap_unmark(swapmap, index);
@@ -225,27 +364,43 @@ swap_free(off_t swapaddr)
 
 /*
  * swap_reserve/unreserve: reserve some pages for future allocation, or
- * release such pages.
+ * release such pages. Whether a reservation can exceed the free swap
+ * depends on the overcommit mode.
  *
  * Synchronization: uses swaplock.
  */
 int
 swap_reserve(unsigned long npages)
 {
-	lock_acquire(swaplock);
+	bool ok;
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	lock_acquire(swaplock);
 
-	if (swap_free_pages - swap_reserved_pages < npages) {
+	KASSERT(SWAP_COUNTS_OK());
+
+	switch (overcommit_mode) {
+	    case OC_STRICT:
+		ok = swap_reserved_pages + npages <= swap_free_pages;
+		break;
+	    case OC_HEURISTIC:
+		ok = swap_reserved_pages + npages <=
+			swap_free_pages + swap_ram_pages;
+		break;
+	    case OC_ALWAYS:
+		ok = true;
+		break;
+	    default:
+		panic("swap_reserve: invalid overcommit mode %u\n",
+		      overcommit_mode);
+	}
+	if (!ok) {
 		lock_release(swaplock);
 		return ENOMEM;
 	}
 
 	swap_reserved_pages += npages;
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(SWAP_COUNTS_OK());
 
 	lock_release(swaplock);
 	return 0;
@@ -256,8 +411,7 @@ swap_unreserve(unsigned long npages)
 {
 	lock_acquire(swaplock);
 
-	KASSERT(swap_free_pages <= swap_total_pages);
-	KASSERT(swap_reserved_pages <= swap_free_pages);
+	KASSERT(SWAP_COUNTS_OK());
 
 	KASSERT(npages <= swap_reserved_pages);
 	swap_reserved_pages -= npages;
@@ -266,38 +420,116 @@ swap_unreserve(unsigned long npages)
 }
 
 /*
- * swap_io: Does one swap I/O. Panics on failure.
+ * swap_reserve_ahead: reserve NPAGES for a vm_object's untouched pages
+ * if the mode is strict; otherwise reserve nothing and leave them to
+ * be reserved one at a time as they're first dirtied. Sets *DIDRET to
+ * whether it reserved.
  *
- * Synchronization: none specifically. The physical page should be
- * marked "pinned" (locked) so it won't be touched by other people.
+ * Synchronization: uses swaplock.
+ */
+int
+swap_reserve_ahead(unsigned long npages, bool *didret)
+{
+	lock_acquire(swaplock);
+	if (overcommit_mode != OC_STRICT) {
+		lock_release(swaplock);
+		*didret = false;
+		return 0;
+	}
+	KASSERT(SWAP_COUNTS_OK());
+	if (swap_reserved_pages + npages > swap_free_pages) {
+		lock_release(swaplock);
+		return ENOMEM;
+	}
+	swap_reserved_pages += npages;
+	lock_release(swaplock);
+	*didret = true;
+	return 0;
+}
+
+/*
+ * swap_set_overcommit: change the overcommit mode, by name. Going
+ * back to strict fails with EBUSY if more is reserved than is free.
+ *
+ * swap_get_overcommit: return the name of the current mode.
+ *
+ * Synchronization: uses swaplock.
+ */
+int
+swap_set_overcommit(const char *name)
+{
+	unsigned i, n;
+
+	n = sizeof(overcommit_names)/sizeof(overcommit_names[0]);
+	for (i=0; i<n; i++) {
+		if (!strcmp(name, overcommit_names[i])) {
+			break;
+		}
+	}
+	if (i == n) {
+		return EINVAL;
+	}
+
+	lock_acquire(swaplock);
+	if (i == OC_STRICT && swap_reserved_pages > swap_free_pages) {
+		lock_release(swaplock);
+		return EBUSY;
+	}
+	overcommit_mode = i;
+	lock_release(swaplock);
+
+	return 0;
+}
+
+const char *
+swap_get_overcommit(void)
+{
+	return overcommit_names[overcommit_mode];
+}
+
+/*
+ * swap_io_iov: Does one swap I/O, of NPAGES pages described by IOV to
+ * or from that many consecutive swap pages starting at SWAPADDR.
+ * Panics on failure.
  */
 static
 void
-swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
+swap_io_iov(struct iovec *iov, unsigned npages, off_t swapaddr,
+	    enum uio_rw rw)
 {
-	struct iovec iov;
 	struct uio u;
-	vaddr_t va;
+	time_t secs1, secs2, isecs;
+	uint32_t nsecs1, nsecs2, insecs;
 	int result;
 
-	KASSERT(lock_do_i_hold(global_paging_lock));
-
-	KASSERT(pa != INVALID_PADDR);
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER_MAX);
 	KASSERT(swapaddr % PAGE_SIZE == 0);
-	KASSERT(coremap_pageispinned(pa));
-	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
 
-	va = coremap_map_swap_page(pa);
+	u.uio_iov = iov;
+	u.uio_iovcnt = npages;
+	u.uio_offset = swapaddr;
+	u.uio_resid = npages * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
 
-	uio_kinit(&iov, &u, (char *)va, PAGE_SIZE, swapaddr, rw);
+	gettime(&secs1, &nsecs1);
 	if (rw==UIO_READ) {
 		result = VOP_READ(swapstore, &u);
 	}
 	else {
 		result = VOP_WRITE(swapstore, &u);
 	}
-
-	coremap_unmap_swap_page(va, pa);
+	gettime(&secs2, &nsecs2);
+
+	if (rw==UIO_WRITE) {
+		getinterval(secs1, nsecs1, secs2, nsecs2, &isecs, &insecs);
+		spinlock_acquire(&swap_stats_spinlock);
+		ct_write_clusters[npages]++;
+		ct_write_bytes += npages * PAGE_SIZE;
+		ct_write_nsecs += (uint64_t)isecs * 1000000000 + insecs;
+		spinlock_release(&swap_stats_spinlock);
+	}
 
 	if (result==EIO) {
 		panic("swap: EIO on swapfile (offset %ld)\n",
@@ -314,22 +546,182 @@ swap_io(paddr_t pa, off_t swapaddr, enum uio_rw rw)
 }
 
 /*
- * swap_pagein: load one page from swap into physical memory.
+ * swap_io: Does one swap I/O, of NPAGES physical pages to or from
+ * that many consecutive swap pages starting at SWAPADDR. This always
+ * goes to disk; the compressed cache is the callers' business.
+ *
+ * Synchronization: none specifically. The physical pages should be
+ * marked "pinned" (locked) so they won't be touched by other people.
+ */
+static
+void
+swap_io(const paddr_t *pas, unsigned npages, off_t swapaddr,
+	enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER_MAX];
+	vaddr_t va;
+	unsigned i;
+
+	KASSERT(npages > 0 && npages <= SWAP_CLUSTER_MAX);
+	for (i=0; i<npages; i++) {
+		KASSERT(pas[i] != INVALID_PADDR);
+		KASSERT(coremap_pageispinned(pas[i]));
+		KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE + i));
+
+		va = coremap_map_swap_page(pas[i]);
+		iov[i].iov_kbase = (void *)va;
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	swap_io_iov(iov, npages, swapaddr, rw);
+
+	for (i=0; i<npages; i++) {
+		coremap_unmap_swap_page(PADDR_TO_KVADDR(pas[i]), pas[i]);
+	}
+}
+
+/*
+ * swap_write_kbuf: write a page-sized kernel buffer to swap. Used by
+ * the compressed cache to write pages back.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_write_kbuf(const void *buf, off_t swapaddr)
+{
+	struct iovec iov;
+
+	KASSERT(bitmap_isset(swapmap, swapaddr / PAGE_SIZE));
+
+	iov.iov_kbase = (void *)buf;
+	iov.iov_len = PAGE_SIZE;
+	swap_io_iov(&iov, 1, swapaddr, UIO_WRITE);
+}
+
+/*
+ * swap_pagein: load one page from swap into physical memory, from
+ * the compressed cache if it's there.
  * Synchronization: none here. See swap_io().
  */
 void
 swap_pagein(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_READ);
+	if (!zcache_load(pa, swapaddr)) {
+		swap_io(&pa, 1, swapaddr, UIO_READ);
+	}
+}
+
+/*
+ * swap_pagein_cluster: load NPAGES consecutive swap pages starting at
+ * SWAPADDR into physical memory. Pages in the compressed cache come
+ * from there; each run of the others is read in one I/O.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pagein_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	unsigned i, start;
+
+	start = 0;
+	for (i=0; i<npages; i++) {
+		if (zcache_load(pas[i], swapaddr + i * PAGE_SIZE)) {
+			if (i > start) {
+				swap_io(pas + start, i - start,
+					swapaddr + start * PAGE_SIZE,
+					UIO_READ);
+			}
+			start = i + 1;
+		}
+	}
+	if (npages > start) {
+		swap_io(pas + start, npages - start,
+			swapaddr + start * PAGE_SIZE, UIO_READ);
+	}
 }
 
 
 /* 
- * swap_pageout: write one page from physical memory into swap.
+ * swap_pageout: write one page from physical memory into swap; that
+ * is, into the compressed cache, or to disk if it won't go there.
  * Synchronization: none here. See swap_io().
  */
 void
 swap_pageout(paddr_t pa, off_t swapaddr)
 {
-	swap_io(pa, swapaddr, UIO_WRITE);
+	if (!zcache_store(pa, swapaddr)) {
+		swap_io(&pa, 1, swapaddr, UIO_WRITE);
+	}
+}
+
+/*
+ * swap_pageout_cluster: write NPAGES pages from physical memory into
+ * consecutive swap pages starting at SWAPADDR. As for pagein, pages
+ * that go into the compressed cache split the rest into runs, each
+ * written in one I/O.
+ * Synchronization: none here. See swap_io().
+ */
+void
+swap_pageout_cluster(const paddr_t *pas, unsigned npages, off_t swapaddr)
+{
+	unsigned i, start;
+
+	start = 0;
+	for (i=0; i<npages; i++) {
+		if (zcache_store(pas[i], swapaddr + i * PAGE_SIZE)) {
+			if (i > start) {
+				swap_io(pas + start, i - start,
+					swapaddr + start * PAGE_SIZE,
+					UIO_WRITE);
+			}
+			start = i + 1;
+		}
+	}
+	if (npages > start) {
+		swap_io(pas + start, npages - start,
+			swapaddr + start * PAGE_SIZE, UIO_WRITE);
+	}
+}
+
+/*
+ * swap_printstats: print swap usage and pageout stats.
+ */
+void
+swap_printstats(void)
+{
+	uint32_t clusters[SWAP_CLUSTER_MAX+1];
+	uint64_t bytes, nsecs;
+	unsigned long tot, fr, res, afail;
+	unsigned mode, i;
+
+	spinlock_acquire(&swap_stats_spinlock);
+	for (i=0; i<=SWAP_CLUSTER_MAX; i++) {
+		clusters[i] = ct_write_clusters[i];
+	}
+	bytes = ct_write_bytes;
+	nsecs = ct_write_nsecs;
+	spinlock_release(&swap_stats_spinlock);
+
+	lock_acquire(swaplock);
+	tot = swap_total_pages;
+	fr = swap_free_pages;
+	res = swap_reserved_pages;
+	afail = swap_alloc_failures;
+	mode = overcommit_mode;
+	lock_release(swaplock);
+
+	kprintf("swap: %lu pages, %lu free, %lu reserved\n", tot, fr, res);
+	kprintf("swap: overcommit %s, %lu failed allocations\n",
+		overcommit_names[mode], afail);
+	kprintf("swap: writes by cluster size:");
+	for (i=1; i<=SWAP_CLUSTER_MAX; i++) {
+		if (clusters[i] > 0) {
+			kprintf(" %u:%lu", i, (unsigned long) clusters[i]);
+		}
+	}
+	kprintf("\n");
+	kprintf("swap: wrote %luk in %lu msec (%luk/sec)\n",
+		(unsigned long) (bytes / 1024),
+		(unsigned long) (nsecs / 1000000),
+		(unsigned long) (nsecs > 0 ?
+				 bytes * 1000000000 / 1024 / nsecs : 0));
+	zcache_printstats();
 }
@@ -31,82 +31,442 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <synch.h>
+#include <vnode.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <vmprivate.h>
 #include <machine/coremap.h>
 
+/*
+ * lpage_table operations.
+ */
+
+#define LPT_CHUNKMASK		(LPT_CHUNKPAGES - 1)
+#define LPT_NCHUNKS(n)		(((n) + LPT_CHUNKMASK) >> LPT_CHUNKSHIFT)
+
+struct lpage_table *
+lpage_table_create(void)
+{
+	struct lpage_table *lt;
+
+	lt = kmalloc(sizeof(struct lpage_table));
+	if (lt == NULL) {
+		return NULL;
+	}
+	lt->lt_num = 0;
+	lt->lt_maxchunks = 0;
+	lt->lt_chunks = NULL;
+	return lt;
+}
+
+void
+lpage_table_destroy(struct lpage_table *lt)
+{
+	KASSERT(lt->lt_num == 0);
+	kfree(lt->lt_chunks);
+	kfree(lt);
+}
+
+unsigned
+lpage_table_num(const struct lpage_table *lt)
+{
+	return lt->lt_num;
+}
+
+/*
+ * Is chunk C all NULL?
+ */
+static
+bool
+lpage_table_chunkempty(struct lpage **chunk)
+{
+	unsigned i;
+
+	for (i=0; i<LPT_CHUNKPAGES; i++) {
+		if (chunk[i] != NULL) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Set the size of the table. Shrinking drops whole chunks past the
+ * end and clears the tail of the last one, so that slots are NULL
+ * again if the table grows back. Growing only has to enlarge the
+ * directory (doubling it, since the heap grows a little at a time);
+ * the new slots have no chunks and so are NULL.
+ */
+int
+lpage_table_setsize(struct lpage_table *lt, unsigned num)
+{
+	struct lpage ***newchunks;
+	struct lpage **chunk;
+	unsigned oldchunks, nchunks, newmax, c, i;
+
+	oldchunks = LPT_NCHUNKS(lt->lt_num);
+	nchunks = LPT_NCHUNKS(num);
+
+	if (num < lt->lt_num) {
+		for (c = nchunks; c < oldchunks; c++) {
+			kfree(lt->lt_chunks[c]);
+			lt->lt_chunks[c] = NULL;
+		}
+		chunk = (num & LPT_CHUNKMASK) ? lt->lt_chunks[nchunks-1] : NULL;
+		if (chunk != NULL) {
+			for (i = num & LPT_CHUNKMASK; i < LPT_CHUNKPAGES; i++) {
+				chunk[i] = NULL;
+			}
+			if (lpage_table_chunkempty(chunk)) {
+				kfree(chunk);
+				lt->lt_chunks[nchunks-1] = NULL;
+			}
+		}
+	}
+	else if (nchunks > lt->lt_maxchunks) {
+		newmax = lt->lt_maxchunks * 2;
+		if (newmax < nchunks) {
+			newmax = nchunks;
+		}
+		newchunks = kmalloc(newmax * sizeof(struct lpage **));
+		if (newchunks == NULL) {
+			return ENOMEM;
+		}
+		for (c = 0; c < newmax; c++) {
+			newchunks[c] = c < oldchunks ? lt->lt_chunks[c] : NULL;
+		}
+		kfree(lt->lt_chunks);
+		lt->lt_chunks = newchunks;
+		lt->lt_maxchunks = newmax;
+	}
+
+	lt->lt_num = num;
+	return 0;
+}
+
+struct lpage *
+lpage_table_get(const struct lpage_table *lt, unsigned index)
+{
+	struct lpage **chunk;
+
+	KASSERT(index < lt->lt_num);
+	chunk = lt->lt_chunks[index >> LPT_CHUNKSHIFT];
+	if (chunk == NULL) {
+		return NULL;
+	}
+	return chunk[index & LPT_CHUNKMASK];
+}
+
+/*
+ * Allocate the chunk for slot INDEX if it doesn't have one yet.
+ */
+int
+lpage_table_prepare(struct lpage_table *lt, unsigned index)
+{
+	struct lpage **chunk;
+	unsigned c, i;
+
+	KASSERT(index < lt->lt_num);
+	c = index >> LPT_CHUNKSHIFT;
+	if (lt->lt_chunks[c] != NULL) {
+		return 0;
+	}
+
+	chunk = kmalloc(LPT_CHUNKPAGES * sizeof(struct lpage *));
+	if (chunk == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<LPT_CHUNKPAGES; i++) {
+		chunk[i] = NULL;
+	}
+	lt->lt_chunks[c] = chunk;
+	return 0;
+}
+
+void
+lpage_table_set(struct lpage_table *lt, unsigned index, struct lpage *lp)
+{
+	struct lpage **chunk;
+
+	KASSERT(index < lt->lt_num);
+	chunk = lt->lt_chunks[index >> LPT_CHUNKSHIFT];
+	if (chunk == NULL) {
+		/* storing NULL in a slot with no chunk is a no-op */
+		KASSERT(lp == NULL);
+		return;
+	}
+	chunk[index & LPT_CHUNKMASK] = lp;
+}
+
+unsigned
+lpage_table_next(const struct lpage_table *lt, unsigned index)
+{
+	struct lpage **chunk;
+
+	while (index < lt->lt_num) {
+		chunk = lt->lt_chunks[index >> LPT_CHUNKSHIFT];
+		if (chunk == NULL) {
+			index = (index | LPT_CHUNKMASK) + 1;
+			continue;
+		}
+		if (chunk[index & LPT_CHUNKMASK] != NULL) {
+			return index;
+		}
+		index++;
+	}
+	return lt->lt_num;
+}
+
 /*
  * vm_object operations.
  */
 
+/*
+ * Shared text objects (see vmprivate.h), and how many times an exec
+ * found one already there.
+ */
+static struct lock *vm_text_lock;
+static struct array vm_text_objects;
+static volatile uint32_t ct_text_shares;
 
-DEFARRAY_BYTYPE(lpage_array, struct lpage, /*noinline*/);
+/*
+ * Does this vm_object hold swap for its pages? Everything but
+ * read-only file mappings does.
+ */
+static
+bool
+vm_object_holds_swap(struct vm_object *vmo)
+{
+	return vmo->vmo_vnode == NULL || vmo->vmo_writeable;
+}
 
 /*
- * vm_object_create: Allocate a new vm_object with nothing in it.
- * Returns: new vm_object on success, NULL on error.
+ * vm_object_init: Allocate a new vm_object with nothing in it. If
+ * RESERVE is set it holds swap, which is reserved now if the
+ * overcommit mode says so (vmo_reserved) and otherwise a page at a
+ * time as the pages are materialized.
  */
+static
 struct vm_object *
-vm_object_create(size_t npages)
+vm_object_init(size_t npages, bool reserve)
 {
 	struct vm_object *vmo;
-	unsigned i;
+	bool reserved = false;
 	int result;
 
-	result = swap_reserve(npages);
-	if (result != 0) {
-		return NULL;
+	if (reserve) {
+		result = swap_reserve_ahead(npages, &reserved);
+		if (result != 0) {
+			return NULL;
+		}
 	}
 
 	vmo = kmalloc(sizeof(struct vm_object));
 	if (vmo == NULL) {
-		swap_unreserve(npages);
-		return NULL;
+		goto fail;
 	}
 
-	vmo->vmo_lpages = lpage_array_create();
+	vmo->vmo_lpages = lpage_table_create();
 	if (vmo->vmo_lpages == NULL) {
 		kfree(vmo);
-		swap_unreserve(npages);
-		return NULL;
+		goto fail;
 	}
 
 	vmo->vmo_base = 0xdeafbeef;		/* make sure these */
 	vmo->vmo_lower_redzone = 0xdeafbeef;	/* get filled in later */
 
+	vmo->vmo_vnode = NULL;
+	vmo->vmo_fileoff = 0;
+	vmo->vmo_filestart = 0;
+	vmo->vmo_filesize = 0;
+	vmo->vmo_writeable = true;
+	vmo->vmo_reserved = reserved;
+	vmo->vmo_shared = false;
+	vmo->vmo_text = false;
+	vmo->vmo_refcount = 1;
+	vmo->vmo_lock = NULL;
+
 	/* add the requested number of zerofilled pages */
-	result = lpage_array_setsize(vmo->vmo_lpages, npages);
+	result = lpage_table_setsize(vmo->vmo_lpages, npages);
 	if (result) {
-		lpage_array_destroy(vmo->vmo_lpages);
+		lpage_table_destroy(vmo->vmo_lpages);
 		kfree(vmo);
+		goto fail;
+	}
+
+	return vmo;
+
+fail:
+	if (reserved) {
 		swap_unreserve(npages);
+	}
+	return NULL;
+}
+
+/*
+ * vm_object_create: Allocate a new vm_object with nothing in it.
+ * Returns: new vm_object on success, NULL on error.
+ */
+struct vm_object *
+vm_object_create(size_t npages)
+{
+	return vm_object_init(npages, true);
+}
+
+/*
+ * vm_object_create_vnode: Allocate a new vm_object whose contents come
+ * from FILESIZE bytes of the file V starting at FILEOFF, which land
+ * FILESTART bytes into the object. The rest is zero. If WRITEABLE is
+ * false the object reserves no swap.
+ *
+ * Takes its own reference to V.
+ * Returns: new vm_object on success, NULL on error.
+ */
+struct vm_object *
+vm_object_create_vnode(size_t npages, struct vnode *v, off_t fileoff,
+		       size_t filestart, size_t filesize, bool writeable)
+{
+	struct vm_object *vmo;
+
+	KASSERT(v != NULL);
+	KASSERT(filestart + filesize <= npages * PAGE_SIZE);
+
+	vmo = vm_object_init(npages, writeable);
+	if (vmo == NULL) {
 		return NULL;
 	}
 
-	for (i=0; i<npages; i++) {
-		lpage_array_set(vmo->vmo_lpages, i, NULL);
+	VOP_INCREF(v);
+	vmo->vmo_vnode = v;
+	vmo->vmo_fileoff = fileoff;
+	vmo->vmo_filestart = filestart;
+	vmo->vmo_filesize = filesize;
+	vmo->vmo_writeable = writeable;
+
+	return vmo;
+}
+
+/*
+ * vm_object_setshared: mark a new vm_object as shared, so that fork
+ * shares it instead of copying it.
+ */
+int
+vm_object_setshared(struct vm_object *vmo)
+{
+	KASSERT(!vmo->vmo_shared);
+
+	vmo->vmo_lock = lock_create("vm_object");
+	if (vmo->vmo_lock == NULL) {
+		return ENOMEM;
 	}
+	vmo->vmo_shared = true;
+	return 0;
+}
 
+/*
+ * vm_object_gettext: get the shared object for NPAGES pages at BASE
+ * holding FILESIZE bytes of the file V at FILEOFF, FILESTART bytes
+ * in, read-only. If some other address space already has one just
+ * like it, take another reference to that; otherwise make a new one
+ * and list it for others to find.
+ *
+ * Synchronization: vm_text_lock, then the object's vmo_lock.
+ * Returns: the object on success, NULL on error.
+ */
+struct vm_object *
+vm_object_gettext(size_t npages, vaddr_t base, struct vnode *v,
+		  off_t fileoff, size_t filestart, size_t filesize)
+{
+	struct vm_object *vmo;
+	unsigned i;
+	int result;
+
+	lock_acquire(vm_text_lock);
+	for (i=0; i<array_num(&vm_text_objects); i++) {
+		vmo = array_get(&vm_text_objects, i);
+		if (vmo->vmo_vnode == v && vmo->vmo_base == base &&
+		    vmo->vmo_fileoff == fileoff &&
+		    vmo->vmo_filestart == filestart &&
+		    vmo->vmo_filesize == filesize &&
+		    lpage_table_num(vmo->vmo_lpages) == npages) {
+			lock_acquire(vmo->vmo_lock);
+			KASSERT(vmo->vmo_refcount > 0);
+			vmo->vmo_refcount++;
+			lock_release(vmo->vmo_lock);
+			ct_text_shares++;
+			lock_release(vm_text_lock);
+			return vmo;
+		}
+	}
+
+	vmo = vm_object_create_vnode(npages, v, fileoff, filestart, filesize,
+				     false);
+	if (vmo == NULL) {
+		lock_release(vm_text_lock);
+		return NULL;
+	}
+	vmo->vmo_base = base;
+	vmo->vmo_lower_redzone = 0;
+
+	result = vm_object_setshared(vmo);
+	if (result == 0) {
+		result = array_add(&vm_text_objects, vmo, NULL);
+	}
+	if (result) {
+		lock_release(vm_text_lock);
+		vm_object_destroy(NULL, vmo);
+		return NULL;
+	}
+	vmo->vmo_text = true;
+
+	lock_release(vm_text_lock);
 	return vmo;
 }
 
 /*
  * vm_object_copy: clone a vm_object.
  *
- * Synchronization: None; lpage_copy does the hard stuff.
+ * Nothing is copied: every lpage is shared copy-on-write with the
+ * new object, and the first write through either side splits it (see
+ * lpage_fault). The new object's swap reservation for each shared
+ * slot stays reserved until then. If the new object didn't reserve
+ * swap up front (see vm_object_init), those are reserved here.
+ *
+ * A shared object isn't cloned at all; the new address space gets
+ * another reference to it.
+ *
+ * The caller has to take away VMO's writable mappings afterwards;
+ * as_copy does them all at once with mmu_writeprotect.
+ *
+ * Synchronization: None beyond the lpage locks.
  */
 int
 vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 	       struct vm_object **ret)
 {
 	struct vm_object *newvmo;
-
-	struct lpage *newlp, *lp;
-	unsigned j;
+	struct lpage *lp;
+	unsigned j, num, nshared;
 	int result;
 
-	newvmo = vm_object_create(lpage_array_num(vmo->vmo_lpages));
+	if (vmo->vmo_shared) {
+		lock_acquire(vmo->vmo_lock);
+		vmo->vmo_refcount++;
+		lock_release(vmo->vmo_lock);
+		*ret = vmo;
+		return 0;
+	}
+
+	if (vmo->vmo_vnode != NULL) {
+		newvmo = vm_object_create_vnode(
+			lpage_table_num(vmo->vmo_lpages), vmo->vmo_vnode,
+			vmo->vmo_fileoff, vmo->vmo_filestart,
+			vmo->vmo_filesize, vmo->vmo_writeable);
+	}
+	else {
+		newvmo = vm_object_create(lpage_table_num(vmo->vmo_lpages));
+	}
 	if (newvmo == NULL) {
 		return ENOMEM;
 	}
@@ -114,31 +474,45 @@ vm_object_copy(struct vm_object *vmo, struct addrspace *newas,
 	newvmo->vmo_base = vmo->vmo_base;
 	newvmo->vmo_lower_redzone = vmo->vmo_lower_redzone;
 
-	for (j = 0; j < lpage_array_num(vmo->vmo_lpages); j++) {
-		lp = lpage_array_get(vmo->vmo_lpages, j);
-		newlp = lpage_array_get(newvmo->vmo_lpages, j);
-
-		/* new guy should be initialized to all zerofill */
-		KASSERT(newlp == NULL);
-
-		if (lp == NULL) {
-			/* old guy is zerofill too, don't do anything */
-			continue;
+	/*
+	 * Untouched (zerofill) pages are NULL on both sides, so only
+	 * the slots with lpages need looking at. Give the new guy the
+	 * chunks it needs first, so we can't fail halfway through
+	 * sharing.
+	 */
+	num = lpage_table_num(vmo->vmo_lpages);
+	nshared = 0;
+	for (j = lpage_table_next(vmo->vmo_lpages, 0); j < num;
+	     j = lpage_table_next(vmo->vmo_lpages, j+1)) {
+		result = lpage_table_prepare(newvmo->vmo_lpages, j);
+		if (result) {
+			vm_object_destroy(newas, newvmo);
+			return result;
 		}
-
-		result = lpage_copy(lp, &newlp);
+		nshared++;
+	}
+	if (nshared > 0 && !newvmo->vmo_reserved &&
+	    vm_object_holds_swap(newvmo)) {
+		result = swap_reserve(nshared);
 		if (result) {
-			goto fail;
+			vm_object_destroy(newas, newvmo);
+			return result;
 		}
-		lpage_array_set(newvmo->vmo_lpages, j, newlp);
+	}
+
+	for (j = lpage_table_next(vmo->vmo_lpages, 0); j < num;
+	     j = lpage_table_next(vmo->vmo_lpages, j+1)) {
+		lp = lpage_table_get(vmo->vmo_lpages, j);
+
+		/* new guy should be initialized to all zerofill */
+		KASSERT(lpage_table_get(newvmo->vmo_lpages, j) == NULL);
+
+		lpage_share(lp);
+		lpage_table_set(newvmo->vmo_lpages, j, lp);
 	}
 
 	*ret = newvmo;
 	return 0;
-
- fail:
-	vm_object_destroy(newas, newvmo);
-	return result;
 }
 
 /*
@@ -148,64 +522,320 @@ int
 vm_object_setsize(struct addrspace *as, struct vm_object *vmo, unsigned npages)
 {
 	int result;
-	unsigned i;
+	unsigned num, nzero, i;
 	struct lpage *lp;
 
 	KASSERT(vmo != NULL);
 	KASSERT(vmo->vmo_lpages != NULL);
 
-	if (npages < lpage_array_num(vmo->vmo_lpages)) {
-		for (i=npages; i<lpage_array_num(vmo->vmo_lpages); i++) {
-			lp = lpage_array_get(vmo->vmo_lpages, i);
-			if (lp != NULL) {
-				KASSERT(as != NULL);
-				/* remove any tlb entry for this mapping */
-				mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
-				lpage_destroy(lp);
-			}
-			else {
-				swap_unreserve(1);
-			}
+	num = lpage_table_num(vmo->vmo_lpages);
+	if (npages < num) {
+		if (as != NULL) {
+			/* the pages going away may be mapped to zeros */
+			mmu_unmap_zero(as);
+		}
+		nzero = num - npages;
+		for (i = lpage_table_next(vmo->vmo_lpages, npages); i < num;
+		     i = lpage_table_next(vmo->vmo_lpages, i+1)) {
+			lp = lpage_table_get(vmo->vmo_lpages, i);
+			KASSERT(as != NULL);
+			/* remove any tlb entry for this mapping */
+			mmu_unmap(as, vmo->vmo_base+PAGE_SIZE*i);
+			lpage_destroy(lp);
+			nzero--;
 		}
-		result = lpage_array_setsize(vmo->vmo_lpages, npages);
-		/* shrinking an array shouldn't fail */
+		/* the untouched ones may still hold their reservation */
+		if (nzero > 0 && vmo->vmo_reserved) {
+			swap_unreserve(nzero);
+		}
+		result = lpage_table_setsize(vmo->vmo_lpages, npages);
+		/* shrinking a table shouldn't fail */
 		KASSERT(result==0);
 	}
-	else if (npages > lpage_array_num(vmo->vmo_lpages)) {
-		int oldsize = lpage_array_num(vmo->vmo_lpages);
-		unsigned newpages = npages - oldsize;
+	else if (npages > num) {
+		unsigned newpages = npages - num;
 
-		result = swap_reserve(newpages);
-		if (result) {
-			return result;
+		if (vmo->vmo_reserved) {
+			result = swap_reserve(newpages);
+			if (result) {
+				return result;
+			}
 		}
 
-		result = lpage_array_setsize(vmo->vmo_lpages, npages);
+		result = lpage_table_setsize(vmo->vmo_lpages, npages);
 		if (result) {
-			swap_unreserve(newpages);
+			if (vmo->vmo_reserved) {
+				swap_unreserve(newpages);
+			}
 			return result;
 		}
-		for (i=oldsize; i<npages; i++) {
-			lpage_array_set(vmo->vmo_lpages, i, NULL);
-		}
 	}
 	return 0;
 }
 
 /*
- * vm_object_destroy: Deallocates a vm_object.
+ * vm_object_destroy: Deallocates a vm_object, or for a shared one,
+ * drops AS's reference to it. A shared writeable file object is
+ * written back to the file first.
  *
- * Synchronization: none; assumes one thread uniquely owns the object.
+ * Synchronization: none; assumes one thread uniquely owns the object,
+ * except for shared objects, which are locked.
  */
 void 					
 vm_object_destroy(struct addrspace *as, struct vm_object *vmo)
 {
+	unsigned num, i;
 	int result;
 
+	if (vmo->vmo_shared) {
+		/* a text object has to come off the list atomically */
+		if (vmo->vmo_text) {
+			lock_acquire(vm_text_lock);
+		}
+		lock_acquire(vmo->vmo_lock);
+		KASSERT(vmo->vmo_refcount > 0);
+		vmo->vmo_refcount--;
+		if (vmo->vmo_refcount > 0) {
+			/* Just get rid of our own mappings. */
+			num = lpage_table_num(vmo->vmo_lpages);
+			for (i = lpage_table_next(vmo->vmo_lpages, 0);
+			     i < num && as != NULL;
+			     i = lpage_table_next(vmo->vmo_lpages, i+1)) {
+				mmu_unmap(as, vmo->vmo_base + PAGE_SIZE*i);
+			}
+			lock_release(vmo->vmo_lock);
+			if (vmo->vmo_text) {
+				lock_release(vm_text_lock);
+			}
+			return;
+		}
+		lock_release(vmo->vmo_lock);
+
+		if (vmo->vmo_text) {
+			num = array_num(&vm_text_objects);
+			for (i=0; i<num; i++) {
+				if (array_get(&vm_text_objects, i) == vmo) {
+					array_remove(&vm_text_objects, i);
+					break;
+				}
+			}
+			KASSERT(i < num);
+			lock_release(vm_text_lock);
+		}
+
+		if (vmo->vmo_vnode != NULL && vmo->vmo_writeable) {
+			result = vm_object_sync(vmo, 0,
+				       lpage_table_num(vmo->vmo_lpages));
+			if (result) {
+				kprintf("vm: writing back mapped file: %s\n",
+					strerror(result));
+			}
+		}
+		lock_destroy(vmo->vmo_lock);
+	}
+
 	result = vm_object_setsize(as, vmo, 0);
 	KASSERT(result==0);
+
+	if (vmo->vmo_vnode != NULL) {
+		VOP_DECREF(vmo->vmo_vnode);
+	}
 	
-	lpage_array_destroy(vmo->vmo_lpages);
+	lpage_table_destroy(vmo->vmo_lpages);
 	kfree(vmo);
 }
 
+
+/*
+ * vm_object_backing: fill in VB with where the file data for page
+ * INDEX of a file-backed vm_object is. The page may have none, in
+ * which case vb_len is 0.
+ */
+void
+vm_object_backing(struct vm_object *vmo, unsigned index,
+		  struct vm_backing *vb)
+{
+	size_t pagestart, pageend, start, end;
+
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(index < lpage_table_num(vmo->vmo_lpages));
+
+	pagestart = index * PAGE_SIZE;
+	pageend = pagestart + PAGE_SIZE;
+	start = vmo->vmo_filestart;
+	end = start + vmo->vmo_filesize;
+	if (start < pagestart) {
+		start = pagestart;
+	}
+	if (end > pageend) {
+		end = pageend;
+	}
+
+	vb->vb_vnode = vmo->vmo_vnode;
+	if (start >= end) {
+		vb->vb_offset = 0;
+		vb->vb_skip = 0;
+		vb->vb_len = 0;
+		return;
+	}
+	vb->vb_offset = vmo->vmo_fileoff + (start - vmo->vmo_filestart);
+	vb->vb_skip = start - pagestart;
+	vb->vb_len = end - start;
+}
+
+/*
+ * vm_object_sync: write pages FIRST through LAST-1 of a shared
+ * writeable file-backed vm_object back to the file.
+ *
+ * We don't track which pages were written since they were read in
+ * (LPF_DIRTY is about the swap copy, and is lost on eviction), so
+ * every page that has been touched is written.
+ *
+ * Synchronization: the caller holds vmo_lock, or has the last
+ * reference.
+ */
+int
+vm_object_sync(struct vm_object *vmo, unsigned first, unsigned last)
+{
+	struct vm_backing vb;
+	struct lpage *lp;
+	unsigned i;
+	int result;
+
+	KASSERT(vmo->vmo_shared);
+	KASSERT(vmo->vmo_vnode != NULL);
+	KASSERT(last <= lpage_table_num(vmo->vmo_lpages));
+
+	for (i = lpage_table_next(vmo->vmo_lpages, first); i < last;
+	     i = lpage_table_next(vmo->vmo_lpages, i+1)) {
+		lp = lpage_table_get(vmo->vmo_lpages, i);
+		vm_object_backing(vmo, i, &vb);
+		result = lpage_writefile(lp, &vb);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * vm_object_readahead: called after a major fault on page INDEX. Pages
+ * that follow it in the object and also follow it in swap are likely
+ * to be wanted next (the object was probably written out in order),
+ * and reading them along with it costs little more than one I/O. Read
+ * in as many as the readahead window allows, stopping at the first
+ * one that isn't a match.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+void
+vm_object_readahead(struct vm_object *vmo, unsigned index)
+{
+	struct lpage *lps[SWAP_CLUSTER_MAX];
+	struct lpage *lp;
+	off_t base, swa;
+	unsigned window, num, n, i;
+	bool match;
+
+	window = lpage_readahead_window();
+	KASSERT(window <= SWAP_CLUSTER_MAX);
+	num = lpage_table_num(vmo->vmo_lpages);
+
+	lp = lpage_table_get(vmo->vmo_lpages, index);
+	lpage_lock(lp);
+	base = lp->lp_swapaddr;
+	lpage_unlock(lp);
+
+	if (base == INVALID_SWAPADDR) {
+		/* read in from a file; nothing to go on */
+		return;
+	}
+	base += PAGE_SIZE;
+
+	n = 0;
+	for (i = index+1; i < num && n < window; i++) {
+		lp = lpage_table_get(vmo->vmo_lpages, i);
+		if (lp == NULL) {
+			break;
+		}
+		swa = base + n * PAGE_SIZE;
+
+		lpage_lock(lp);
+		match = (lp->lp_paddr & PAGE_FRAME) == INVALID_PADDR &&
+			lp->lp_swapaddr == swa;
+		lpage_unlock(lp);
+
+		if (!match) {
+			break;
+		}
+		lps[n++] = lp;
+	}
+
+	if (n > 0) {
+		lpage_readahead(lps, n, base);
+	}
+}
+
+/*
+ * vm_object_faultaround: map whatever is already resident in the
+ * aligned block of FAULTAROUND_PAGES pages around page INDEX, so
+ * touching those pages doesn't each cost a trip through vm_fault.
+ * Nothing is read in. Not used for shared objects.
+ *
+ * Synchronization: none; assumes one thread uniquely owns the object.
+ */
+void
+vm_object_faultaround(struct vm_object *vmo, struct addrspace *as,
+		      unsigned index)
+{
+	struct lpage *lp;
+	unsigned first, last, i;
+
+	KASSERT(!vmo->vmo_shared);
+
+	first = index & ~(FAULTAROUND_PAGES - 1);
+	last = first + FAULTAROUND_PAGES;
+	if (last > lpage_table_num(vmo->vmo_lpages)) {
+		last = lpage_table_num(vmo->vmo_lpages);
+	}
+
+	for (i = first; i < last; i++) {
+		if (i == index) {
+			continue;
+		}
+		lp = lpage_table_get(vmo->vmo_lpages, i);
+		if (lp == NULL) {
+			continue;
+		}
+		lpage_premap(lp, as, vmo->vmo_base + i * PAGE_SIZE);
+	}
+}
+
+/*
+ * vm_object_bootstrap: set up the shared text list.
+ */
+void
+vm_object_bootstrap(void)
+{
+	vm_text_lock = lock_create("vmtext");
+	if (vm_text_lock == NULL) {
+		panic("vm_object_bootstrap: Out of memory\n");
+	}
+	array_init(&vm_text_objects);
+}
+
+/*
+ * vm_object_printstats: print shared text stats.
+ */
+void
+vm_object_printstats(void)
+{
+	unsigned num;
+
+	lock_acquire(vm_text_lock);
+	num = array_num(&vm_text_objects);
+	lock_release(vm_text_lock);
+
+	kprintf("vm: shared text: %u objects, %lu times shared\n", num,
+		(unsigned long) ct_text_shares);
+}
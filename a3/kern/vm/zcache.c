@@ -0,0 +1,623 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vm.h>
+#include <vmprivate.h>
+#include <machine/coremap.h>
+
+/*
+ * zcache.c - compressed swap cache.
+ *
+ * Pages on their way out to swap are compressed (lz_compress) and
+ * kept in a pool of kernel pages instead of being written to disk.
+ * Paging them back in is then a decompression rather than a disk
+ * read. When the pool fills up, the least recently used pages in it
+ * are written back to their swap pages on disk to make room.
+ *
+ * The pool is indexed by swap address: a page in the cache has its
+ * swap page allocated as usual, but what's on disk there is stale
+ * until the entry is written back. So the cache entry is the real
+ * copy; swap_pagein and swap_pagein_cluster check here first, and
+ * swap_free drops the entry along with the swap page. An entry stays
+ * after it's paged in, because the lpage is clean afterwards and can
+ * be dropped again without a pageout on the strength of it.
+ *
+ * Compressed pages are stored in ZC_CHUNKSIZE-byte chunks chained
+ * together, so the pool doesn't fragment. Pages that don't compress
+ * to ZC_MAXLEN or less aren't worth keeping and go to disk.
+ *
+ * Everything is allocated at boot: we get here from the pageout path,
+ * which is trying to free memory, so kmalloc isn't an option.
+ *
+ * Synchronization: zc_lock, a sleep lock, protects everything but the
+ * stats. It's only held while compressing and copying, never across
+ * I/O. A write-back takes the LRU entry out of the pool, decompressed
+ * into zc_bounce, and drops the lock for the disk write; zc_wbindex
+ * says which swap page is in flight meanwhile. A load of that page is
+ * served from zc_bounce, and anything that would free or rewrite it
+ * waits on zc_wbcv for the write to finish, so an old write-back can't
+ * land on top of newer contents. There's one write-back at a time;
+ * a store that needs room while one is going waits for it too.
+ *
+ * Stores make room for the largest compressed page before they
+ * compress, since zc_cbuf can't be left holding a page while the lock
+ * is dropped.
+ */
+
+#define ZC_CHUNKSIZE	128
+#define ZC_CHUNKSPERPAGE (PAGE_SIZE / ZC_CHUNKSIZE)
+#define ZC_MAXLEN	(PAGE_SIZE * 3 / 4)
+#define ZC_MAXCHUNKS	DIVROUNDUP(ZC_MAXLEN, ZC_CHUNKSIZE)
+#define ZC_NONE		0xffffffff
+
+/* One compressed page. A free entry has ze_swapindex 0. */
+struct zentry {
+	uint32_t ze_swapindex;		/* swap address / PAGE_SIZE */
+	uint32_t ze_chunk;		/* first chunk */
+	uint32_t ze_len;		/* compressed length */
+	uint32_t ze_hashnext;		/* next in hash chain (or free list) */
+	uint32_t ze_lruprev;		/* toward most recently used */
+	uint32_t ze_lrunext;		/* toward least recently used */
+};
+
+/*
+ * Data.
+ */
+static struct lock *zc_lock;
+static struct cv *zc_wbcv;
+static uint32_t zc_wbindex;		/* being written back, or 0 */
+
+static vaddr_t *zc_pages;		/* pool pages */
+static unsigned zc_npages;
+static uint32_t *zc_chunknext;		/* chunk chains */
+static uint32_t zc_nchunks;
+static uint32_t zc_freechunk;		/* free chunk list */
+static uint32_t zc_nfreechunks;
+
+static struct zentry *zc_entries;	/* one per chunk is enough */
+static uint32_t zc_freeentry;		/* free list, via ze_hashnext */
+static uint32_t *zc_hash;
+static uint32_t zc_hashsize;		/* a power of 2 */
+static uint32_t zc_lruhead, zc_lrutail;
+
+static void *zc_work;			/* for lz_compress */
+static char *zc_cbuf;			/* compressed page being stored */
+static char *zc_tmp;			/* compressed page being read */
+static char *zc_bounce;			/* page being written back */
+
+/*
+ * Stats. Protected by zc_stats_spinlock.
+ */
+static struct spinlock zc_stats_spinlock = SPINLOCK_INITIALIZER;
+static volatile uint32_t ct_zc_stores;
+static volatile uint32_t ct_zc_incompressible;
+static volatile uint64_t ct_zc_inbytes;		/* of pages stored */
+static volatile uint64_t ct_zc_outbytes;	/* what they came to */
+static volatile uint32_t ct_zc_hits;
+static volatile uint32_t ct_zc_misses;
+static volatile uint32_t ct_zc_writebacks;
+
+/*
+ * zcache_bootstrap: set up a pool of NPAGES pages. If there's no
+ * memory for it, run without one.
+ *
+ * Synchronization: none; runs during boot.
+ */
+void
+zcache_bootstrap(unsigned npages)
+{
+	uint32_t i;
+
+	zc_lock = lock_create("zcache");
+	zc_wbcv = cv_create("zcache");
+	if (zc_lock == NULL || zc_wbcv == NULL) {
+		panic("zcache: No memory for lock\n");
+	}
+	zc_freechunk = ZC_NONE;
+	zc_freeentry = ZC_NONE;
+	zc_lruhead = zc_lrutail = ZC_NONE;
+
+	if (npages == 0) {
+		return;
+	}
+
+	zc_pages = kmalloc(npages * sizeof(zc_pages[0]));
+	zc_chunknext = kmalloc(npages * ZC_CHUNKSPERPAGE * sizeof(uint32_t));
+	zc_entries = kmalloc(npages * ZC_CHUNKSPERPAGE *
+			     sizeof(struct zentry));
+	zc_hashsize = 1;
+	while (zc_hashsize < npages * ZC_CHUNKSPERPAGE / 4) {
+		zc_hashsize *= 2;
+	}
+	zc_hash = kmalloc(zc_hashsize * sizeof(uint32_t));
+	zc_work = kmalloc(LZ_WORKSIZE);
+	zc_cbuf = kmalloc(ZC_MAXLEN);
+	zc_tmp = kmalloc(ZC_MAXLEN);
+	zc_bounce = kmalloc(PAGE_SIZE);
+	if (zc_pages == NULL || zc_chunknext == NULL || zc_entries == NULL ||
+	    zc_hash == NULL || zc_work == NULL || zc_cbuf == NULL ||
+	    zc_tmp == NULL || zc_bounce == NULL) {
+		kprintf("zcache: No memory; not caching swap\n");
+		return;
+	}
+
+	for (zc_npages = 0; zc_npages < npages; zc_npages++) {
+		zc_pages[zc_npages] = alloc_kpages(1);
+		if (zc_pages[zc_npages] == 0) {
+			break;
+		}
+	}
+	zc_nchunks = zc_npages * ZC_CHUNKSPERPAGE;
+	if (zc_nchunks < ZC_MAXCHUNKS) {
+		kprintf("zcache: No memory; not caching swap\n");
+		zc_nchunks = 0;
+		return;
+	}
+
+	for (i=0; i<zc_nchunks; i++) {
+		zc_chunknext[i] = zc_freechunk;
+		zc_freechunk = i;
+		zc_entries[i].ze_swapindex = 0;
+		zc_entries[i].ze_hashnext = zc_freeentry;
+		zc_freeentry = i;
+	}
+	zc_nfreechunks = zc_nchunks;
+	for (i=0; i<zc_hashsize; i++) {
+		zc_hash[i] = ZC_NONE;
+	}
+
+	kprintf("zcache: %u pages (%uk) for compressed swap\n",
+		zc_npages, zc_npages * PAGE_SIZE / 1024);
+}
+
+static
+uint32_t
+zc_hashfn(uint32_t swapindex)
+{
+	return (swapindex * 2654435761U) & (zc_hashsize - 1);
+}
+
+static
+char *
+zc_chunkaddr(uint32_t chunk)
+{
+	return (char *)zc_pages[chunk / ZC_CHUNKSPERPAGE] +
+		(chunk % ZC_CHUNKSPERPAGE) * ZC_CHUNKSIZE;
+}
+
+/*
+ * Find the entry for a swap page, or ZC_NONE.
+ */
+static
+uint32_t
+zc_lookup(uint32_t swapindex)
+{
+	uint32_t e;
+
+	KASSERT(lock_do_i_hold(zc_lock));
+	if (zc_nchunks == 0) {
+		return ZC_NONE;
+	}
+	e = zc_hash[zc_hashfn(swapindex)];
+	while (e != ZC_NONE && zc_entries[e].ze_swapindex != swapindex) {
+		e = zc_entries[e].ze_hashnext;
+	}
+	return e;
+}
+
+/*
+ * LRU list operations.
+ */
+static
+void
+zc_lru_remove(uint32_t e)
+{
+	struct zentry *ze = &zc_entries[e];
+
+	if (ze->ze_lruprev == ZC_NONE) {
+		zc_lruhead = ze->ze_lrunext;
+	}
+	else {
+		zc_entries[ze->ze_lruprev].ze_lrunext = ze->ze_lrunext;
+	}
+	if (ze->ze_lrunext == ZC_NONE) {
+		zc_lrutail = ze->ze_lruprev;
+	}
+	else {
+		zc_entries[ze->ze_lrunext].ze_lruprev = ze->ze_lruprev;
+	}
+}
+
+static
+void
+zc_lru_addhead(uint32_t e)
+{
+	struct zentry *ze = &zc_entries[e];
+
+	ze->ze_lruprev = ZC_NONE;
+	ze->ze_lrunext = zc_lruhead;
+	if (zc_lruhead == ZC_NONE) {
+		zc_lrutail = e;
+	}
+	else {
+		zc_entries[zc_lruhead].ze_lruprev = e;
+	}
+	zc_lruhead = e;
+}
+
+/*
+ * Remove an entry and free its chunks.
+ */
+static
+void
+zc_drop(uint32_t e)
+{
+	struct zentry *ze = &zc_entries[e];
+	uint32_t *pp, c, next;
+
+	KASSERT(ze->ze_swapindex != 0);
+
+	pp = &zc_hash[zc_hashfn(ze->ze_swapindex)];
+	while (*pp != e) {
+		KASSERT(*pp != ZC_NONE);
+		pp = &zc_entries[*pp].ze_hashnext;
+	}
+	*pp = ze->ze_hashnext;
+
+	zc_lru_remove(e);
+
+	for (c = ze->ze_chunk; c != ZC_NONE; c = next) {
+		next = zc_chunknext[c];
+		zc_chunknext[c] = zc_freechunk;
+		zc_freechunk = c;
+		zc_nfreechunks++;
+	}
+
+	ze->ze_swapindex = 0;
+	ze->ze_hashnext = zc_freeentry;
+	zc_freeentry = e;
+}
+
+/*
+ * Copy an entry's compressed data out of its chunks into zc_tmp.
+ */
+static
+void
+zc_gather(uint32_t e)
+{
+	struct zentry *ze = &zc_entries[e];
+	uint32_t c, done, n;
+
+	done = 0;
+	for (c = ze->ze_chunk; c != ZC_NONE; c = zc_chunknext[c]) {
+		n = ze->ze_len - done;
+		if (n > ZC_CHUNKSIZE) {
+			n = ZC_CHUNKSIZE;
+		}
+		memcpy(zc_tmp + done, zc_chunkaddr(c), n);
+		done += n;
+	}
+	KASSERT(done == ze->ze_len);
+}
+
+/*
+ * Decompress an entry into the page at KVA.
+ */
+static
+void
+zc_unpack(uint32_t e, void *kva)
+{
+	size_t len;
+
+	zc_gather(e);
+	len = lz_decompress(zc_tmp, zc_entries[e].ze_len, kva, PAGE_SIZE);
+	if (len != PAGE_SIZE) {
+		panic("zcache: corrupt page for swap index %u\n",
+		      zc_entries[e].ze_swapindex);
+	}
+}
+
+/*
+ * Write the least recently used entry back to its swap page and drop
+ * it. If a write-back is already going, wait for that one instead.
+ *
+ * Synchronization: called with zc_lock held; drops it for the I/O.
+ */
+static
+void
+zc_writeback(void)
+{
+	uint32_t e, swapindex;
+
+	KASSERT(lock_do_i_hold(zc_lock));
+
+	if (zc_wbindex != 0) {
+		cv_wait(zc_wbcv, zc_lock);
+		return;
+	}
+
+	e = zc_lrutail;
+	KASSERT(e != ZC_NONE);
+	swapindex = zc_entries[e].ze_swapindex;
+
+	zc_unpack(e, zc_bounce);
+	zc_drop(e);
+	zc_wbindex = swapindex;
+
+	lock_release(zc_lock);
+	swap_write_kbuf(zc_bounce, (off_t)swapindex * PAGE_SIZE);
+	lock_acquire(zc_lock);
+
+	KASSERT(zc_wbindex == swapindex);
+	zc_wbindex = 0;
+	cv_broadcast(zc_wbcv, zc_lock);
+
+	spinlock_acquire(&zc_stats_spinlock);
+	ct_zc_writebacks++;
+	spinlock_release(&zc_stats_spinlock);
+}
+
+/*
+ * Wait until swap page SWAPINDEX isn't being written back.
+ */
+static
+void
+zc_wbwait(uint32_t swapindex)
+{
+	KASSERT(lock_do_i_hold(zc_lock));
+
+	while (zc_wbindex == swapindex) {
+		cv_wait(zc_wbcv, zc_lock);
+	}
+}
+
+/*
+ * zcache_store: compress the page at physical address PA and keep it
+ * as the contents of swap page SWAPADDR, writing older pages back to
+ * disk if the pool is full. Returns false if the page doesn't
+ * compress well enough; the caller then writes it to disk itself.
+ *
+ * Synchronization: zc_lock; may wait for a write-back. The caller must
+ * have PA pinned.
+ */
+bool
+zcache_store(paddr_t pa, off_t swapaddr)
+{
+	uint32_t swapindex, e, c, prev, need, done, n;
+	struct zentry *ze;
+	vaddr_t va;
+	size_t len;
+
+	KASSERT(coremap_pageispinned(pa));
+	swapindex = swapaddr / PAGE_SIZE;
+
+	lock_acquire(zc_lock);
+
+	/* an old write-back mustn't land after the caller's own write */
+	zc_wbwait(swapindex);
+
+	/* whatever we had for this swap page is out of date */
+	e = zc_lookup(swapindex);
+	if (e != ZC_NONE) {
+		zc_drop(e);
+	}
+	if (zc_nchunks == 0) {
+		lock_release(zc_lock);
+		return false;
+	}
+
+	/* make room first; this may drop zc_lock */
+	while (zc_nfreechunks < ZC_MAXCHUNKS) {
+		zc_writeback();
+	}
+	KASSERT(zc_lookup(swapindex) == ZC_NONE);
+
+	va = coremap_map_swap_page(pa);
+	len = lz_compress((void *)va, PAGE_SIZE, zc_cbuf, ZC_MAXLEN, zc_work);
+	coremap_unmap_swap_page(va, pa);
+
+	if (len == 0) {
+		lock_release(zc_lock);
+		spinlock_acquire(&zc_stats_spinlock);
+		ct_zc_incompressible++;
+		spinlock_release(&zc_stats_spinlock);
+		return false;
+	}
+
+	need = DIVROUNDUP(len, ZC_CHUNKSIZE);
+	KASSERT(need <= zc_nfreechunks);
+
+	/* every entry uses at least one chunk, so there's a free one */
+	e = zc_freeentry;
+	KASSERT(e != ZC_NONE);
+	ze = &zc_entries[e];
+	zc_freeentry = ze->ze_hashnext;
+
+	ze->ze_swapindex = swapindex;
+	ze->ze_len = len;
+	ze->ze_chunk = ZC_NONE;
+	prev = ZC_NONE;
+	for (done = 0; done < len; done += n) {
+		c = zc_freechunk;
+		zc_freechunk = zc_chunknext[c];
+		zc_nfreechunks--;
+		zc_chunknext[c] = ZC_NONE;
+		if (prev == ZC_NONE) {
+			ze->ze_chunk = c;
+		}
+		else {
+			zc_chunknext[prev] = c;
+		}
+		prev = c;
+
+		n = len - done;
+		if (n > ZC_CHUNKSIZE) {
+			n = ZC_CHUNKSIZE;
+		}
+		memcpy(zc_chunkaddr(c), zc_cbuf + done, n);
+	}
+
+	ze->ze_hashnext = zc_hash[zc_hashfn(swapindex)];
+	zc_hash[zc_hashfn(swapindex)] = e;
+	zc_lru_addhead(e);
+
+	lock_release(zc_lock);
+
+	spinlock_acquire(&zc_stats_spinlock);
+	ct_zc_stores++;
+	ct_zc_inbytes += PAGE_SIZE;
+	ct_zc_outbytes += len;
+	spinlock_release(&zc_stats_spinlock);
+
+	return true;
+}
+
+/*
+ * zcache_load: if swap page SWAPADDR is in the cache, decompress it
+ * into the page at physical address PA and return true. Otherwise
+ * return false; the caller then reads it from disk. A page that's
+ * being written back is copied from the write-back buffer.
+ *
+ * Synchronization: zc_lock, which is never held across I/O. The caller
+ * must have PA pinned.
+ */
+bool
+zcache_load(paddr_t pa, off_t swapaddr)
+{
+	uint32_t e;
+	vaddr_t va;
+
+	KASSERT(coremap_pageispinned(pa));
+
+	lock_acquire(zc_lock);
+	e = zc_lookup(swapaddr / PAGE_SIZE);
+	if (e == ZC_NONE && zc_wbindex != 0 &&
+	    zc_wbindex == swapaddr / PAGE_SIZE) {
+		va = coremap_map_swap_page(pa);
+		memcpy((void *)va, zc_bounce, PAGE_SIZE);
+		coremap_unmap_swap_page(va, pa);
+		lock_release(zc_lock);
+		spinlock_acquire(&zc_stats_spinlock);
+		ct_zc_hits++;
+		spinlock_release(&zc_stats_spinlock);
+		return true;
+	}
+	if (e == ZC_NONE) {
+		lock_release(zc_lock);
+		spinlock_acquire(&zc_stats_spinlock);
+		ct_zc_misses++;
+		spinlock_release(&zc_stats_spinlock);
+		return false;
+	}
+
+	va = coremap_map_swap_page(pa);
+	zc_unpack(e, (void *)va);
+	coremap_unmap_swap_page(va, pa);
+
+	zc_lru_remove(e);
+	zc_lru_addhead(e);
+	lock_release(zc_lock);
+
+	spinlock_acquire(&zc_stats_spinlock);
+	ct_zc_hits++;
+	spinlock_release(&zc_stats_spinlock);
+	return true;
+}
+
+/*
+ * zcache_drop: forget swap page SWAPADDR, if we have it. Called
+ * before the page is freed or overwritten on disk, so if it's being
+ * written back we wait for that to finish.
+ *
+ * Synchronization: zc_lock.
+ */
+void
+zcache_drop(off_t swapaddr)
+{
+	uint32_t e;
+
+	lock_acquire(zc_lock);
+	zc_wbwait(swapaddr / PAGE_SIZE);
+	e = zc_lookup(swapaddr / PAGE_SIZE);
+	if (e != ZC_NONE) {
+		zc_drop(e);
+	}
+	lock_release(zc_lock);
+}
+
+/*
+ * zcache_printstats: print pool usage, compression ratio, hit rate,
+ * and the disk I/O saved. Every hit is a read saved, and every store
+ * a write, unless it was later written back.
+ */
+void
+zcache_printstats(void)
+{
+	uint32_t stores, incomp, hits, misses, wbs, used, total;
+	uint64_t inb, outb;
+	unsigned long saved;
+
+	lock_acquire(zc_lock);
+	used = zc_nchunks - zc_nfreechunks;
+	total = zc_nchunks;
+	lock_release(zc_lock);
+
+	spinlock_acquire(&zc_stats_spinlock);
+	stores = ct_zc_stores;
+	incomp = ct_zc_incompressible;
+	inb = ct_zc_inbytes;
+	outb = ct_zc_outbytes;
+	hits = ct_zc_hits;
+	misses = ct_zc_misses;
+	wbs = ct_zc_writebacks;
+	spinlock_release(&zc_stats_spinlock);
+
+	saved = (unsigned long) hits + stores - wbs;
+
+	kprintf("zcache: %lu of %lu chunks in use (%luk of %luk)\n",
+		(unsigned long) used, (unsigned long) total,
+		(unsigned long) used * ZC_CHUNKSIZE / 1024,
+		(unsigned long) total * ZC_CHUNKSIZE / 1024);
+	kprintf("zcache: %lu pages stored, %lu incompressible, "
+		"%luk compressed to %luk (%lu%%)\n",
+		(unsigned long) stores, (unsigned long) incomp,
+		(unsigned long) (inb / 1024), (unsigned long) (outb / 1024),
+		(unsigned long) (inb > 0 ? outb * 100 / inb : 0));
+	kprintf("zcache: %lu hits, %lu misses (%lu%% hit rate), "
+		"%lu written back\n",
+		(unsigned long) hits, (unsigned long) misses,
+		(unsigned long) (hits + misses > 0 ?
+				 (uint64_t)hits * 100 / (hits + misses) : 0),
+		(unsigned long) wbs);
+	kprintf("zcache: %lu disk I/Os avoided\n", saved);
+}